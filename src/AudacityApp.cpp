@@ -119,6 +119,10 @@ It handles initialization and termination by subclassing wxApp.
 
 #include "import/Import.h"
 
+// IAL: Added to warm up the labeler models and run the labeler benchmark
+#include "labeler/IALLabeler.hpp"
+#include "labeler/IALBenchmark.hpp"
+
 #if defined(EXPERIMENTAL_CRASH_REPORT)
 #include <wx/debugrpt.h>
 #include <wx/evtloop.h>
@@ -1395,6 +1399,11 @@ bool AudacityApp::OnInit()
       temporarywindow.Show(false);
    }
 
+   // IAL: start loading the labeler models in the background while the
+   // first project window is built
+   IALLabeler::configureInference();
+   IALLabeler::warmUpModels();
+
    // Workaround Bug 1377 - Crash after Audacity starts and low disk space warning appears
    // The temporary splash window is closed AND cleaned up, before attempting to create
    // a project and possibly creating a modal warning dialog by doing so.
@@ -1469,6 +1478,14 @@ bool AudacityApp::OnInit()
             SafeMRUOpen(parser->GetParam(i));
          }
 #endif
+
+         // IAL: headless labeler benchmark, over generated tracks and
+         // any files opened above
+         if (parser->Found(wxT("labeler-benchmark")))
+         {
+            wxPrintf(wxT("%s"), RunLabelerBenchmark(*project));
+            QuitAudacity(true);
+         }
       }
    } );
 
@@ -1953,6 +1970,10 @@ std::unique_ptr<wxCmdLineParser> AudacityApp::ParseCommandLine()
    /*i18n-hint: This runs a set of automatic tests on Audacity itself */
    parser->AddSwitch(wxT("t"), wxT("test"), _("run self diagnostics"));
 
+   /*i18n-hint: This runs the automatic labeler over a set of generated
+    *           tracks and prints how fast it went */
+   parser->AddSwitch(wxEmptyString, wxT("labeler-benchmark"), _("run the labeler benchmark and print the results"));
+
    /*i18n-hint: This displays the Audacity version */
    parser->AddSwitch(wxT("v"), wxT("version"), _("display Audacity version"));
 
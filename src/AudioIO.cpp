@@ -3018,6 +3018,11 @@ void AudioIO::FillBuffers()
                // see comment in second handler about guarantee
                newBlocks = mCaptureTracks[i]->Append(temp.ptr(), format, size, 1)
                   || newBlocks;
+
+               // IAL: let the project label the audio as it is recorded
+               if (auto pListener = GetListener())
+                  pListener->OnAudioIOCapturedSamples(
+                     &mCaptureTracks, i, temp.ptr(), format, size);
             } // end loop over capture channels
 
             // Now update the recording shedule position
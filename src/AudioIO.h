@@ -518,6 +518,10 @@ public:
    const std::vector< std::pair<double, double> > &LostCaptureIntervals()
    { return mLostCaptureIntervals; }
 
+   // IAL: The tracks being recorded into, one per input channel
+   const WaveTrackArray &GetCaptureTracks() const
+   { return mCaptureTracks; }
+
    // Used only for testing purposes in alpha builds
    bool mSimulateRecordingErrors{ false };
 
@@ -14,6 +14,7 @@
 #define __AUDACITY_AUDIO_IO_LISTENER__
 
 #include "Audacity.h"
+#include "SampleFormat.h" // IAL: for OnAudioIOCapturedSamples
 
 class AUDACITY_DLL_API AudioIOListener /* not final */ {
 public:
@@ -27,6 +28,11 @@ public:
    virtual void OnAudioIOStopRecording() = 0;
    virtual void OnAudioIONewBlocks(const WaveTrackArray *tracks) = 0;
 
+   // IAL: Added for live labeling.
+   // Called on the buffer thread with samples just appended to a capture track
+   virtual void OnAudioIOCapturedSamples(const WaveTrackArray *tracks,
+      size_t channel, samplePtr buffer, sampleFormat format, size_t len) = 0;
+
    // Commit the addition of temporary recording tracks into the project
    virtual void OnCommitRecording() = 0;
 
@@ -60,6 +60,27 @@ bool DBConnection::ShouldBypass()
    return mBypass;
 }
 
+bool DBConnection::InTransaction() const
+{
+   // No thread has the default id
+   return mTransactionThread == std::this_thread::get_id();
+}
+
+std::unique_lock<std::mutex> DBConnection::LockOutsideTransaction()
+{
+   std::unique_lock<std::mutex> lock(mTransactionMutex);
+   mTransactionCondition.wait(lock, [this]{
+      return !mDB || sqlite3_get_autocommit(mDB);
+   });
+
+   return lock;
+}
+
+void DBConnection::SetTransactionEndCallback(std::function<void()> callback)
+{
+   mTransactionEndCallback = std::move(callback);
+}
+
 void DBConnection::SetError(
    const TranslatableString &msg, const TranslatableString &libraryError)
 {
@@ -100,6 +121,8 @@ bool DBConnection::Open(const char *fileName)
    // (See comments in ProjectFileIO::SaveProject() about threading
    SafeMode();
 
+   mCompressedBlocksMarked = false;
+
    // Kick off the checkpoint thread
    mCheckpointStop = false;
    mCheckpointPending = false;
@@ -165,11 +188,14 @@ bool DBConnection::Close()
    mCheckpointThread.join();
 
    // We're done with the prepared statements
-   for (auto stmt : mStatements)
    {
-      sqlite3_finalize(stmt.second);
+      std::lock_guard<std::mutex> guard(mStatementMutex);
+      for (auto stmt : mStatements)
+      {
+         sqlite3_finalize(stmt.second);
+      }
+      mStatements.clear();
    }
-   mStatements.clear();
 
    // Close the DB
    rc = sqlite3_close(mDB);
@@ -182,6 +208,7 @@ bool DBConnection::Close()
    }
 
    mDB = nullptr;
+   mCompressedBlocksMarked = false;
 
    return true;
 }
@@ -244,10 +271,16 @@ const wxString DBConnection::GetLastMessage() const
 
 sqlite3_stmt *DBConnection::Prepare(enum StatementID id, const char *sql)
 {
+   std::lock_guard<std::mutex> guard(mStatementMutex);
+
    int rc;
 
+   // The same prepared statement must not be used from two threads at
+   // once, so the cache is keyed by the calling thread too
+   StatementIndex ndx(id, std::this_thread::get_id());
+
    // Return an existing statement if it's already been prepared
-   auto iter = mStatements.find(id);
+   auto iter = mStatements.find(ndx);
    if (iter != mStatements.end())
    {
       return iter->second;
@@ -263,15 +296,17 @@ sqlite3_stmt *DBConnection::Prepare(enum StatementID id, const char *sql)
    }
 
    // And remember it
-   mStatements.insert({id, stmt});
+   mStatements.insert({ndx, stmt});
 
    return stmt;
 }
 
 sqlite3_stmt *DBConnection::GetStatement(enum StatementID id)
 {
+   std::lock_guard<std::mutex> guard(mStatementMutex);
+
    // Look it up
-   auto iter = mStatements.find(id);
+   auto iter = mStatements.find(StatementIndex(id, std::this_thread::get_id()));
 
    // It should always be there
    wxASSERT(iter != mStatements.end());
@@ -395,12 +430,16 @@ bool TransactionScope::TransactionStart(const wxString &name)
 {
    char *errmsg = nullptr;
 
+   std::lock_guard<std::mutex> guard(mConnection.GetTransactionMutex());
    int rc = sqlite3_exec(mConnection.DB(),
                          wxT("SAVEPOINT ") + name + wxT(";"),
                          nullptr,
                          nullptr,
                          &errmsg);
 
+   if (rc == SQLITE_OK && mConnection.mTransactionDepth++ == 0)
+      mConnection.mTransactionThread = std::this_thread::get_id();
+
    if (errmsg)
    {
       mConnection.SetDBError(
@@ -454,6 +493,23 @@ bool TransactionScope::TransactionRollback(const wxString &name)
    return rc == SQLITE_OK;
 }
 
+void TransactionScope::TransactionEnd()
+{
+   std::function<void()> callback;
+   {
+      std::lock_guard<std::mutex> guard(mConnection.GetTransactionMutex());
+      if (--mConnection.mTransactionDepth > 0)
+         return;
+      mConnection.mTransactionThread = std::thread::id{};
+      mConnection.mTransactionCondition.notify_all();
+      callback = mConnection.mTransactionEndCallback;
+   }
+
+   // Not with the mutex held, so that the callback may take it
+   if (callback)
+      callback();
+}
+
 TransactionScope::TransactionScope(
    DBConnection &connection, const char *name)
 :  mConnection(connection),
@@ -482,6 +538,8 @@ TransactionScope::~TransactionScope()
          // Do not throw from a destructor!
          // This has to be a no-fail cleanup that does the best that it can.
       }
+      mConnection.SetCompressedBlocksMarked(false);
+      TransactionEnd();
    }
 }
 
@@ -492,6 +550,8 @@ bool TransactionScope::Commit()
       THROW_INCONSISTENCY_EXCEPTION;
 
    mInTrans = !TransactionCommit(mName);
+   if (!mInTrans)
+      TransactionEnd();
 
    return mInTrans;
 }
@@ -14,6 +14,7 @@ Paul Licameli -- split from ProjectFileIO.h
 
 #include <atomic>
 #include <condition_variable>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -25,6 +26,7 @@ struct sqlite3;
 struct sqlite3_stmt;
 class wxString;
 class AudacityProject;
+class TransactionScope;
 
 class DBConnection
 {
@@ -61,11 +63,38 @@ public:
       InsertSampleBlock,
       DeleteSampleBlock,
       GetRootPage,
-      GetDBPage
+      GetDBPage,
+      // IAL: labeler inference cache
+      GetLabelCache,
+      PutLabelCache,
+      GetLabelEmbedding,
+      PutLabelEmbedding
    };
    sqlite3_stmt *GetStatement(enum StatementID id);
    sqlite3_stmt *Prepare(enum StatementID id, const char *sql);
 
+   //! Held while a transaction is opened, so that a batch written in a
+   //! transaction of its own by another thread can't interleave with it
+   std::mutex &GetTransactionMutex() { return mTransactionMutex; }
+
+   //! Whether the calling thread has a TransactionScope open
+   bool InTransaction() const;
+
+   //! Waits until no transaction is open, then holds the transaction mutex,
+   //! so that what is done with it can't join another thread's transaction
+   /*! @pre !InTransaction() */
+   std::unique_lock<std::mutex> LockOutsideTransaction();
+
+   //! Called, on the thread that ended it, as the outermost TransactionScope ends
+   /*! @pre the transaction mutex is held */
+   void SetTransactionEndCallback(std::function<void()> callback);
+
+   //! Whether the file version was already raised for compressed sample
+   //! blocks; forgotten when a transaction rolls back, as that may undo it
+   bool CompressedBlocksMarked() const { return mCompressedBlocksMarked; }
+   void SetCompressedBlocksMarked( bool marked )
+   { mCompressedBlocksMarked = marked; }
+
    void SetBypass( bool bypass );
    bool ShouldBypass();
 
@@ -101,7 +130,24 @@ private:
    std::atomic_bool mCheckpointPending{ false };
    std::atomic_bool mCheckpointActive{ false };
 
-   std::map<enum StatementID, sqlite3_stmt *> mStatements;
+   // Prepared statements are cached per thread: sqlite3_stmt objects
+   // must not be stepped concurrently, and sample blocks are read from
+   // worker threads as well as the main thread
+   std::mutex mStatementMutex;
+   using StatementIndex = std::pair<enum StatementID, std::thread::id>;
+   std::map<StatementIndex, sqlite3_stmt *> mStatements;
+
+   friend TransactionScope;
+   std::mutex mTransactionMutex;
+   //! Notified as the outermost TransactionScope ends
+   std::condition_variable mTransactionCondition;
+   std::function<void()> mTransactionEndCallback;
+   // The thread that has TransactionScopes open, and how many;
+   // changed with mTransactionMutex held
+   std::atomic<std::thread::id> mTransactionThread{ std::thread::id{} };
+   int mTransactionDepth{ 0 };
+
+   std::atomic_bool mCompressedBlocksMarked{ false };
 
    TranslatableString mLastError;
    TranslatableString mLibraryError;
@@ -128,6 +174,7 @@ private:
    bool TransactionStart(const wxString &name);
    bool TransactionCommit(const wxString &name);
    bool TransactionRollback(const wxString &name);
+   void TransactionEnd();
 
    DBConnection &mConnection;
    bool mInTrans;
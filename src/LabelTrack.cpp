@@ -38,6 +38,7 @@ for drawing different aspects of the label and its text box.
 
 #include <stdio.h>
 #include <algorithm>
+#include <iterator>
 #include <limits.h>
 #include <float.h>
 
@@ -80,7 +81,8 @@ LabelTrack::LabelTrack(const LabelTrack &orig) :
    mClipLen(0.0)
 {
    for (auto &original: orig.mLabels) {
-      LabelStruct l { original.selectedRegion, original.title };
+      // IAL: keep the labeler's classes, e.g. in undo states
+      LabelStruct l { original, original.getT0(), original.getT1() };
       mLabels.push_back(l);
    }
 }
@@ -288,6 +290,14 @@ LabelStruct::LabelStruct(const SelectedRegion &region,
    y = 0;
 }
 
+// IAL
+LabelStruct::LabelStruct(const LabelStruct &other, double t0, double t1)
+: LabelStruct(other.selectedRegion, t0, t1, other.title)
+{
+   classes = other.classes;
+   confidences = other.confidences;
+}
+
 void LabelTrack::SetSelected( bool s )
 {
    bool selected = GetSelected();
@@ -564,6 +574,8 @@ bool LabelTrack::HandleXMLTag(const wxChar *tag, const wxChar **attrs)
 
       SelectedRegion selectedRegion;
       wxString title;
+      std::vector<wxString> classes;
+      std::vector<float> confidences;
 
       // loop through attrs, which is a null-terminated list of
       // attribute-value pairs
@@ -585,6 +597,19 @@ bool LabelTrack::HandleXMLTag(const wxChar *tag, const wxChar **attrs)
             ;
          else if (!wxStrcmp(attr, wxT("title")))
             title = strValue;
+         // IAL: the labeler's classes and confidences
+         else if (!wxStrcmp(attr, wxT("classes"))) {
+            for (const auto &className : wxSplit(strValue, wxT(';')))
+               classes.push_back(className);
+         }
+         else if (!wxStrcmp(attr, wxT("confidences"))) {
+            for (const auto &confidence : wxSplit(strValue, wxT(';'))) {
+               double dblValue;
+               if (!Internat::CompatibleToDouble(confidence, &dblValue))
+                  return false;
+               confidences.push_back(float(dblValue));
+            }
+         }
 
       } // while
 
@@ -596,6 +621,8 @@ bool LabelTrack::HandleXMLTag(const wxChar *tag, const wxChar **attrs)
       //   selectedRegion.collapseToT0();
 
       LabelStruct l { selectedRegion, title };
+      l.classes = std::move(classes);
+      l.confidences = std::move(confidences);
       mLabels.push_back(l);
 
       return true;
@@ -654,6 +681,16 @@ void LabelTrack::WriteXML(XMLWriter &xmlFile) const
          .WriteXMLAttributes(xmlFile, wxT("t"), wxT("t1"));
       // PRL: to do: write other selection fields
       xmlFile.WriteAttr(wxT("title"), labelStruct.title);
+      // IAL: the labeler's classes and confidences, if it made this label
+      if (!labelStruct.classes.empty()) {
+         wxArrayString confidences;
+         for (auto confidence : labelStruct.confidences)
+            confidences.push_back(Internat::ToString(confidence, 3));
+         xmlFile.WriteAttr(wxT("classes"),
+            wxJoin(wxArrayString(labelStruct.classes.size(),
+               labelStruct.classes.data()), wxT(';')));
+         xmlFile.WriteAttr(wxT("confidences"), wxJoin(confidences, wxT(';')));
+      }
       xmlFile.EndTag(wxT("label"));
    }
 
@@ -693,37 +730,33 @@ Track::Holder LabelTrack::Copy(double t0, double t1, bool) const
                         labelStruct.RegionRelation(t0, t1, this);
       if (relation == LabelStruct::SURROUNDS_LABEL) {
          LabelStruct l {
-            labelStruct.selectedRegion,
+            labelStruct,
             labelStruct.getT0() - t0,
-            labelStruct.getT1() - t0,
-            labelStruct.title
+            labelStruct.getT1() - t0
          };
          lt->mLabels.push_back(l);
       }
       else if (relation == LabelStruct::WITHIN_LABEL) {
          LabelStruct l {
-            labelStruct.selectedRegion,
+            labelStruct,
             0,
-            t1-t0,
-            labelStruct.title
+            t1-t0
          };
          lt->mLabels.push_back(l);
       }
       else if (relation == LabelStruct::BEGINS_IN_LABEL) {
          LabelStruct l {
-            labelStruct.selectedRegion,
+            labelStruct,
             0,
-            labelStruct.getT1() - t0,
-            labelStruct.title
+            labelStruct.getT1() - t0
          };
          lt->mLabels.push_back(l);
       }
       else if (relation == LabelStruct::ENDS_IN_LABEL) {
          LabelStruct l {
-            labelStruct.selectedRegion,
+            labelStruct,
             labelStruct.getT0() - t0,
-            t1 - t0,
-            labelStruct.title
+            t1 - t0
          };
          lt->mLabels.push_back(l);
       }
@@ -745,10 +778,9 @@ bool LabelTrack::PasteOver(double t, const Track * src)
 
       for (auto &labelStruct: sl->mLabels) {
          LabelStruct l {
-            labelStruct.selectedRegion,
+            labelStruct,
             labelStruct.getT0() + t,
-            labelStruct.getT1() + t,
-            labelStruct.title
+            labelStruct.getT1() + t
          };
          mLabels.insert(mLabels.begin() + pos++, l);
       }
@@ -806,10 +838,9 @@ bool LabelTrack::Repeat(double t0, double t1, int n)
          {
             const LabelStruct &label = mLabels[i];
             LabelStruct l {
-               label.selectedRegion,
+               label,
                label.getT0() + j * tLen,
-               label.getT1() + j * tLen,
-               label.title
+               label.getT1() + j * tLen
             };
 
             // Figure out where to insert
@@ -863,10 +894,9 @@ void LabelTrack::Silence(double t0, double t1)
          // Split label around the selection
          const LabelStruct &label = mLabels[i];
          LabelStruct l {
-            label.selectedRegion,
+            label,
             t1,
-            label.getT1(),
-            label.title
+            label.getT1()
          };
 
          mLabels[i].selectedRegion.setT1(t0);
@@ -941,6 +971,37 @@ int LabelTrack::AddLabel(const SelectedRegion &selectedRegion,
    return pos;
 }
 
+void LabelTrack::AddLabels(LabelArray labels)
+{
+   const auto compare = [](const LabelStruct &a, const LabelStruct &b){
+      return a.getT0() < b.getT0();
+   };
+
+   // Stable, so that labels starting together keep the order they came in
+   std::stable_sort(labels.begin(), labels.end(), compare);
+
+   if (mLabels.empty()) {
+      mLabels = std::move(labels);
+      return;
+   }
+
+   LabelArray merged;
+   merged.reserve(mLabels.size() + labels.size());
+   std::merge(
+      std::make_move_iterator(mLabels.begin()),
+      std::make_move_iterator(mLabels.end()),
+      std::make_move_iterator(labels.begin()),
+      std::make_move_iterator(labels.end()),
+      std::back_inserter(merged), compare);
+   mLabels.swap(merged);
+}
+
+void LabelTrack::SetLabels(LabelArray labels)
+{
+   mLabels.clear();
+   AddLabels(std::move(labels));
+}
+
 void LabelTrack::DeleteLabel(int index)
 {
    wxASSERT((index < (int)mLabels.size()));
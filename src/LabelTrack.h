@@ -35,6 +35,9 @@ public:
    // Copies region but then overwrites other times
    LabelStruct(const SelectedRegion& region, double t0, double t1,
                const wxString &aTitle);
+   // IAL: Copies the whole label, including its classes, but then
+   // overwrites the times
+   LabelStruct(const LabelStruct &other, double t0, double t1);
    const SelectedRegion &getSelectedRegion() const { return selectedRegion; }
    double getDuration() const { return selectedRegion.duration(); }
    double getT0() const { return selectedRegion.t0(); }
@@ -69,6 +72,11 @@ public:
 public:
    SelectedRegion selectedRegion;
    wxString title; /// Text of the label.
+
+   // IAL: the labeler's best guesses for this label, best first, and its
+   // confidence in each.  Empty for labels the labeler didn't make.
+   std::vector<wxString> classes;
+   std::vector<float> confidences;
    mutable int width{}; /// width of the text in pixels.
 
 // Working storage for on-screen layout.
@@ -133,6 +141,14 @@ public:
    //This returns the index of the label we just added.
    int AddLabel(const SelectedRegion &region, const wxString &title);
 
+   // IAL: bulk insertion for the labeler.
+   // Sorts the new labels once and merges them in, in a single pass, so
+   // adding n labels costs O(n log n) rather than O(n^2).  Like Import,
+   // this sends no per-label events.
+   void AddLabels(LabelArray labels);
+   // Replaces all labels with the given ones
+   void SetLabels(LabelArray labels);
+
    //This deletes the label at given index.
    void DeleteLabel(int index);
 
@@ -39,6 +39,8 @@ Paul Licameli split from ProjectManager.cpp
 #include "widgets/MeterPanelBase.h"
 #include "widgets/Warning.h"
 #include "widgets/AudacityMessageBox.h"
+// IAL: Added for live labeling
+#include "labeler/IALLabeler.hpp"
 
 
 static AudacityProject::AttachedObjects::RegisteredFactory
@@ -856,6 +858,10 @@ void ProjectAudioManager::OnAudioIOStartRecording()
 {
    // Auto-save was done here before, but it is unnecessary, provided there
    // are sufficient autosaves when pushing or modifying undo states.
+
+   // IAL: label the audio as it comes in
+   IALLabeler::Get( mProject ).startLiveLabeling(
+      AudioIO::Get()->GetCaptureTracks() );
 }
 
 // This is called after recording has stopped and all tracks have flushed.
@@ -865,6 +871,7 @@ void ProjectAudioManager::OnAudioIOStopRecording()
    auto &projectAudioIO = ProjectAudioIO::Get( project );
    auto &projectFileIO = ProjectFileIO::Get( project );
    auto &window = GetProjectFrame( project );
+   auto &labeler = IALLabeler::Get( project );
 
    // Only push state if we were capturing and not monitoring
    if (projectAudioIO.GetAudioIOToken() > 0)
@@ -873,6 +880,8 @@ void ProjectAudioManager::OnAudioIOStopRecording()
 
       if (IsTimerRecordCancelled()) {
          // discard recording
+         // IAL: along with its live labels
+         labeler.stopLiveLabeling(true);
          history.RollbackState();
          // Reset timer record
          ResetTimerRecordCancelled();
@@ -885,6 +894,9 @@ void ProjectAudioManager::OnAudioIOStopRecording()
          history.PushState(XO("Recorded Audio"), XO("Record"),
             UndoPush::NOAUTOSAVE);
 
+         // IAL: labels that aren't ready yet get an undo state of their own
+         labeler.stopLiveLabeling(false);
+
          // Now, we may add a label track to give information about
          // dropouts.  We allow failure of this.
          auto &tracks = TrackList::Get( project );
@@ -928,6 +940,9 @@ You are saving directly to a slow external storage device\n\
          }
       }
    }
+   else
+      // IAL: the stream failed to start
+      labeler.stopLiveLabeling(true);
 }
 
 void ProjectAudioManager::OnAudioIONewBlocks(const WaveTrackArray *tracks)
@@ -937,10 +952,20 @@ void ProjectAudioManager::OnAudioIONewBlocks(const WaveTrackArray *tracks)
    projectFileIO.AutoSave(true);
 }
 
+// IAL: called on the buffer thread
+void ProjectAudioManager::OnAudioIOCapturedSamples(const WaveTrackArray *tracks,
+   size_t channel, samplePtr buffer, sampleFormat format, size_t len)
+{
+   IALLabeler::Get( mProject ).captureLive( *tracks, channel, buffer, format, len );
+}
+
 void ProjectAudioManager::OnCommitRecording()
 {
    const auto project = &mProject;
    TrackList::Get( *project ).ApplyPendingTracks();
+
+   // IAL: the live labels so far were applied with the recording
+   IALLabeler::Get( *project ).commitLiveLabeling();
 }
 
 void ProjectAudioManager::OnSoundActivationThreshold()
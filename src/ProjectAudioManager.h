@@ -138,6 +138,8 @@ private:
    void OnAudioIOStartRecording() override;
    void OnAudioIOStopRecording() override;
    void OnAudioIONewBlocks(const WaveTrackArray *tracks) override;
+   void OnAudioIOCapturedSamples(const WaveTrackArray *tracks,
+      size_t channel, samplePtr buffer, sampleFormat format, size_t len) override;
    void OnCommitRecording() override;
    void OnSoundActivationThreshold() override;
 
@@ -41,6 +41,12 @@ wxDEFINE_EVENT(EVT_PROJECT_TITLE_CHANGE, wxCommandEvent);
 
 static const int ProjectFileID = ('A' << 24 | 'U' << 16 | 'D' << 8 | 'Y');
 static const int ProjectFileVersion = 1;
+// Sample blocks may be stored compressed by SampleBlockCodec, which older
+// versions would misread. New projects keep ProjectFileVersion until the
+// first compressed block is written
+static const int CompressedBlocksFileVersion = 2;
+// The newest project file version this build can process
+static const int NewestProjectFileVersion = CompressedBlocksFileVersion;
 
 // Navigation:
 //
@@ -111,7 +117,9 @@ static const char *ProjectFileSchema =
    // The quantity of valid data in the blocks is
    // provided in the project blob.
    // 
-   // sampleformat specifies the format of the samples stored.
+   // sampleformat specifies the format of the samples stored.  If they are
+   // compressed, it also holds SampleBlockCodec::CompressedFlag and the
+   // number of samples.
    //
    // blockID is a 64 bit number.
    //
@@ -129,7 +137,21 @@ static const char *ProjectFileSchema =
    "  summary256           BLOB,"
    "  summary64k           BLOB,"
    "  samples              BLOB"
-   ");";
+   ");"
+   ""
+   // CREATE SQL labelcache
+   // IAL: per-frame class probabilities computed by the labeler.
+   // fingerprint identifies the sample blocks under a frame, and
+   // modelhash the model and class list that produced 'probits'
+   // (an array of float32, one per class).
+   // This is only a cache; rows may be deleted at any time.
+   "CREATE TABLE IF NOT EXISTS <schema>.labelcache"
+   "("
+   "  fingerprint          INTEGER,"
+   "  modelhash            INTEGER,"
+   "  probits              BLOB,"
+   "  PRIMARY KEY (fingerprint, modelhash)"
+   ") WITHOUT ROWID;";
 
 // This singleton handles initialization/shutdown of the SQLite library.
 // It is needed because our local SQLite is built with SQLITE_OMIT_AUTOINIT
@@ -280,6 +302,16 @@ sqlite3 *ProjectFileIO::DB()
    return GetConnection().DB();
 }
 
+// The sample block factory may still be inserting new blocks on another
+// thread; the document names them, and a copy or a close needs all of them
+static bool FlushSampleBlocks(AudacityProject &project)
+{
+   return GuardedCall<bool>( [&]{
+      WaveTrackFactory::Get( project ).GetSampleBlockFactory()->Flush();
+      return true;
+   }, MakeSimpleGuard( false ) );
+}
+
 /*!
  @pre *CurConn() does not exist
  @post *CurConn() exists or return value is false
@@ -330,6 +362,9 @@ bool ProjectFileIO::OpenConnection(FilePath fileName /* = {}  */)
 
    SetFileName(fileName);
 
+   // Let the factory reserve block ids in this database ahead of need
+   FlushSampleBlocks(mProject);
+
    return true;
 }
 
@@ -338,6 +373,8 @@ bool ProjectFileIO::CloseConnection()
    auto &curConn = CurrConn();
    wxASSERT(curConn);
 
+   FlushSampleBlocks(mProject);
+
    if (!curConn->Close())
    {
       return false;
@@ -353,6 +390,8 @@ bool ProjectFileIO::CloseConnection()
 // another may be opened with OpenConnection()
 void ProjectFileIO::SaveConnection()
 {
+   FlushSampleBlocks(mProject);
+
    // Should do nothing in proper usage, but be sure not to leak a connection:
    DiscardConnection();
 
@@ -577,7 +616,7 @@ bool ProjectFileIO::CheckVersion()
 
    // Project file version is higher than ours. We will refuse to
    // process it since we can't trust anything about it.
-   if (version > ProjectFileVersion)
+   if (version > NewestProjectFileVersion)
    {
       SetError(
          XO("This project was created with a newer version of Audacity:\n\nYou will need to upgrade to process it")
@@ -595,6 +634,66 @@ bool ProjectFileIO::CheckVersion()
    return true;
 }
 
+// Returns the version in the header of one of the attached databases, or -1
+static int GetFileVersion(sqlite3 *db, const char *schema)
+{
+   int version = -1;
+
+   wxString sql;
+   sql.Printf("PRAGMA %s.user_version;", schema);
+
+   auto cb = [](void *data, int cols, char **vals, char **)
+   {
+      *static_cast<int *>(data) = vals[0] ? (int) wxStrtol<char **>(vals[0], nullptr, 10) : -1;
+      return 0;
+   };
+
+   if (sqlite3_exec(db, sql, cb, &version, nullptr) != SQLITE_OK)
+   {
+      return -1;
+   }
+
+   return version;
+}
+
+// Raises the version in the header of one of the attached databases, but
+// never lowers it. Part of the current transaction, if there is one.
+static bool RequireFileVersion(sqlite3 *db, const char *schema, int version)
+{
+   const int current = GetFileVersion(db, schema);
+   if (current < 0)
+   {
+      return false;
+   }
+
+   if (current >= version)
+   {
+      return true;
+   }
+
+   wxString sql;
+   sql.Printf("PRAGMA %s.user_version = %d;", schema, version);
+
+   return sqlite3_exec(db, sql, nullptr, nullptr, nullptr) == SQLITE_OK;
+}
+
+bool ProjectFileIO::MarkCompressedBlocks(DBConnection &conn)
+{
+   // The version only ever goes up, so once is enough for each connection
+   if (conn.CompressedBlocksMarked())
+   {
+      return true;
+   }
+
+   if (!RequireFileVersion(conn.DB(), "main", CompressedBlocksFileVersion))
+   {
+      return false;
+   }
+
+   conn.SetCompressedBlocksMarked(true);
+   return true;
+}
+
 bool ProjectFileIO::InstallSchema(sqlite3 *db, const char *schema /* = "main" */)
 {
    int rc;
@@ -687,6 +786,11 @@ bool ProjectFileIO::CopyTo(const FilePath &destpath,
    auto pProject = &mProject;
    auto &tracklist = tracks ? *tracks : TrackList::Get(*pProject);
 
+   if (!FlushSampleBlocks(mProject))
+   {
+      return false;
+   }
+
    SampleBlockIDSet blockids;
 
    // Collect all active blockids
@@ -764,6 +868,15 @@ bool ProjectFileIO::CopyTo(const FilePath &destpath,
       return false;
    }
 
+   // The copied blocks may need a newer version than a new project has
+   if (!RequireFileVersion(db, "outbound", GetFileVersion(db, "main")))
+   {
+      SetDBError(
+         XO("Unable to initialize the project file")
+      );
+      return false;
+   }
+
    // Copy over tags (not really used yet)
    rc = sqlite3_exec(db,
                      "INSERT INTO outbound.tags SELECT * FROM main.tags;",
@@ -779,6 +892,15 @@ bool ProjectFileIO::CopyTo(const FilePath &destpath,
       return false;
    }
 
+   // IAL: Copy over cached labeler predictions. This is only a cache, and
+   // projects from before it existed don't have the table, so failure is
+   // not an error.
+   sqlite3_exec(db,
+                "INSERT INTO outbound.labelcache SELECT * FROM main.labelcache;",
+                nullptr,
+                nullptr,
+                nullptr);
+
    {
       // Ensure statement gets cleaned up
       sqlite3_stmt *stmt = nullptr;
@@ -1373,6 +1495,11 @@ bool ProjectFileIO::WriteDoc(const char *table,
    auto db = DB();
    int rc;
 
+   if (!FlushSampleBlocks(mProject))
+   {
+      return false;
+   }
+
    // For now, we always use an ID of 1. This will replace the previously
    // writen row every time.
    char sql[256];
@@ -1438,6 +1565,12 @@ bool ProjectFileIO::ImportProject(const FilePath &fileName)
    bool restore = true;
    int rc;
 
+   // Its own transaction must not overlap a batch of new blocks
+   if (!FlushSampleBlocks(mProject))
+   {
+      return false;
+   }
+
    // Ensure the inbound database gets detached
    auto detach = finally([&]
    {
@@ -1458,6 +1591,16 @@ bool ProjectFileIO::ImportProject(const FilePath &fileName)
       return false;
    }
 
+   // As in CheckVersion, refuse what we can't trust
+   const int inboundVersion = GetFileVersion(db, "inbound");
+   if (inboundVersion > NewestProjectFileVersion)
+   {
+      SetError(
+         XO("This project was created with a newer version of Audacity:\n\nYou will need to upgrade to process it")
+      );
+      return false;
+   }
+
    // We need either the autosave or project docs from the inbound AUP3
    wxMemoryBuffer buffer;
 
@@ -1680,6 +1823,16 @@ bool ProjectFileIO::ImportProject(const FilePath &fileName)
          return false;
       }
 
+      // The imported blocks may be stored in a way that needs a newer version
+      if (!RequireFileVersion(db, "main", inboundVersion))
+      {
+         SetDBError(
+            XO("Failed to import sample block.\nThe following command failed:\n\n%s").Format("PRAGMA main.user_version")
+         );
+         sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+         return false;
+      }
+
       // Go ahead and commit now
       sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
 
@@ -1779,6 +1932,13 @@ bool ProjectFileIO::LoadProject(const FilePath &fileName)
 
       XMLFileReader xmlFile;
 
+      // Read what describes the sample blocks in one pass, rather than
+      // with a query for each block that the document names
+      auto &pSampleBlockFactory =
+         WaveTrackFactory::Get( mProject ).GetSampleBlockFactory();
+      pSampleBlockFactory->Prefetch();
+      auto release = finally([&]{ pSampleBlockFactory->ReleasePrefetched(); });
+
       // Load 'er up
       success = xmlFile.ParseString(this, project);
       if (!success)
@@ -1977,9 +2137,9 @@ bool ProjectFileIO::SaveProject(const FilePath &fileName, const std::shared_ptr<
    return true;
 }
 
-bool ProjectFileIO::SaveCopy(const FilePath& fileName)
+bool ProjectFileIO::SaveCopy(const FilePath& fileName, const std::shared_ptr<TrackList> &tracks)
 {
-   return CopyTo(fileName, XO("Backing up project"), false, true);
+   return CopyTo(fileName, XO("Backing up project"), false, true, tracks);
 }
 
 bool ProjectFileIO::OpenProject()
@@ -85,7 +85,8 @@ public:
    bool LoadProject(const FilePath &fileName);
    bool UpdateSaved(const std::shared_ptr<TrackList> &tracks = nullptr);
    bool SaveProject(const FilePath &fileName, const std::shared_ptr<TrackList> &lastSaved);
-   bool SaveCopy(const FilePath& fileName);
+   // IAL: tracks, if given, are saved in place of the project's own (see IALBatchLabeler)
+   bool SaveCopy(const FilePath& fileName, const std::shared_ptr<TrackList> &tracks = nullptr);
 
    wxLongLong GetFreeDiskSpace() const;
 
@@ -103,6 +104,12 @@ public:
    // specific database. This is the workhorse for the above 3 methods.
    static int64_t GetDiskUsage(DBConnection *conn, SampleBlockID blockid);
 
+   // Raises the version of the connection's project file so that builds which
+   // can't read sample blocks compressed by SampleBlockCodec refuse to open it.
+   // Must be called before the first compressed block is written; only the
+   // first call on a connection touches the database.
+   static bool MarkCompressedBlocks(DBConnection &conn);
+
    const TranslatableString &GetLastError();
    const TranslatableString &GetLibraryError();
 
@@ -36,6 +36,7 @@ Paul Licameli split from AudacityProject.cpp
 #include "wxFileNameWrapper.h"
 #include "import/Import.h"
 #include "import/ImportMIDI.h"
+#include "labeler/IALLabeler.hpp"
 #include "prefs/QualityPrefs.h"
 #include "toolbars/MixerToolBar.h"
 #include "toolbars/SelectionBar.h"
@@ -681,6 +682,10 @@ void ProjectManager::OnCloseWindow(wxCloseEvent & event)
    window.ShowFullScreen(false);
 #endif
 
+   // IAL: background labeling reads from the project database, so it must
+   // stop before the database is closed
+   IALLabeler::Get( project ).cancelLabeling( true );
+
    ModuleManager::Get().Dispatch(ProjectClosing);
 
    // Stop the timer since there's no need to update anything anymore
@@ -38,6 +38,23 @@ SampleBlockFactoryPtr SampleBlockFactory::New( AudacityProject &project )
 
 SampleBlockFactory::~SampleBlockFactory() = default;
 
+SampleBlockCacheStatistics SampleBlockFactory::GetCacheStatistics() const
+{
+   return {};
+}
+
+void SampleBlockFactory::Prefetch()
+{
+}
+
+void SampleBlockFactory::ReleasePrefetched()
+{
+}
+
+void SampleBlockFactory::Flush()
+{
+}
+
 SampleBlockPtr SampleBlockFactory::Create(samplePtr src,
    size_t numsamples,
    sampleFormat srcformat)
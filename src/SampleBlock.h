@@ -38,6 +38,16 @@ public:
 
 class SqliteSampleBlockFactory;
 
+//! Counters of a factory's in-memory cache of block contents
+struct SampleBlockCacheStatistics
+{
+   unsigned long long hits = 0;
+   unsigned long long misses = 0;
+   //! Bytes held now, and the most that may be held
+   size_t bytes = 0;
+   size_t budget = 0;
+};
+
 ///\brief Abstract class allows access to contents of a block of sound samples,
 /// serialization as XML, and reference count management that can suppress
 /// reclamation of its storage
@@ -142,6 +152,22 @@ public:
    virtual BlockDeletionCallback SetBlockDeletionCallback(
       BlockDeletionCallback callback ) = 0;
 
+   //! @return counters of the factory's read cache; all zero if it has none
+   virtual SampleBlockCacheStatistics GetCacheStatistics() const;
+
+   //! Reads what describes every stored block, all at once
+   /*! Until ReleasePrefetched(), CreateFromXML() takes from that instead of
+    querying the storage for each block, as when a project is opened. */
+   virtual void Prefetch();
+   virtual void ReleasePrefetched();
+
+   //! Waits until every block created so far is stored
+   /*! A factory may store new blocks later, on another thread; this must be
+    called before the project's document, which names the blocks, is written,
+    and before the storage is copied or closed.  It may throw what storing a
+    block failed with. */
+   virtual void Flush();
+
 protected:
    // The override should throw more informative exceptions on error than the
    // default InconsistencyException thrown by Create
@@ -0,0 +1,339 @@
+/**********************************************************************
+
+Audacity: A Digital Audio Editor
+
+SampleBlockCodec.cpp
+
+*******************************************************************//**
+
+\file SampleBlockCodec.cpp
+\brief Lossless linear prediction and Rice coding of sample blocks
+
+*//*******************************************************************/
+
+#include "SampleBlockCodec.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+// Samples per choice of predictor and Rice parameter
+constexpr size_t ChunkSamples = 4096;
+constexpr int MaxOrder = 3;
+
+// Quotients this large are written as an escape and the whole value, so
+// that an outlier can't cost thousands of bits
+constexpr unsigned EscapeQuotient = 24;
+
+constexpr unsigned char Magic = 'L';
+constexpr unsigned char Version = 1;
+
+class BitWriter
+{
+public:
+   explicit BitWriter(std::vector<char> &out) : mOut{ out } {}
+
+   void Write(uint64_t value, unsigned bits)
+   {
+      while (bits > 32) {
+         bits -= 32;
+         Put(uint32_t(value >> bits), 32);
+      }
+      Put(uint32_t(value & ((uint64_t{ 1 } << bits) - 1)), bits);
+   }
+
+   void WriteOnes(unsigned count)
+   {
+      while (count > 0) {
+         const auto bits = std::min(count, 32u);
+         Put(uint32_t((uint64_t{ 1 } << bits) - 1), bits);
+         count -= bits;
+      }
+   }
+
+   void Flush()
+   {
+      if (mCount > 0)
+         mOut.push_back(char(mAcc << (8 - mCount)));
+      mCount = 0;
+   }
+
+private:
+   void Put(uint32_t value, unsigned bits)
+   {
+      if (bits == 0)
+         return;
+      mAcc = (mAcc << bits) | value;
+      mCount += bits;
+      while (mCount >= 8) {
+         mCount -= 8;
+         mOut.push_back(char(mAcc >> mCount));
+      }
+   }
+
+   std::vector<char> &mOut;
+   uint64_t mAcc{ 0 };
+   unsigned mCount{ 0 };
+};
+
+class BitReader
+{
+public:
+   BitReader(const unsigned char *data, size_t bytes)
+      : mData{ data }, mBytes{ bytes } {}
+
+   uint64_t Read(unsigned bits)
+   {
+      uint64_t result = 0;
+      while (bits > 32) {
+         bits -= 32;
+         result = (result << 32) | Get(32);
+      }
+      return (result << bits) | Get(bits);
+   }
+
+   //! Counts ones up to the first zero, or up to limit
+   unsigned ReadOnes(unsigned limit)
+   {
+      unsigned count = 0;
+      while (count < limit && Get(1))
+         ++count;
+      return count;
+   }
+
+   //! True if more bits were read than there were
+   bool Overrun() const { return mOverrun; }
+
+private:
+   uint32_t Get(unsigned bits)
+   {
+      if (bits == 0)
+         return 0;
+      while (mCount < bits) {
+         if (mPos < mBytes)
+            mAcc = (mAcc << 8) | mData[mPos++];
+         else {
+            mAcc <<= 8;
+            mOverrun = true;
+         }
+         mCount += 8;
+      }
+      mCount -= bits;
+      return uint32_t((mAcc >> mCount) & ((uint64_t{ 1 } << bits) - 1));
+   }
+
+   const unsigned char *mData;
+   size_t mBytes;
+   size_t mPos{ 0 };
+   uint64_t mAcc{ 0 };
+   unsigned mCount{ 0 };
+   bool mOverrun{ false };
+};
+
+// Floats map to integers of the same order: flipping all but the sign bit of
+// negative values reverses them, so that more negative sorts lower.
+// The mapping is its own inverse.
+inline int32_t OrderedBits(int32_t bits)
+{
+   return bits < 0 ? bits ^ 0x7fffffff : bits;
+}
+
+int64_t LoadValue(constSamplePtr src, sampleFormat format, size_t i)
+{
+   switch (format) {
+   case int16Sample:
+      return reinterpret_cast<const int16_t *>(src)[i];
+   case int24Sample:
+      return reinterpret_cast<const int32_t *>(src)[i];
+   case floatSample:
+   default: {
+      int32_t bits;
+      memcpy(&bits, src + i * sizeof(float), sizeof(bits));
+      return OrderedBits(bits);
+   }
+   }
+}
+
+void StoreValue(samplePtr dest, sampleFormat format, size_t i, int64_t value)
+{
+   switch (format) {
+   case int16Sample:
+      reinterpret_cast<int16_t *>(dest)[i] = int16_t(value);
+      break;
+   case int24Sample:
+      reinterpret_cast<int32_t *>(dest)[i] = int32_t(value);
+      break;
+   case floatSample:
+   default: {
+      const int32_t bits = OrderedBits(int32_t(value));
+      memcpy(dest + i * sizeof(float), &bits, sizeof(bits));
+      break;
+   }
+   }
+}
+
+// The fixed predictors of FLAC.  history[0] is the previous value.
+// Unsigned arithmetic, so that overflow wraps rather than being undefined;
+// the decoder wraps the same way.
+inline uint64_t Predict(int order, const uint64_t *history)
+{
+   switch (order) {
+   default:
+   case 0:
+      return 0;
+   case 1:
+      return history[0];
+   case 2:
+      return 2 * history[0] - history[1];
+   case 3:
+      return 3 * history[0] - 3 * history[1] + history[2];
+   }
+}
+
+inline void Push(uint64_t *history, uint64_t value)
+{
+   history[2] = history[1];
+   history[1] = history[0];
+   history[0] = value;
+}
+
+// Small residuals of either sign become small unsigned numbers
+inline uint64_t ZigZag(uint64_t residual)
+{
+   return (residual << 1) ^ uint64_t(int64_t(residual) >> 63);
+}
+
+inline uint64_t UnZigZag(uint64_t value)
+{
+   return (value >> 1) ^ (0 - (value & 1));
+}
+
+// The Rice parameter that best suits residuals of this mean
+unsigned RiceParameter(double mean)
+{
+   if (mean < 1.0)
+      return 0;
+   return std::min(62u, unsigned(std::log2(mean)));
+}
+
+}
+
+bool SampleBlockCodec::Encode(constSamplePtr src, size_t numsamples,
+   sampleFormat format, std::vector<char> &dest)
+{
+   const size_t rawBytes = numsamples * SAMPLE_SIZE(format);
+   if (numsamples == 0 || numsamples > UINT32_MAX)
+      return false;
+
+   dest.clear();
+   dest.reserve(rawBytes);
+
+   dest.push_back(char(Magic));
+   dest.push_back(char(Version));
+   dest.push_back(0);
+   dest.push_back(0);
+   for (int shift = 0; shift < 32; shift += 8)
+      dest.push_back(char(numsamples >> shift));
+
+   BitWriter writer{ dest };
+   uint64_t history[MaxOrder] = { 0, 0, 0 };
+   std::vector<uint64_t> residuals(std::min(ChunkSamples, numsamples));
+
+   for (size_t chunkStart = 0; chunkStart < numsamples; chunkStart += ChunkSamples) {
+      const size_t count = std::min(ChunkSamples, numsamples - chunkStart);
+
+      // Pick the predictor that leaves the smallest residuals
+      int bestOrder = 0;
+      double bestSum = 0;
+      for (int order = 0; order <= MaxOrder; ++order) {
+         uint64_t trial[MaxOrder];
+         std::copy(history, history + MaxOrder, trial);
+         double sum = 0;
+         for (size_t i = 0; i < count; ++i) {
+            const uint64_t value = LoadValue(src, format, chunkStart + i);
+            sum += double(ZigZag(value - Predict(order, trial)));
+            Push(trial, value);
+         }
+         if (order == 0 || sum < bestSum)
+            bestOrder = order, bestSum = sum;
+      }
+
+      for (size_t i = 0; i < count; ++i) {
+         const uint64_t value = LoadValue(src, format, chunkStart + i);
+         residuals[i] = ZigZag(value - Predict(bestOrder, history));
+         Push(history, value);
+      }
+
+      const unsigned k = RiceParameter(bestSum / count);
+      writer.Write(bestOrder, 2);
+      writer.Write(k, 6);
+      for (size_t i = 0; i < count; ++i) {
+         const uint64_t quotient = residuals[i] >> k;
+         if (quotient < EscapeQuotient) {
+            writer.WriteOnes(unsigned(quotient));
+            writer.Write(0, 1);
+            writer.Write(residuals[i], k);
+         }
+         else {
+            writer.WriteOnes(EscapeQuotient);
+            writer.Write(residuals[i], 64);
+         }
+      }
+
+      // Give up as soon as it's clear that nothing is gained
+      if (dest.size() >= rawBytes)
+         return false;
+   }
+
+   writer.Flush();
+   return dest.size() < rawBytes;
+}
+
+size_t SampleBlockCodec::DecodedSampleCount(const char *src, size_t bytes)
+{
+   if (bytes < HeaderBytes ||
+       (unsigned char)src[0] != Magic || (unsigned char)src[1] != Version)
+      return 0;
+
+   size_t numsamples = 0;
+   for (int i = 0; i < 4; ++i)
+      numsamples |= size_t((unsigned char)src[4 + i]) << (8 * i);
+   return numsamples;
+}
+
+bool SampleBlockCodec::Decode(const char *src, size_t bytes,
+   sampleFormat format, samplePtr dest, size_t numsamples)
+{
+   if (DecodedSampleCount(src, bytes) != numsamples)
+      return false;
+
+   BitReader reader{
+      reinterpret_cast<const unsigned char *>(src) + HeaderBytes,
+      bytes - HeaderBytes };
+   uint64_t history[MaxOrder] = { 0, 0, 0 };
+
+   for (size_t chunkStart = 0; chunkStart < numsamples; chunkStart += ChunkSamples) {
+      const size_t count = std::min(ChunkSamples, numsamples - chunkStart);
+      const int order = int(reader.Read(2));
+      const unsigned k = unsigned(reader.Read(6));
+
+      for (size_t i = 0; i < count; ++i) {
+         const unsigned quotient = reader.ReadOnes(EscapeQuotient);
+         const uint64_t residual = (quotient < EscapeQuotient)
+            ? (uint64_t(quotient) << k) | reader.Read(k)
+            : reader.Read(64);
+
+         const uint64_t value = UnZigZag(residual) + Predict(order, history);
+         StoreValue(dest, format, chunkStart + i, int64_t(value));
+         Push(history, value);
+      }
+
+      if (reader.Overrun())
+         return false;
+   }
+
+   return true;
+}
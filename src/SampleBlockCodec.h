@@ -0,0 +1,55 @@
+/**********************************************************************
+
+Audacity: A Digital Audio Editor
+
+SampleBlockCodec.h
+
+**********************************************************************/
+
+#ifndef __AUDACITY_SAMPLE_BLOCK_CODEC__
+#define __AUDACITY_SAMPLE_BLOCK_CODEC__
+
+#include "audacity/Types.h"
+
+#include <vector>
+
+///\brief Lossless compression of the samples of a sample block
+/*!
+ Samples are predicted from the ones before them with the fixed polynomial
+ predictors of FLAC (orders 0 to 3, chosen per run of 4096 samples), and the
+ residuals are Rice coded.  Integer formats are predicted as they are.  Float
+ samples are first mapped to integers that sort in the same order as the
+ floats, so that nearby values stay nearby and prediction still works on
+ them; the mapping is exactly reversible, so nothing is lost.
+
+ An encoded blob starts with a header that holds the number of samples, so
+ the decoded size is known without decoding.
+ */
+namespace SampleBlockCodec
+{
+   //! Or'ed into the sampleformat column of rows whose samples are encoded
+   enum : int { CompressedFlag = 0x40000000 };
+
+   //! Such rows also keep the number of samples in the sampleformat column,
+   //! shifted up by this much, so that loading needn't open the blob
+   enum : int { SampleCountShift = 32 };
+
+   //! Bytes of the header at the start of every encoded blob
+   enum : size_t { HeaderBytes = 8 };
+
+   //! Encodes numsamples samples of the given format
+   /*! @return false if the samples don't get any smaller; dest is then unspecified */
+   bool Encode(constSamplePtr src, size_t numsamples, sampleFormat format,
+               std::vector<char> &dest);
+
+   //! @return the number of samples encoded in a blob, from its header,
+   //! or zero if the header isn't valid
+   size_t DecodedSampleCount(const char *src, size_t bytes);
+
+   //! Decodes a whole blob into numsamples samples of the given format
+   /*! @return false if the blob is damaged */
+   bool Decode(const char *src, size_t bytes, sampleFormat format,
+               samplePtr dest, size_t numsamples);
+}
+
+#endif
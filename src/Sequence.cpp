@@ -46,6 +46,85 @@
 
 size_t Sequence::sMaxDiskBlockSize = 1048576;
 
+BlockRunSummary::BlockRunSummary()
+   : min(FLT_MAX), max(-FLT_MAX), sumsq(0.0), count(0)
+{
+}
+
+void BlockRunSummary::Add(const BlockRunSummary &other)
+{
+   min = std::min(min, other.min);
+   max = std::max(max, other.max);
+   sumsq += other.sumsq;
+   count += other.count;
+}
+
+void BlockSummaryPyramid::Invalidate(size_t firstBlock)
+{
+   std::lock_guard<std::mutex> guard{ mMutex };
+   mValidBlocks = std::min(mValidBlocks, firstBlock);
+}
+
+void BlockSummaryPyramid::Update(const BlockArray &blocks)
+{
+   const size_t first = std::min(mValidBlocks, blocks.size());
+   if (first == blocks.size() && !mLevels.empty() &&
+       mLevels[0].size() == blocks.size())
+      return;
+
+   // Leaves come from the summaries every block keeps in memory
+   if (mLevels.empty())
+      mLevels.emplace_back();
+   auto &leaves = mLevels[0];
+   leaves.resize(first);
+   for (size_t b = first, nn = blocks.size(); b < nn; ++b) {
+      const auto &sb = blocks[b].sb;
+      const auto results = sb->GetMinMaxRMS(false);
+      const auto count = sb->GetSampleCount();
+      leaves.emplace_back(results.min, results.max,
+         double(results.RMS) * results.RMS * count, count);
+   }
+
+   // Each node above summarizes two below; those holding a changed block are
+   // recomputed, including a last node that had only one child
+   size_t level = 1;
+   for (; mLevels[level - 1].size() > 1; ++level) {
+      if (mLevels.size() <= level)
+         mLevels.emplace_back();
+      const auto &below = mLevels[level - 1];
+      auto &nodes = mLevels[level];
+      nodes.resize(std::min(nodes.size(), first >> level));
+      for (size_t i = nodes.size(), nn = (below.size() + 1) / 2; i < nn; ++i) {
+         BlockRunSummary node = below[2 * i];
+         if (2 * i + 1 < below.size())
+            node.Add(below[2 * i + 1]);
+         nodes.push_back(node);
+      }
+   }
+   mLevels.resize(level);
+
+   mValidBlocks = blocks.size();
+}
+
+BlockRunSummary BlockSummaryPyramid::Query(
+   const BlockArray &blocks, size_t b0, size_t b1)
+{
+   std::lock_guard<std::mutex> guard{ mMutex };
+   Update(blocks);
+
+   BlockRunSummary result;
+   b1 = std::min(b1, blocks.size());
+   for (size_t level = 0; b0 < b1 && level < mLevels.size(); ++level) {
+      const auto &nodes = mLevels[level];
+      if (b0 & 1)
+         result.Add(nodes[b0++]);
+      if (b1 & 1)
+         result.Add(nodes[--b1]);
+      b0 >>= 1, b1 >>= 1;
+   }
+   return result;
+}
+
 // Sequence methods
 Sequence::Sequence(
    const SampleBlockFactoryPtr &pFactory, sampleFormat format)
@@ -239,16 +318,13 @@ std::pair<float, float> Sequence::GetMinMax(
    unsigned int block1 = FindBlock(start + len - 1);
 
    // First calculate the min/max of the blocks in the middle of this region;
-   // this is very fast because we have the min/max of every entire block
-   // already in memory.
+   // this is very fast because the pyramid summarizes runs of whole blocks
+   // in memory.
 
-   for (unsigned b = block0 + 1; b < block1; ++b) {
-      auto results = mBlock[b].sb->GetMinMaxRMS(mayThrow);
-
-      if (results.min < min)
-         min = results.min;
-      if (results.max > max)
-         max = results.max;
+   if (block0 + 1 < block1) {
+      auto results = mPyramid.Query(mBlock, block0 + 1, block1);
+      min = results.min;
+      max = results.max;
    }
 
    // Now we take the first and last blocks into account, noting that the
@@ -315,17 +391,12 @@ float Sequence::GetRMS(sampleCount start, sampleCount len, bool mayThrow) const
    unsigned int block1 = FindBlock(start + len - 1);
 
    // First calculate the rms of the blocks in the middle of this region;
-   // this is very fast because we have the rms of every entire block
-   // already in memory.
-   for (unsigned b = block0 + 1; b < block1; b++) {
-      const SeqBlock &theBlock = mBlock[b];
-      const auto &sb = theBlock.sb;
-      auto results = sb->GetMinMaxRMS(mayThrow);
-
-      const auto fileLen = sb->GetSampleCount();
-      const auto blockRMS = results.RMS;
-      sumsq += blockRMS * blockRMS * fileLen;
-      length += fileLen;
+   // this is very fast because the pyramid summarizes runs of whole blocks
+   // in memory.
+   if (block0 + 1 < block1) {
+      auto results = mPyramid.Query(mBlock, block0 + 1, block1);
+      sumsq += results.sumsq;
+      length += results.count;
    }
 
    // Now we take the first and last blocks into account, noting that the
@@ -571,6 +642,7 @@ void Sequence::Paste(sampleCount s, const Sequence *src)
          buffer.ptr(),
          largerBlockLen.as_size_t(),
          mSampleFormat);
+      mPyramid.Invalidate(b);
 
       // Don't make a duplicate array.  We can still give Strong-guarantee
       // if we modify only one block in place.
@@ -1276,6 +1348,12 @@ bool Sequence::GetWaveDisplay(float *min, float *max, float *rms, int* bl,
    // ... unless the mNumSamples ceiling applies, and then there are other defenses
    const auto s1 =
       std::min(mNumSamples, std::max(1 + where[len - 1], where[len]));
+
+   // So zoomed out that each column spans whole blocks: rather than visit
+   // every block, summarize each column's run of blocks from the pyramid
+   if ((s1 - s0).as_double() >= 2.0 * mMaxSamples * len)
+      return GetWaveDisplayFromPyramid(min, max, rms, bl, len, where, s0, s1);
+
    Floats temp{ mMaxSamples };
 
    decltype(len) pixel = 0;
@@ -1459,6 +1537,61 @@ bool Sequence::GetWaveDisplay(float *min, float *max, float *rms, int* bl,
    return true;
 }
 
+// Each column takes its whole blocks from the pyramid, and the parts of
+// the blocks at either end from their own summaries, so the cost is in
+// proportion to the number of columns, however long the sequence is
+bool Sequence::GetWaveDisplayFromPyramid(float *min, float *max, float *rms,
+   int* bl, size_t len, const sampleCount *where,
+   sampleCount s0, sampleCount s1) const
+{
+   auto addPart = [&](BlockRunSummary &summary, unsigned b,
+                      sampleCount from, sampleCount to) {
+      const SeqBlock &block = mBlock[b];
+      const auto offset = (from - block.start).as_size_t();
+      const auto length = (to - from).as_size_t();
+      if (offset == 0 && length == block.sb->GetSampleCount()) {
+         summary.Add(mPyramid.Query(mBlock, b, b + 1));
+         return;
+      }
+      // no-throw for display operations!
+      const auto results = block.sb->GetMinMaxRMS(offset, length, false);
+      summary.Add({ results.min, results.max,
+         double(results.RMS) * results.RMS * length, sampleCount(length) });
+   };
+
+   for (size_t pixel = 0; pixel < len; ++pixel) {
+      // The column for pixel p covers samples from
+      // where[p] up to but excluding where[p + 1].
+      const auto from = std::max(s0, std::min(s1 - 1, where[pixel]));
+      const auto to = (pixel + 1 == len)
+         ? s1
+         : std::max(from + 1, std::min(s1, where[pixel + 1]));
+
+      const unsigned b0 = FindBlock(from);
+      const unsigned b1 = FindBlock(to - 1);
+
+      BlockRunSummary summary;
+      if (b0 == b1)
+         addPart(summary, b0, from, to);
+      else {
+         const SeqBlock &first = mBlock[b0];
+         addPart(summary, b0, from, first.start + first.sb->GetSampleCount());
+         if (b0 + 1 < b1)
+            summary.Add(mPyramid.Query(mBlock, b0 + 1, b1));
+         addPart(summary, b1, mBlock[b1].start, to);
+      }
+
+      min[pixel] = summary.min;
+      max[pixel] = summary.max;
+      rms[pixel] = summary.count > 0
+         ? (float)sqrt(summary.sumsq / summary.count.as_double())
+         : 0.0f;
+      bl[pixel] = b0;
+   }
+
+   return true;
+}
+
 size_t Sequence::GetIdealAppendLen() const
 {
    int numBlocks = mBlock.size();
@@ -1681,6 +1814,7 @@ void Sequence::Delete(sampleCount start, sampleCount len)
            ( pos + len ).as_size_t(), newLen - pos, true);
 
       b.sb = factory.Create(scratch.ptr(), newLen, mSampleFormat);
+      mPyramid.Invalidate(b0);
 
       // Don't make a duplicate array.  We can still give Strong-guarantee
       // if we modify only one block in place.
@@ -1867,6 +2001,13 @@ void Sequence::CommitChangesIfConsistent
    // now commit
    // use No-fail-guarantee
 
+   // The blocks before the first one replaced are still summarized
+   size_t firstChanged = 0;
+   while (firstChanged < mBlock.size() && firstChanged < newBlock.size() &&
+          mBlock[firstChanged].sb == newBlock[firstChanged].sb)
+      ++firstChanged;
+   mPyramid.Invalidate(firstChanged);
+
    mBlock.swap(newBlock);
    mNumSamples = numSamples;
 }
@@ -1890,6 +2031,7 @@ void Sequence::AppendBlocksIfConsistent
    }
 
    auto prevSize = mBlock.size();
+   mPyramid.Invalidate(prevSize);
 
    bool consistent = false;
    auto cleanup = finally( [&] {
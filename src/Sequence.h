@@ -13,6 +13,7 @@
 
 #include <vector>
 #include <functional>
+#include <mutex>
 
 #include "SampleFormat.h"
 #include "xml/XMLTagHandler.h"
@@ -48,6 +49,45 @@ class SeqBlock {
 class BlockArray : public std::vector<SeqBlock> {};
 using BlockPtrArray = std::vector<SeqBlock*>; // non-owning pointers
 
+//! Min, max and sum of squares of a run of whole sample blocks
+struct BlockRunSummary {
+   //! An empty run
+   BlockRunSummary();
+   BlockRunSummary(float min_, float max_, double sumsq_, sampleCount count_)
+      : min(min_), max(max_), sumsq(sumsq_), count(count_)
+   {}
+
+   void Add(const BlockRunSummary &other);
+
+   float min;
+   float max;
+   double sumsq;
+   sampleCount count;
+};
+
+//! A tree of BlockRunSummary over the blocks of a sequence, each node
+//! summarizing two of the level below, so that any run of whole blocks is
+//! summarized in time logarithmic in the number of blocks.
+/*! The tree is brought up to date lazily, from the first block that was
+ invalidated since the last query.  Appending blocks needs no invalidation.
+ Queries may come from more than one thread. */
+class BlockSummaryPyramid {
+public:
+   //! Blocks from this index on may have changed
+   void Invalidate(size_t firstBlock);
+
+   //! Summary of blocks [b0, b1)
+   BlockRunSummary Query(const BlockArray &blocks, size_t b0, size_t b1);
+
+private:
+   void Update(const BlockArray &blocks);
+
+   std::mutex mMutex;
+   std::vector< std::vector< BlockRunSummary > > mLevels;
+   //! How many of the leading blocks the tree still describes
+   size_t mValidBlocks{ 0 };
+};
+
 class PROFILE_DLL_API Sequence final : public XMLTagHandler{
  public:
 
@@ -197,6 +237,9 @@ class PROFILE_DLL_API Sequence final : public XMLTagHandler{
 
    bool          mErrorOpening{ false };
 
+   // Summaries of runs of whole blocks, for queries over long stretches
+   mutable BlockSummaryPyramid mPyramid;
+
    //
    // Private methods
    //
@@ -211,6 +254,10 @@ class PROFILE_DLL_API Sequence final : public XMLTagHandler{
                            sampleCount &numSamples,
                            const SeqBlock &b);
 
+   bool GetWaveDisplayFromPyramid(float *min, float *max, float *rms, int* bl,
+                                  size_t len, const sampleCount *where,
+                                  sampleCount s0, sampleCount s1) const;
+
    static bool Read(samplePtr buffer,
                     sampleFormat format,
                     const SeqBlock &b,
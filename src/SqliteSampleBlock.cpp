@@ -11,8 +11,21 @@ Paul Licameli -- split from SampleBlock.cpp and SampleBlock.h
 #include <float.h>
 #include <sqlite3.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "DBConnection.h"
+#include "Prefs.h"
 #include "ProjectFileIO.h"
+#include "SampleBlockCodec.h"
 #include "SampleFormat.h"
 #include "xml/XMLTagHandler.h"
 
@@ -20,6 +33,283 @@ Paul Licameli -- split from SampleBlock.cpp and SampleBlock.h
 
 class SqliteSampleBlockFactory;
 
+///\brief Bounded, thread-safe cache of the blobs of sample blocks, as read
+/// from the database, least recently used first out
+/*! The waveform display, playback, effects and the labeler all read the same
+ blocks again and again; each read would otherwise step a statement and copy
+ out of SQLite.  Committed blocks never change, so a cached blob can't go
+ stale while its block exists; it is evicted when the block is destroyed,
+ before its id could be reused. */
+class SampleBlockBlobCache
+{
+public:
+   enum Column { Samples, Summary256, Summary64k };
+   using Blob = std::shared_ptr< const std::vector<char> >;
+
+   //! A budget of zero disables the cache
+   void SetBudget(size_t bytes);
+   bool IsEnabled() const;
+
+   //! @return null on a miss
+   Blob Find(SampleBlockID id, Column column);
+   void Insert(SampleBlockID id, Column column, const Blob &blob);
+   //! Drops every column of a block
+   void Evict(SampleBlockID id);
+
+   SampleBlockCacheStatistics GetStatistics() const;
+
+private:
+   // Must be called with the mutex held
+   void Trim();
+
+   using Key = std::pair< SampleBlockID, int >;
+   struct Entry
+   {
+      Key key;
+      Blob blob;
+   };
+   using Entries = std::list< Entry >;
+
+   mutable std::mutex mMutex;
+   //! Most recently used first
+   Entries mEntries;
+   std::map< Key, Entries::iterator > mIndex;
+   size_t mBytes{ 0 };
+   size_t mBudget{ 0 };
+   unsigned long long mHits{ 0 };
+   unsigned long long mMisses{ 0 };
+};
+
+void SampleBlockBlobCache::SetBudget(size_t bytes)
+{
+   std::lock_guard< std::mutex > guard{ mMutex };
+   mBudget = bytes;
+   Trim();
+}
+
+bool SampleBlockBlobCache::IsEnabled() const
+{
+   std::lock_guard< std::mutex > guard{ mMutex };
+   return mBudget > 0;
+}
+
+auto SampleBlockBlobCache::Find(SampleBlockID id, Column column) -> Blob
+{
+   std::lock_guard< std::mutex > guard{ mMutex };
+   auto iter = mIndex.find({ id, column });
+   if (iter == mIndex.end()) {
+      ++mMisses;
+      return {};
+   }
+
+   ++mHits;
+   mEntries.splice(mEntries.begin(), mEntries, iter->second);
+   return iter->second->blob;
+}
+
+void SampleBlockBlobCache::Insert(
+   SampleBlockID id, Column column, const Blob &blob)
+{
+   std::lock_guard< std::mutex > guard{ mMutex };
+   if (!blob || blob->size() > mBudget)
+      return;
+
+   const Key key{ id, column };
+   auto iter = mIndex.find(key);
+   if (iter != mIndex.end()) {
+      // Another thread read the same blob meanwhile
+      mBytes -= iter->second->blob->size();
+      mEntries.erase(iter->second);
+      mIndex.erase(iter);
+   }
+
+   mEntries.push_front({ key, blob });
+   mIndex[key] = mEntries.begin();
+   mBytes += blob->size();
+   Trim();
+}
+
+void SampleBlockBlobCache::Evict(SampleBlockID id)
+{
+   std::lock_guard< std::mutex > guard{ mMutex };
+   auto iter = mIndex.lower_bound({ id, Samples });
+   while (iter != mIndex.end() && iter->first.first == id) {
+      mBytes -= iter->second->blob->size();
+      mEntries.erase(iter->second);
+      iter = mIndex.erase(iter);
+   }
+}
+
+void SampleBlockBlobCache::Trim()
+{
+   while (mBytes > mBudget && !mEntries.empty()) {
+      auto &last = mEntries.back();
+      mBytes -= last.blob->size();
+      mIndex.erase(last.key);
+      mEntries.pop_back();
+   }
+}
+
+SampleBlockCacheStatistics SampleBlockBlobCache::GetStatistics() const
+{
+   std::lock_guard< std::mutex > guard{ mMutex };
+   return { mHits, mMisses, mBytes, mBudget };
+}
+
+///\brief What SqliteSampleBlock::Load reads of a row
+struct SampleBlockMetadata
+{
+   SampleBlockID id;
+   //! As stored, perhaps with SampleBlockCodec::CompressedFlag and the
+   //! number of samples
+   sqlite3_int64 storedFormat;
+   //! Of the samples column as stored
+   size_t storedBytes;
+   double sumMin;
+   double sumMax;
+   double sumRms;
+};
+
+///\brief The columns of a new block's row, kept in memory until inserted
+struct SampleBlockRow
+{
+   //! Reserved in advance, or zero to have the database assign one
+   SampleBlockID id{ 0 };
+   sampleFormat format{ floatSample };
+   size_t sampleCount{ 0 };
+   size_t sampleBytes{ 0 };
+   size_t summary256Bytes{ 0 };
+   size_t summary64kBytes{ 0 };
+
+   // Guards what follows, which the threads of SampleBlockWriter change
+   std::mutex mutex;
+   bool summarised{ false };
+   //! Once set, the arrays are freed, and the row must be read from the database
+   bool written{ false };
+   bool compressed{ false };
+   ArrayOf<char> samples;
+   ArrayOf<char> summary256;
+   ArrayOf<char> summary64k;
+   double sumMin{ 0.0 };
+   double sumMax{ 0.0 };
+   double sumRms{ 0.0 };
+};
+
+///\brief Inserts the rows of new sample blocks on threads of its own
+/*! Appending, as recording and importing do, then costs only a copy of the
+ samples.  A few worker threads calculate the summaries, and one writer thread
+ inserts the rows in batches of one transaction each.  The queue is bounded,
+ so a database that can't keep up slows down the appending thread rather than
+ taking all memory.
+
+ Rows are given ids reserved ahead, so that blocks know their ids at once.
+ The writer thread reserves them in the database before those at hand run
+ out, so that appending needn't wait for it.  Until its row is inserted, a
+ block reads from the copy that is queued.
+
+ Rows are inserted only while no other transaction is open, never into one
+ that might yet be rolled back.  A batch that fails goes back to the front of
+ the queue, and the writer stops until Enqueue() or Flush() tries it again;
+ they throw for as long as it fails. */
+class SampleBlockWriter
+{
+public:
+   using Row = std::shared_ptr< SampleBlockRow >;
+   using Rows = std::vector< Row >;
+   //! Inserts rows; called on the writer thread
+   /*! @return false, having inserted nothing, while another transaction is open */
+   using Inserter = std::function< bool(const Rows &) >;
+   //! Moves the id sequence of a database past a number of ids
+   /*! @param wait whether to wait for another transaction to end, rather
+    than return 0
+    @return the first of the ids, or 0 while another transaction is open
+    @throws if db isn't the database in use */
+   using Reserver = std::function<
+      SampleBlockID(SampleBlockID count, bool wait, const sqlite3 *db) >;
+
+   enum : size_t {
+      QueueLimit = 64,
+      BatchSize = 16,
+   };
+   // Ids never used are skipped; gaps are harmless
+   enum : SampleBlockID { ReserveCount = 256 };
+
+   ~SampleBlockWriter();
+
+   //! Must be called before the first ReserveID(); the threads start with that
+   void Enable(Inserter inserter, Reserver reserver);
+   bool IsEnabled() const { return static_cast<bool>(mInserter); }
+
+   //! @return an id that no row of the connection's database has, or will get
+   /*! Reserves in the database only if the writer thread hasn't kept up
+    @pre !conn.InTransaction() */
+   SampleBlockID ReserveID(DBConnection &conn);
+
+   //! Waits while the queue is full
+   /*! @pre the calling thread has no transaction open */
+   void Enqueue(const Row &row);
+
+   //! Takes a row out of the queue, if it's still there
+   /*! @return whether the row was inserted */
+   bool Cancel(const Row &row);
+
+   //! Waits for the queue to empty, and if the connection has another
+   //! database than before, has the writer thread reserve ids in that one
+   /*! @pre the calling thread has no transaction open
+    @throws whatever the insertion of a row still queued fails with */
+   void Flush(DBConnection *conn);
+
+   //! Lets the writer try again what a transaction held up
+   void Unblock();
+
+private:
+   // Must be called with mMutex held
+   void Start();
+   void Stop();
+   void WriterThread();
+   void SummaryThread();
+   //! Asks the writer thread to reserve more ids
+   void RequestRefill();
+   //! Reserves more ids, on the writer thread
+   /*! @return false while another transaction is open */
+   bool Refill();
+   //! Lets the writer try a failed batch again, and waits for the queue to empty
+   /*! @param lock holds mMutex
+    @throws whatever the insertion fails with again */
+   void Drain(std::unique_lock< std::mutex > &lock);
+
+   Inserter mInserter;
+   Reserver mReserver;
+
+   std::mutex mMutex;
+   std::condition_variable mCondition;
+   //! Waiting to be inserted
+   std::deque< Row > mQueue;
+   //! Waiting for summaries; they may have been cancelled meanwhile
+   std::deque< std::weak_ptr< SampleBlockRow > > mToSummarise;
+   //! Set while the writer thread inserts or reserves
+   bool mWriting{ false };
+   bool mStopping{ false };
+   bool mRefill{ false };
+   //! Set while a transaction holds the writer up
+   bool mBlocked{ false };
+   //! Counts calls to Unblock(), which may come before the writer blocks
+   unsigned long mUnblocks{ 0 };
+   //! Set while a failed batch waits at the front of the queue
+   std::exception_ptr mpException;
+
+   std::thread mWriterThread;
+   std::vector< std::thread > mSummaryThreads;
+
+   // Guards what follows; not held while waiting for the database
+   std::mutex mReserveMutex;
+   //! The database the reserved ids belong to
+   const sqlite3 *mReservedDB{ nullptr };
+   //! Ranges of ids, first and past the end
+   std::deque< std::pair< SampleBlockID, SampleBlockID > > mReserved;
+   bool mRefilling{ false };
+};
+
 ///\brief Implementation of @ref SampleBlock using Sqlite database
 class SqliteSampleBlock final : public SampleBlock
 {
@@ -35,7 +325,13 @@ public:
 
    //! Numbers of bytes needed for 256 and for 64k summaries
    using Sizes = std::pair< size_t, size_t >;
-   void Commit(Sizes sizes);
+   void Commit(SampleBlockRow &row);
+
+   //! Calculates the summaries of a row, unless another thread already has
+   static SampleBlockRow &Summarise(SampleBlockRow &row);
+   //! Inserts a summarised row, which gets an id if it has none
+   /*! @return whether the samples were stored compressed */
+   static bool InsertRow(DBConnection &conn, SampleBlockRow &row, bool compress);
 
    void Delete();
 
@@ -66,24 +362,44 @@ public:
 private:
    bool IsSilent() const { return mBlockID <= 0; }
    void Load(SampleBlockID sbid);
+   void Load(const SampleBlockMetadata &metadata);
    bool GetSummary(float *dest,
                    size_t frameoffset,
                    size_t numframes,
+                   SampleBlockBlobCache::Column column,
                    DBConnection::StatementID id,
                    const char *sql);
    size_t GetBlob(void *dest,
                   sampleFormat destformat,
-                  sqlite3_stmt *stmt,
+                  SampleBlockBlobCache::Column column,
+                  DBConnection::StatementID id,
+                  const char *sql,
                   sampleFormat srcformat,
                   size_t srcoffset,
                   size_t srcbytes);
+   bool CopyFromRow(void *dest,
+                    sampleFormat destformat,
+                    SampleBlockBlobCache::Column column,
+                    sampleFormat srcformat,
+                    size_t srcoffset,
+                    size_t srcbytes);
+   bool IsCompressed() const;
+   SampleBlockBlobCache::Blob ReadBlob(SampleBlockBlobCache::Column column,
+                                       DBConnection::StatementID id,
+                                       const char *sql);
+   size_t GetBlobSize(SampleBlockBlobCache::Column column) const;
+   bool ReadBlobRange(SampleBlockBlobCache::Column column,
+                      size_t srcoffset,
+                      size_t srcbytes,
+                      char *dest,
+                      size_t &readbytes);
 
    enum {
       fields = 3, /* min, max, rms */
       bytesPerFrame = fields * sizeof(float),
    };
    Sizes SetSizes( size_t numsamples, sampleFormat srcformat );
-   void CalcSummary(Sizes sizes);
+   static void CalcSummary(SampleBlockRow &row);
 
 private:
    //! This must never be called for silent blocks
@@ -100,14 +416,16 @@ private:
    bool mLocked = false;
 
    SampleBlockID mBlockID{ 0 };
+   //! Whether the row holds the samples encoded by SampleBlockCodec
+   bool mCompressed{ false };
+   //! Set for good when the row is left to the factory's writer; the
+   //! summaries and the compression are then the row's, not those below
+   std::shared_ptr<SampleBlockRow> mpRow;
 
-   ArrayOf<char> mSamples;
    size_t mSampleBytes;
    size_t mSampleCount;
    sampleFormat mSampleFormat;
 
-   ArrayOf<char> mSummary256;
-   ArrayOf<char> mSummary64k;
    double mSumMin;
    double mSumMax;
    double mSumRms;
@@ -150,11 +468,43 @@ public:
    BlockDeletionCallback SetBlockDeletionCallback(
       BlockDeletionCallback callback ) override;
 
+   SampleBlockCacheStatistics GetCacheStatistics() const override;
+
+   void Flush() override;
+
+   void Prefetch() override;
+   void ReleasePrefetched() override;
+
 private:
    friend SqliteSampleBlock;
 
+   //! @return null if the block wasn't prefetched
+   const SampleBlockMetadata *FindPrefetched(SampleBlockID id) const;
+
+   //! The writer's inserter
+   bool InsertRows(const SampleBlockWriter::Rows &rows);
+   //! The writer's reserver
+   SampleBlockID ReserveIDs(SampleBlockID count, bool wait, const sqlite3 *db);
+   //! @return the connection, which the writer must not use after it's closed
+   DBConnection &WriterConnection();
+   //! Wakes the writer when a transaction that holds it up ends
+   /*! @pre the transaction mutex of conn is held */
+   void UnblockWriterLater(DBConnection &conn);
+
    const std::shared_ptr<ConnectionPtr> mppConnection;
 
+   // Shared by the blocks of this factory, which may be read from any thread
+   SampleBlockBlobCache mCache;
+
+   // Whether new blocks store their samples losslessly compressed
+   bool mCompress{ false };
+
+   // Inserts new blocks in the background, if enabled
+   SampleBlockWriter mWriter;
+
+   // Filled by Prefetch(), in order of id
+   std::vector<SampleBlockMetadata> mPrefetched;
+
    // Track all blocks that this factory has created, but don't control
    // their lifetimes (so use weak_ptr)
    // (Must also use weak pointers because the blocks have shared pointers
@@ -169,10 +519,557 @@ private:
 SqliteSampleBlockFactory::SqliteSampleBlockFactory( AudacityProject &project )
    : mppConnection{ ConnectionPtr::Get(project).shared_from_this() }
 {
-   
+   // Memory budget of the read cache, in megabytes
+   long budget = gPrefs->Read(wxT("/Performance/BlockCacheSize"), 64L);
+   mCache.SetBudget(size_t(std::max(0L, budget)) * 1024 * 1024);
+
+   gPrefs->Read(wxT("/Performance/CompressBlocks"), &mCompress, false);
+
+   bool writeBehind = false;
+   gPrefs->Read(wxT("/Performance/WriteBehind"), &writeBehind, false);
+   if (writeBehind)
+      mWriter.Enable(
+         [this](const SampleBlockWriter::Rows &rows){
+            return InsertRows(rows);
+         },
+         [this](SampleBlockID count, bool wait, const sqlite3 *db){
+            return ReserveIDs(count, wait, db);
+         });
+}
+
+SqliteSampleBlockFactory::~SqliteSampleBlockFactory()
+{
+   auto stats = mCache.GetStatistics();
+   wxLogDebug(wxT("SqliteSampleBlockFactory - block cache %llu hits, %llu misses"),
+      stats.hits, stats.misses);
+}
+
+SampleBlockCacheStatistics SqliteSampleBlockFactory::GetCacheStatistics() const
+{
+   return mCache.GetStatistics();
+}
+
+void SqliteSampleBlockFactory::Flush()
+{
+   mWriter.Flush(mppConnection->mpConnection.get());
+}
+
+/// One scan of the table, so that opening a project doesn't step a
+/// statement for each of its blocks
+void SqliteSampleBlockFactory::Prefetch()
+{
+   mPrefetched.clear();
+
+   auto &pConnection = mppConnection->mpConnection;
+   if (!pConnection)
+      return;
+   auto db = pConnection->DB();
+
+   // length() of a blob is taken from the record header, without reading it
+   sqlite3_stmt *stmt = nullptr;
+   if (sqlite3_prepare_v2(db,
+                          "SELECT blockid, sampleformat, summin, summax, sumrms,"
+                          "       length(samples)"
+                          "  FROM sampleblocks;",
+                          -1, &stmt, nullptr) != SQLITE_OK)
+   {
+      // Each block queries for itself, as without the prefetch
+      return;
+   }
+
+   auto cleanup = finally([&]{ sqlite3_finalize(stmt); });
+
+   int rc;
+   while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+   {
+      mPrefetched.push_back({
+         sqlite3_column_int64(stmt, 0),
+         sqlite3_column_int64(stmt, 1),
+         (size_t) sqlite3_column_int(stmt, 5),
+         sqlite3_column_double(stmt, 2),
+         sqlite3_column_double(stmt, 3),
+         sqlite3_column_double(stmt, 4)
+      });
+   }
+
+   if (rc != SQLITE_DONE)
+   {
+      wxLogDebug(wxT("SqliteSampleBlockFactory::Prefetch - SQLITE error %s"), sqlite3_errmsg(db));
+      mPrefetched.clear();
+   }
+
+   // A scan of a rowid table is in order already
+   auto byId = [](const SampleBlockMetadata &a, const SampleBlockMetadata &b)
+      { return a.id < b.id; };
+   if (!std::is_sorted(mPrefetched.begin(), mPrefetched.end(), byId))
+      std::sort(mPrefetched.begin(), mPrefetched.end(), byId);
+}
+
+void SqliteSampleBlockFactory::ReleasePrefetched()
+{
+   mPrefetched.clear();
+   mPrefetched.shrink_to_fit();
+}
+
+const SampleBlockMetadata *
+SqliteSampleBlockFactory::FindPrefetched(SampleBlockID id) const
+{
+   auto iter = std::lower_bound(mPrefetched.begin(), mPrefetched.end(), id,
+      [](const SampleBlockMetadata &metadata, SampleBlockID id)
+         { return metadata.id < id; });
+   if (iter == mPrefetched.end() || iter->id != id)
+      return nullptr;
+   return &*iter;
+}
+
+/// Inserts a batch of rows in one transaction of its own.  Rows never join
+/// another thread's transaction, which might yet roll them back after they
+/// are marked written; while one is open, nothing is inserted.
+bool SqliteSampleBlockFactory::InsertRows(const SampleBlockWriter::Rows &rows)
+{
+   auto &conn = WriterConnection();
+   auto db = conn.DB();
+
+   // Summaries the workers haven't got to yet are done before the
+   // transaction starts, so as not to hold it up
+   for (auto &pRow : rows)
+      SqliteSampleBlock::Summarise(*pRow);
+
+   // No transaction may be opened by another thread while this one is,
+   // or its savepoint would be released with this transaction
+   std::lock_guard< std::mutex > lock{ conn.GetTransactionMutex() };
+   if (!sqlite3_get_autocommit(db)) {
+      UnblockWriterLater(conn);
+      return false;
+   }
+   if (sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr) != SQLITE_OK)
+      conn.ThrowException( true );
+
+   bool committed = false;
+   auto cleanup = finally([&]{
+      if (!committed) {
+         sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+         conn.SetCompressedBlocksMarked(false);
+      }
+   });
+
+   std::vector< bool > compressed;
+   for (auto &pRow : rows)
+      compressed.push_back(SqliteSampleBlock::InsertRow(conn, *pRow, mCompress));
+
+   if (sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) != SQLITE_OK)
+      conn.ThrowException( true );
+   committed = true;
+
+   // From now on the blocks read their rows from the database
+   for (size_t i = 0; i < rows.size(); ++i) {
+      auto &row = *rows[i];
+      std::lock_guard< std::mutex > guard{ row.mutex };
+      row.written = true;
+      row.compressed = compressed[i];
+      row.samples.reset();
+      row.summary256.reset();
+      row.summary64k.reset();
+   }
+
+   return true;
+}
+
+/// Moves the sequence of the sample blocks table past the reserved ids, so
+/// that no other insertion into the database, with an id or without, takes
+/// one.  Only in a transaction of its own, as a rollback would give them out
+/// again.
+SampleBlockID SqliteSampleBlockFactory::ReserveIDs(
+   SampleBlockID count, bool wait, const sqlite3 *expected)
+{
+   auto &conn = WriterConnection();
+   auto db = conn.DB();
+   if (db != expected)
+      // The reserving raced with a change of the database
+      conn.ThrowException( true );
+
+   char sql[512];
+   sqlite3_snprintf(sizeof(sql),
+                    sql,
+                    "UPDATE sqlite_sequence"
+                    "   SET seq = MAX(seq, IFNULL((SELECT MAX(blockid) FROM sampleblocks), 0)) + %lld"
+                    " WHERE name = 'sampleblocks';"
+                    "INSERT INTO sqlite_sequence (name, seq)"
+                    "   SELECT 'sampleblocks', IFNULL((SELECT MAX(blockid) FROM sampleblocks), 0) + %lld"
+                    "    WHERE NOT EXISTS (SELECT 1 FROM sqlite_sequence WHERE name = 'sampleblocks');",
+                    (long long) count,
+                    (long long) count);
+
+   auto cb = [](void *data, int cols, char **vals, char **) {
+      if (cols > 0 && vals[0])
+         *static_cast<SampleBlockID *>(data) = std::strtoll(vals[0], nullptr, 10);
+      return 0;
+   };
+
+   std::unique_lock< std::mutex > lock;
+   if (wait)
+      lock = conn.LockOutsideTransaction();
+   else {
+      lock = std::unique_lock< std::mutex >{ conn.GetTransactionMutex() };
+      if (!sqlite3_get_autocommit(db)) {
+         UnblockWriterLater(conn);
+         return 0;
+      }
+   }
+
+   SampleBlockID seq = 0;
+   if (sqlite3_exec(db, sql, nullptr, nullptr, nullptr) != SQLITE_OK ||
+       sqlite3_exec(db,
+                    "SELECT seq FROM sqlite_sequence WHERE name = 'sampleblocks';",
+                    cb, &seq, nullptr) != SQLITE_OK ||
+       seq < count)
+   {
+      conn.ThrowException( true );
+   }
+
+   return seq - count + 1;
+}
+
+DBConnection &SqliteSampleBlockFactory::WriterConnection()
+{
+   auto &pConnection = mppConnection->mpConnection;
+   if (!pConnection) {
+      throw SimpleMessageBoxException
+      {
+         XO("Failed to open the project's database"),
+         XO("Warning"),
+         "Error:_Disk_full_or_not_writable"
+      };
+   }
+   return *pConnection;
+}
+
+void SqliteSampleBlockFactory::UnblockWriterLater(DBConnection &conn)
+{
+   // The connection may outlive this factory
+   std::weak_ptr< SqliteSampleBlockFactory > wFactory = shared_from_this();
+   conn.SetTransactionEndCallback([wFactory]{
+      if (auto pFactory = wFactory.lock())
+         pFactory->mWriter.Unblock();
+   });
+}
+
+SampleBlockWriter::~SampleBlockWriter()
+{
+   Stop();
+}
+
+void SampleBlockWriter::Enable(Inserter inserter, Reserver reserver)
+{
+   mInserter = std::move(inserter);
+   mReserver = std::move(reserver);
+}
+
+SampleBlockID SampleBlockWriter::ReserveID(DBConnection &conn)
+{
+   SampleBlockID id;
+   bool refill = false;
+   {
+      std::unique_lock< std::mutex > lock{ mReserveMutex };
+      const sqlite3 *db = conn.DB();
+      if (mReservedDB != db)
+      {
+         // Ids reserved in one database mean nothing in another
+         mReserved.clear();
+         mReservedDB = db;
+         mRefilling = false;
+      }
+
+      if (mReserved.empty())
+      {
+         // The writer thread didn't keep up, so reserve on this one, but
+         // not with the mutex held, which the writer thread takes
+         lock.unlock();
+         auto first = mReserver(ReserveCount, true, db);
+         lock.lock();
+         if (mReservedDB != db)
+            return first;
+         mReserved.emplace_back(first, first + ReserveCount);
+      }
+
+      auto &range = mReserved.front();
+      id = range.first++;
+      if (range.first == range.second)
+         mReserved.pop_front();
+
+      // Ask for more while half of a range is left
+      if (!mRefilling)
+      {
+         SampleBlockID available = 0;
+         for (auto &range : mReserved)
+            available += range.second - range.first;
+         refill = mRefilling = available < ReserveCount / 2;
+      }
+   }
+
+   if (refill)
+      RequestRefill();
+
+   return id;
+}
+
+void SampleBlockWriter::RequestRefill()
+{
+   std::lock_guard< std::mutex > guard{ mMutex };
+   if (!mWriterThread.joinable())
+      Start();
+   mRefill = true;
+   mCondition.notify_all();
+}
+
+bool SampleBlockWriter::Refill()
+{
+   const sqlite3 *db;
+   {
+      std::lock_guard< std::mutex > guard{ mReserveMutex };
+      db = mReservedDB;
+   }
+
+   SampleBlockID first = 0;
+   try
+   {
+      first = mReserver(ReserveCount, false, db);
+   }
+   catch (...)
+   {
+      // The next ReserveID() asks again, and reserves on its own thread if
+      // it must
+      std::lock_guard< std::mutex > guard{ mReserveMutex };
+      mRefilling = false;
+      throw;
+   }
+
+   if (!first)
+      return false;
+
+   std::lock_guard< std::mutex > guard{ mReserveMutex };
+   if (db == mReservedDB)
+      mReserved.emplace_back(first, first + ReserveCount);
+   mRefilling = false;
+   return true;
+}
+
+void SampleBlockWriter::Unblock()
+{
+   std::lock_guard< std::mutex > guard{ mMutex };
+   mBlocked = false;
+   ++mUnblocks;
+   mCondition.notify_all();
+}
+
+void SampleBlockWriter::Enqueue(const Row &row)
+{
+   std::unique_lock< std::mutex > lock{ mMutex };
+   if (mpException)
+      Drain(lock);
+
+   if (!mWriterThread.joinable())
+      Start();
+
+   mCondition.wait(lock, [this]{
+      return mQueue.size() < QueueLimit || mpException;
+   });
+   if (mpException)
+      std::rethrow_exception(mpException);
+
+   mQueue.push_back(row);
+   mToSummarise.push_back(row);
+   mCondition.notify_all();
+}
+
+bool SampleBlockWriter::Cancel(const Row &row)
+{
+   {
+      std::unique_lock< std::mutex > lock{ mMutex };
+      auto remove = [&]{
+         auto iter = std::find(mQueue.begin(), mQueue.end(), row);
+         if (iter == mQueue.end())
+            return false;
+         mQueue.erase(iter);
+         mCondition.notify_all();
+         return true;
+      };
+      if (remove())
+         return false;
+
+      // It may be in the batch being written, which goes back to the queue
+      // if it isn't inserted
+      mCondition.wait(lock, [this]{ return !mWriting; });
+      if (remove())
+         return false;
+   }
+
+   std::lock_guard< std::mutex > guard{ row->mutex };
+   return row->written;
+}
+
+void SampleBlockWriter::Flush(DBConnection *conn)
+{
+   {
+      std::unique_lock< std::mutex > lock{ mMutex };
+      Drain(lock);
+   }
+
+   if (!IsEnabled() || !conn)
+      return;
+
+   // Reserve in a database newly opened before the first block needs it
+   {
+      std::lock_guard< std::mutex > guard{ mReserveMutex };
+      if (mReservedDB == conn->DB())
+         return;
+      mReserved.clear();
+      mReservedDB = conn->DB();
+      mRefilling = true;
+   }
+   RequestRefill();
 }
 
-SqliteSampleBlockFactory::~SqliteSampleBlockFactory() = default;
+void SampleBlockWriter::Drain(std::unique_lock< std::mutex > &lock)
+{
+   mpException = nullptr;
+   mBlocked = false;
+   ++mUnblocks;
+   mCondition.notify_all();
+
+   mCondition.wait(lock, [this]{
+      return (mQueue.empty() && !mWriting) || mpException;
+   });
+
+   // The error stays, and so do the rows, until they are inserted
+   if (mpException)
+      std::rethrow_exception(mpException);
+}
+
+// Must be called with mMutex held
+void SampleBlockWriter::Start()
+{
+   mStopping = false;
+   mWriterThread = std::thread([this]{ WriterThread(); });
+
+   const unsigned count =
+      std::max(1u, std::min(4u, std::thread::hardware_concurrency() / 2));
+   for (unsigned i = 0; i < count; ++i)
+      mSummaryThreads.emplace_back([this]{ SummaryThread(); });
+}
+
+void SampleBlockWriter::Stop()
+{
+   {
+      std::lock_guard< std::mutex > guard{ mMutex };
+      mStopping = true;
+      mCondition.notify_all();
+   }
+
+   if (mWriterThread.joinable())
+      mWriterThread.join();
+   for (auto &thread : mSummaryThreads)
+      thread.join();
+   mSummaryThreads.clear();
+}
+
+void SampleBlockWriter::WriterThread()
+{
+   while (true)
+   {
+      bool refill = false;
+      Rows batch;
+      unsigned long unblocks;
+      {
+         std::unique_lock< std::mutex > lock{ mMutex };
+         mCondition.wait(lock, [this]{
+            return mStopping || (!mBlocked &&
+               (mRefill || (!mQueue.empty() && !mpException)));
+         });
+
+         // Whatever is queued is written before stopping, unless it
+         // failed already, or a transaction holds it up
+         if (mStopping && (mQueue.empty() || mpException || mBlocked))
+            break;
+
+         if (mRefill && !mStopping)
+         {
+            refill = true;
+            mRefill = false;
+         }
+         else
+         {
+            const auto count = std::min<size_t>(mQueue.size(), BatchSize);
+            batch.assign(mQueue.begin(), mQueue.begin() + count);
+            mQueue.erase(mQueue.begin(), mQueue.begin() + count);
+
+            // There is room in the queue again
+            mCondition.notify_all();
+         }
+         mWriting = true;
+         unblocks = mUnblocks;
+      }
+
+      bool done = false;
+      std::exception_ptr pException;
+      try
+      {
+         done = refill ? Refill() : mInserter(batch);
+      }
+      catch (...)
+      {
+         // A failed refill is left to the next ReserveID()
+         if (!refill)
+            pException = std::current_exception();
+         else
+            done = true;
+      }
+
+      std::lock_guard< std::mutex > guard{ mMutex };
+      mWriting = false;
+      if (!done)
+      {
+         if (refill)
+            mRefill = true;
+         else
+         {
+            // Rows that weren't inserted stay in memory, where their blocks
+            // still read them, and go back to the front of the queue in order
+            mQueue.insert(mQueue.begin(), batch.begin(), batch.end());
+            mpException = std::move(pException);
+         }
+
+         // Wait for the transaction to end, unless it did already
+         if (!mpException && unblocks == mUnblocks)
+            mBlocked = true;
+      }
+      mCondition.notify_all();
+   }
+}
+
+void SampleBlockWriter::SummaryThread()
+{
+   while (true)
+   {
+      Row row;
+      {
+         std::unique_lock< std::mutex > lock{ mMutex };
+         mCondition.wait(lock, [this]{
+            return mStopping || !mToSummarise.empty();
+         });
+
+         if (mStopping)
+            break;
+
+         row = mToSummarise.front().lock();
+         mToSummarise.pop_front();
+      }
+
+      // Cancelled rows are gone already
+      if (row)
+         SqliteSampleBlock::Summarise(*row);
+   }
+}
 
 SampleBlockPtr SqliteSampleBlockFactory::DoCreate(
    samplePtr src, size_t numsamples, sampleFormat srcformat )
@@ -261,7 +1158,10 @@ SampleBlockPtr SqliteSampleBlockFactory::DoCreateFromXML(
                ssb->mSampleFormat = srcformat;
                // This may throw database errors
                // It initializes the rest of the fields
-               ssb->Load((SampleBlockID) nValue);
+               if (auto pMetadata = FindPrefetched(nValue))
+                  ssb->Load(*pMetadata);
+               else
+                  ssb->Load((SampleBlockID) nValue);
             }
          }
          found++;
@@ -304,8 +1204,16 @@ SqliteSampleBlock::~SqliteSampleBlock()
       auto &callback = mpFactory->mCallback;
       if (callback)
          GuardedCall( [&]{ callback( *this ); } );
+
+      // The row may go, and its id may be given to a new block
+      if (!IsSilent())
+         mpFactory->mCache.Evict(mBlockID);
    }
 
+   // A row still in the writer's queue never needs to be inserted at all
+   if (mpRow && !mpFactory->mWriter.Cancel(mpRow))
+      return;
+
    if (IsSilent()) {
       // The block object was constructed but failed to Load() or Commit().
       // Or it's a silent block with no row in the database.
@@ -378,13 +1286,11 @@ size_t SqliteSampleBlock::DoGetSamples(samplePtr dest,
       return numsamples;
    }
 
-   // Prepare and cache statement...automatically finalized at DB close
-   sqlite3_stmt *stmt = Conn()->Prepare(DBConnection::GetSamples,
-      "SELECT samples FROM sampleblocks WHERE blockid = ?1;");
-
    return GetBlob(dest,
                   destformat,
-                  stmt,
+                  SampleBlockBlobCache::Samples,
+                  DBConnection::GetSamples,
+                  "SELECT samples FROM sampleblocks WHERE blockid = ?1;",
                   mSampleFormat,
                   sampleoffset * SAMPLE_SIZE(mSampleFormat),
                   numsamples * SAMPLE_SIZE(mSampleFormat)) / SAMPLE_SIZE(mSampleFormat);
@@ -395,19 +1301,40 @@ void SqliteSampleBlock::SetSamples(samplePtr src,
                                    sampleFormat srcformat)
 {
    auto sizes = SetSizes(numsamples, srcformat);
-   mSamples.reinit(mSampleBytes);
-   memcpy(mSamples.get(), src, mSampleBytes);
 
-   CalcSummary( sizes );
+   auto pRow = std::make_shared<SampleBlockRow>();
+   auto &row = *pRow;
+   row.format = mSampleFormat;
+   row.sampleCount = mSampleCount;
+   row.sampleBytes = mSampleBytes;
+   row.summary256Bytes = sizes.first;
+   row.summary64kBytes = sizes.second;
+   row.samples.reinit(mSampleBytes);
+   memcpy(row.samples.get(), src, mSampleBytes);
+
+   auto &writer = mpFactory->mWriter;
+   // Rows made in a transaction are inserted in it, and roll back with it;
+   // the writer would have to wait for it to end
+   if (writer.IsEnabled() && !Conn()->InTransaction())
+   {
+      // Leave the summaries and the insertion to the writer's threads
+      row.id = writer.ReserveID(*Conn());
+      mBlockID = row.id;
+      mpRow = pRow;
+      mValid = true;
+      writer.Enqueue(pRow);
+      return;
+   }
 
-   Commit( sizes );
+   Commit( Summarise( row ) );
 }
 
 bool SqliteSampleBlock::GetSummary256(float *dest,
                                       size_t frameoffset,
                                       size_t numframes)
 {
-   return GetSummary(dest, frameoffset, numframes, DBConnection::GetSummary256,
+   return GetSummary(dest, frameoffset, numframes, SampleBlockBlobCache::Summary256,
+      DBConnection::GetSummary256,
       "SELECT summary256 FROM sampleblocks WHERE blockid = ?1;");
 }
 
@@ -415,13 +1342,15 @@ bool SqliteSampleBlock::GetSummary64k(float *dest,
                                       size_t frameoffset,
                                       size_t numframes)
 {
-   return GetSummary(dest, frameoffset, numframes, DBConnection::GetSummary64k,
+   return GetSummary(dest, frameoffset, numframes, SampleBlockBlobCache::Summary64k,
+      DBConnection::GetSummary64k,
       "SELECT summary64k FROM sampleblocks WHERE blockid = ?1;");
 }
 
 bool SqliteSampleBlock::GetSummary(float *dest,
                                    size_t frameoffset,
                                    size_t numframes,
+                                   SampleBlockBlobCache::Column column,
                                    DBConnection::StatementID id,
                                    const char *sql)
 {
@@ -430,12 +1359,12 @@ bool SqliteSampleBlock::GetSummary(float *dest,
    if (!silent) {
       // Not a silent block
       try {
-         // Prepare and cache statement...automatically finalized at DB close
-         auto stmt = Conn()->Prepare(id, sql);
          // Note GetBlob returns a size_t, not a bool
          GetBlob(dest,
                      floatSample,
-                     stmt,
+                     column,
+                     id,
+                     sql,
                      floatSample,
                      frameoffset * fields * SAMPLE_SIZE(floatSample),
                      numframes * fields * SAMPLE_SIZE(floatSample));
@@ -451,22 +1380,25 @@ bool SqliteSampleBlock::GetSummary(float *dest,
 
 double SqliteSampleBlock::GetSumMin() const
 {
-   return mSumMin;
+   return mpRow ? Summarise(*mpRow).sumMin : mSumMin;
 }
 
 double SqliteSampleBlock::GetSumMax() const
 {
-   return mSumMax;
+   return mpRow ? Summarise(*mpRow).sumMax : mSumMax;
 }
 
 double SqliteSampleBlock::GetSumRms() const
 {
-   return mSumRms;
+   return mpRow ? Summarise(*mpRow).sumRms : mSumRms;
 }
 
 /// Retrieves the minimum, maximum, and maximum RMS of the
 /// specified sample data in this block.
 ///
+/// Whole summary frames inside the region are taken from the stored 64k
+/// and 256 summaries; only the unaligned samples at either end are read.
+///
 /// @param start The offset in this block where the region should begin
 /// @param len   The number of samples to include in the region
 MinMaxRMS SqliteSampleBlock::DoGetMinMaxRMS(size_t start, size_t len)
@@ -476,22 +1408,22 @@ MinMaxRMS SqliteSampleBlock::DoGetMinMaxRMS(size_t start, size_t len)
 
    float min = FLT_MAX;
    float max = -FLT_MAX;
-   float sumsq = 0;
+   double sumsq = 0;
 
    if (!mValid)
    {
       Load(mBlockID);
    }
 
-   if (start < mSampleCount)
+   auto accumulateSamples = [&](size_t from, size_t count)
    {
-      len = std::min(len, mSampleCount - start);
+      if (count == 0)
+         return;
 
-      // TODO: actually use summaries
-      SampleBuffer blockData(len, floatSample);
+      SampleBuffer blockData(count, floatSample);
       float *samples = (float *) blockData.ptr();
 
-      size_t copied = DoGetSamples((samplePtr) samples, floatSample, start, len);
+      size_t copied = DoGetSamples((samplePtr) samples, floatSample, from, count);
       for (size_t i = 0; i < copied; ++i, ++samples)
       {
          float sample = *samples;
@@ -508,6 +1440,63 @@ MinMaxRMS SqliteSampleBlock::DoGetMinMaxRMS(size_t start, size_t len)
 
          sumsq += (sample * sample);
       }
+   };
+
+   // Each summary frame holds min, max and rms of frameLen whole samples
+   auto accumulateSummary = [&](bool use64k, size_t from, size_t to)
+   {
+      const size_t frameLen = use64k ? 65536 : 256;
+      const size_t numframes = (to - from) / frameLen;
+      if (numframes == 0)
+         return;
+
+      Floats summary{ numframes * fields };
+      const bool gotSummary = use64k
+         ? GetSummary64k(summary.get(), from / frameLen, numframes)
+         : GetSummary256(summary.get(), from / frameLen, numframes);
+      if (!gotSummary)
+      {
+         // The summary could not be read and was zero filled; use the samples
+         accumulateSamples(from, numframes * frameLen);
+         return;
+      }
+
+      for (size_t i = 0; i < numframes; ++i)
+      {
+         const float *frame = &summary[i * fields];
+         min = std::min(min, frame[0]);
+         max = std::max(max, frame[1]);
+         sumsq += double(frame[2]) * frame[2] * frameLen;
+      }
+   };
+
+   if (start < mSampleCount)
+   {
+      len = std::min(len, mSampleCount - start);
+      const size_t end = start + len;
+
+      // The whole 256 frames, and within them the whole 64k frames
+      const size_t first256 = (start + 255) / 256 * 256;
+      const size_t last256 = end / 256 * 256;
+
+      if (first256 >= last256)
+         accumulateSamples(start, len);
+      else
+      {
+         const size_t first64k = (first256 + 65535) / 65536 * 65536;
+         const size_t last64k = last256 / 65536 * 65536;
+
+         accumulateSamples(start, first256 - start);
+         if (first64k < last64k)
+         {
+            accumulateSummary(false, first256, first64k);
+            accumulateSummary(true, first64k, last64k);
+            accumulateSummary(false, last64k, last256);
+         }
+         else
+            accumulateSummary(false, first256, last256);
+         accumulateSamples(last256, end - last256);
+      }
    }
 
    return { min, max, (float) sqrt(sumsq / len) };
@@ -518,26 +1507,59 @@ MinMaxRMS SqliteSampleBlock::DoGetMinMaxRMS(size_t start, size_t len)
 /// these values are already computed.
 MinMaxRMS SqliteSampleBlock::DoGetMinMaxRMS() const
 {
-   return { (float) mSumMin, (float) mSumMax, (float) mSumRms };
+   return { (float) GetSumMin(), (float) GetSumMax(), (float) GetSumRms() };
 }
 
 size_t SqliteSampleBlock::GetSpaceUsage() const
 {
    if (IsSilent())
       return 0;
-   else
-      return ProjectFileIO::GetDiskUsage(Conn(), mBlockID);
+
+   if (mpRow)
+   {
+      std::lock_guard< std::mutex > guard{ mpRow->mutex };
+      if (!mpRow->written)
+         // Not in the database yet; what it will take, uncompressed
+         return mpRow->sampleBytes +
+            mpRow->summary256Bytes + mpRow->summary64kBytes;
+   }
+
+   return ProjectFileIO::GetDiskUsage(Conn(), mBlockID);
+}
+
+// Copies what there is of the requested bytes, and zeroes the rest
+static void CopyBlobBytes(const char *src,
+                          size_t availbytes,
+                          sampleFormat srcformat,
+                          void *dest,
+                          sampleFormat destformat,
+                          size_t srcbytes)
+{
+   size_t minbytes = std::min(srcbytes, availbytes);
+
+   CopySamples((samplePtr) src,
+               srcformat,
+               (samplePtr) dest,
+               destformat,
+               minbytes / SAMPLE_SIZE(srcformat));
+
+   dest = ((samplePtr) dest) + minbytes;
+
+   if (srcbytes - minbytes)
+   {
+      memset(dest, 0, srcbytes - minbytes);
+   }
 }
 
 size_t SqliteSampleBlock::GetBlob(void *dest,
                                   sampleFormat destformat,
-                                  sqlite3_stmt *stmt,
+                                  SampleBlockBlobCache::Column column,
+                                  DBConnection::StatementID id,
+                                  const char *sql,
                                   sampleFormat srcformat,
                                   size_t srcoffset,
                                   size_t srcbytes)
 {
-   auto db = DB();
-
    wxASSERT(!IsSilent());
 
    if (!mValid)
@@ -545,8 +1567,160 @@ size_t SqliteSampleBlock::GetBlob(void *dest,
       Load(mBlockID);
    }
 
+   // A row that is still queued is read from memory
+   if (mpRow &&
+       CopyFromRow(dest, destformat, column, srcformat, srcoffset, srcbytes))
+   {
+      return srcbytes;
+   }
+
+   auto &cache = mpFactory->mCache;
+   auto blob = cache.Find(mBlockID, column);
+   if (!blob)
+   {
+      // A short range is read straight out of the row, touching only the
+      // pages it spans.  Longer reads fetch the whole blob and keep it, since
+      // neighbouring ranges are likely to follow.
+      const size_t blobbytes = GetBlobSize(column);
+      // Encoded samples can only be decoded whole
+      const bool encoded = column == SampleBlockBlobCache::Samples && IsCompressed();
+      if (!encoded &&
+          srcoffset < blobbytes &&
+          srcbytes < blobbytes &&
+          (!cache.IsEnabled() || srcbytes <= blobbytes / 4))
+      {
+         ArrayOf<char> range{ srcbytes };
+         size_t readbytes = 0;
+         if (ReadBlobRange(column, srcoffset, srcbytes, range.get(), readbytes))
+         {
+            CopyBlobBytes(range.get(), readbytes, srcformat, dest, destformat, srcbytes);
+            return srcbytes;
+         }
+      }
+
+      blob = ReadBlob(column, id, sql);
+      cache.Insert(mBlockID, column, blob);
+   }
+
+   const size_t blobbytes = blob->size();
+   srcoffset = std::min(srcoffset, blobbytes);
+   CopyBlobBytes(blob->data() + srcoffset, blobbytes - srcoffset,
+                 srcformat, dest, destformat, srcbytes);
+
+   return srcbytes;
+}
+
+/// Copies from the columns of a row that the writer still holds
+/// @return false if the row has been inserted meanwhile
+bool SqliteSampleBlock::CopyFromRow(void *dest,
+                                    sampleFormat destformat,
+                                    SampleBlockBlobCache::Column column,
+                                    sampleFormat srcformat,
+                                    size_t srcoffset,
+                                    size_t srcbytes)
+{
+   auto &row = *mpRow;
+   if (column != SampleBlockBlobCache::Samples)
+      Summarise(row);
+
+   std::lock_guard< std::mutex > guard{ row.mutex };
+   if (row.written)
+      return false;
+
+   const char *data;
+   size_t size;
+   switch (column)
+   {
+   case SampleBlockBlobCache::Summary256:
+      data = row.summary256.get(), size = row.summary256Bytes;
+      break;
+   case SampleBlockBlobCache::Summary64k:
+      data = row.summary64k.get(), size = row.summary64kBytes;
+      break;
+   case SampleBlockBlobCache::Samples:
+   default:
+      data = row.samples.get(), size = row.sampleBytes;
+      break;
+   }
+
+   srcoffset = std::min(srcoffset, size);
+   CopyBlobBytes(data + srcoffset, size - srcoffset,
+                 srcformat, dest, destformat, srcbytes);
+   return true;
+}
+
+bool SqliteSampleBlock::IsCompressed() const
+{
+   if (mpRow)
+   {
+      std::lock_guard< std::mutex > guard{ mpRow->mutex };
+      return mpRow->compressed;
+   }
+   return mCompressed;
+}
+
+/// The length of a column of this block's row, as written by Commit
+size_t SqliteSampleBlock::GetBlobSize(SampleBlockBlobCache::Column column) const
+{
+   const size_t frames64k = (mSampleCount + 65535) / 65536;
+   switch (column)
+   {
+   case SampleBlockBlobCache::Summary256:
+      return frames64k * 256 * bytesPerFrame;
+   case SampleBlockBlobCache::Summary64k:
+      return frames64k * bytesPerFrame;
+   case SampleBlockBlobCache::Samples:
+   default:
+      return mSampleBytes;
+   }
+}
+
+/// Reads part of a column of this block's row with incremental blob I/O,
+/// so that only the pages holding the range are read.
+/// @return false if the blob can't be opened; the caller should read it whole
+bool SqliteSampleBlock::ReadBlobRange(SampleBlockBlobCache::Column column,
+                                      size_t srcoffset,
+                                      size_t srcbytes,
+                                      char *dest,
+                                      size_t &readbytes)
+{
+   static const char *const columnNames[] = {
+      "samples", "summary256", "summary64k"
+   };
+
+   sqlite3_blob *handle = nullptr;
+   int rc = sqlite3_blob_open(DB(), "main", "sampleblocks", columnNames[column],
+                              mBlockID, 0, &handle);
+   if (rc != SQLITE_OK)
+   {
+      // The handle must be closed even when the open fails
+      sqlite3_blob_close(handle);
+      return false;
+   }
+
+   const size_t blobbytes = (size_t) sqlite3_blob_bytes(handle);
+   srcoffset = std::min(srcoffset, blobbytes);
+   readbytes = std::min(srcbytes, blobbytes - srcoffset);
+
+   rc = readbytes
+      ? sqlite3_blob_read(handle, dest, (int) readbytes, (int) srcoffset)
+      : SQLITE_OK;
+   sqlite3_blob_close(handle);
+
+   return rc == SQLITE_OK;
+}
+
+/// Reads a whole column of this block's row, for GetBlob and the cache.
+/// Compressed samples are decoded, so the cache holds them ready to copy.
+SampleBlockBlobCache::Blob SqliteSampleBlock::ReadBlob(
+   SampleBlockBlobCache::Column column,
+   DBConnection::StatementID id, const char *sql)
+{
+   auto db = DB();
    int rc;
-   size_t minbytes = 0;
+
+   // Prepare and cache statement...automatically finalized at DB close
+   sqlite3_stmt *stmt = Conn()->Prepare(id, sql);
 
    // Bind statement parameters
    // Might return SQLITE_MISUSE which means it's our mistake that we violated
@@ -572,35 +1746,35 @@ size_t SqliteSampleBlock::GetBlob(void *dest,
    }
 
    // Retrieve returned data
-   samplePtr src = (samplePtr) sqlite3_column_blob(stmt, 0);
+   const char *src = (const char *) sqlite3_column_blob(stmt, 0);
    size_t blobbytes = (size_t) sqlite3_column_bytes(stmt, 0);
 
-   srcoffset = std::min(srcoffset, blobbytes);
-   minbytes = std::min(srcbytes, blobbytes - srcoffset);
-
-   if (srcoffset != 0)
+   SampleBlockBlobCache::Blob blob;
+   bool decoded = true;
+   if (column == SampleBlockBlobCache::Samples && IsCompressed())
    {
-      srcoffset += 0;
-   }
-
-   CopySamples(src + srcoffset,
-               srcformat,
-               (samplePtr) dest,
-               destformat,
-               minbytes / SAMPLE_SIZE(srcformat));
-
-   dest = ((samplePtr) dest) + minbytes;
-
-   if (srcbytes - minbytes)
-   {
-      memset(dest, 0, srcbytes - minbytes);
+      auto samples = std::make_shared< std::vector<char> >(mSampleBytes);
+      decoded = SampleBlockCodec::Decode(src, blobbytes, mSampleFormat,
+                                         samples->data(), mSampleCount);
+      blob = samples;
    }
+   else
+      blob = std::make_shared< const std::vector<char> >(src, src + blobbytes);
 
    // Clear statement bindings and rewind statement
    sqlite3_clear_bindings(stmt);
    sqlite3_reset(stmt);
 
-   return srcbytes;
+   if (!decoded)
+   {
+      throw SimpleMessageBoxException
+      {
+         XO("Failed to decode the samples of block %lld").Format( mBlockID ),
+         XO("Warning")
+      };
+   }
+
+   return blob;
 }
 
 void SqliteSampleBlock::Load(SampleBlockID sbid)
@@ -647,45 +1821,138 @@ void SqliteSampleBlock::Load(SampleBlockID sbid)
    }
 
    // Retrieve returned data
-   mBlockID = sbid;
-   mSampleFormat = (sampleFormat) sqlite3_column_int(stmt, 0);
-   mSumMin = sqlite3_column_double(stmt, 1);
-   mSumMax = sqlite3_column_double(stmt, 2);
-   mSumRms = sqlite3_column_double(stmt, 3);
-   mSampleBytes = sqlite3_column_int(stmt, 4);
-   mSampleCount = mSampleBytes / SAMPLE_SIZE(mSampleFormat);
+   const SampleBlockMetadata metadata{
+      sbid,
+      sqlite3_column_int64(stmt, 0),
+      (size_t) sqlite3_column_int(stmt, 4),
+      sqlite3_column_double(stmt, 1),
+      sqlite3_column_double(stmt, 2),
+      sqlite3_column_double(stmt, 3)
+   };
 
    // Clear statement bindings and rewind statement
    sqlite3_clear_bindings(stmt);
    sqlite3_reset(stmt);
 
+   Load(metadata);
+}
+
+/// Initializes the block from what was read of its row, by Load or by
+/// the factory's Prefetch
+void SqliteSampleBlock::Load(const SampleBlockMetadata &metadata)
+{
+   mValid = false;
+
+   mBlockID = metadata.id;
+   const int storedFormat = (int) (metadata.storedFormat & 0x7fffffff);
+   mCompressed = (storedFormat & SampleBlockCodec::CompressedFlag) != 0;
+   mSampleFormat = (sampleFormat) (storedFormat & ~SampleBlockCodec::CompressedFlag);
+   mSumMin = metadata.sumMin;
+   mSumMax = metadata.sumMax;
+   mSumRms = metadata.sumRms;
+   mSampleBytes = metadata.storedBytes;
+   mSampleCount = mSampleBytes / SAMPLE_SIZE(mSampleFormat);
+
+   if (mCompressed)
+   {
+      // The length of the row is the encoded length; the number of samples
+      // is stored with the format
+      mSampleCount =
+         (size_t) (metadata.storedFormat >> SampleBlockCodec::SampleCountShift);
+
+      // Rows that don't have it there only have it in the blob's header,
+      // which is read without touching the rest
+      char header[SampleBlockCodec::HeaderBytes];
+      size_t readbytes = 0;
+      if (mSampleCount == 0 &&
+          (!ReadBlobRange(SampleBlockBlobCache::Samples, 0, sizeof(header), header, readbytes) ||
+           (mSampleCount = SampleBlockCodec::DecodedSampleCount(header, readbytes)) == 0))
+      {
+         throw SimpleMessageBoxException
+         {
+            XO("Failed to decode the samples of block %lld").Format( mBlockID ),
+            XO("Warning")
+         };
+      }
+      mSampleBytes = mSampleCount * SAMPLE_SIZE(mSampleFormat);
+   }
+
    mValid = true;
 }
 
-void SqliteSampleBlock::Commit(Sizes sizes)
+/// Inserts the row of this block here and now, on the calling thread
+void SqliteSampleBlock::Commit(SampleBlockRow &row)
 {
-   const auto mSummary256Bytes = sizes.first;
-   const auto mSummary64kBytes = sizes.second;
+   mCompressed = InsertRow(*Conn(), row, mpFactory->mCompress);
+   mBlockID = row.id;
+   mSumMin = row.sumMin;
+   mSumMax = row.sumMax;
+   mSumRms = row.sumRms;
 
-   auto db = DB();
+   mValid = true;
+}
+
+SampleBlockRow &SqliteSampleBlock::Summarise(SampleBlockRow &row)
+{
+   std::lock_guard< std::mutex > guard{ row.mutex };
+   if (!row.summarised)
+   {
+      CalcSummary(row);
+      row.summarised = true;
+   }
+   return row;
+}
+
+bool SqliteSampleBlock::InsertRow(
+   DBConnection &conn, SampleBlockRow &row, bool compress)
+{
+   auto db = conn.DB();
    int rc;
 
+   // Summaries stay as they are, so that drawing never has to decode.
+   // The samples are only stored compressed if that makes them smaller.
+   sqlite3_int64 storedFormat = row.format;
+   const char *storedSamples = row.samples.get();
+   size_t storedBytes = row.sampleBytes;
+   std::vector<char> encoded;
+   const bool compressed = compress &&
+      SampleBlockCodec::Encode(row.samples.get(), row.sampleCount, row.format, encoded);
+   if (compressed)
+   {
+      storedFormat |= SampleBlockCodec::CompressedFlag |
+         ((sqlite3_int64) row.sampleCount << SampleBlockCodec::SampleCountShift);
+      storedSamples = encoded.data();
+      storedBytes = encoded.size();
+
+      // Older builds must refuse the project rather than misread the row.
+      // In the same transaction as the row, so they roll back together
+      if (!ProjectFileIO::MarkCompressedBlocks(conn))
+      {
+         wxLogDebug(wxT("SqliteSampleBlock::InsertRow - SQLITE error %s"), sqlite3_errmsg(db));
+         conn.ThrowException( true );
+      }
+   }
+
    // Prepare and cache statement...automatically finalized at DB close
-   sqlite3_stmt *stmt = Conn()->Prepare(DBConnection::InsertSampleBlock,
+   sqlite3_stmt *stmt = conn.Prepare(DBConnection::InsertSampleBlock,
       "INSERT INTO sampleblocks (sampleformat, summin, summax, sumrms,"
-      "                          summary256, summary64k, samples)"
-      "                         VALUES(?1,?2,?3,?4,?5,?6,?7);");
+      "                          summary256, summary64k, samples, blockid)"
+      "                         VALUES(?1,?2,?3,?4,?5,?6,?7,?8);");
 
    // Bind statement parameters
    // Might return SQLITE_MISUSE which means it's our mistake that we violated
    // preconditions; should return SQL_OK which is 0
-   if (sqlite3_bind_int(stmt, 1, mSampleFormat) ||
-       sqlite3_bind_double(stmt, 2, mSumMin) ||
-       sqlite3_bind_double(stmt, 3, mSumMax) ||
-       sqlite3_bind_double(stmt, 4, mSumRms) ||
-       sqlite3_bind_blob(stmt, 5, mSummary256.get(), mSummary256Bytes, SQLITE_STATIC) ||
-       sqlite3_bind_blob(stmt, 6, mSummary64k.get(), mSummary64kBytes, SQLITE_STATIC) ||
-       sqlite3_bind_blob(stmt, 7, mSamples.get(), mSampleBytes, SQLITE_STATIC))
+   // A null blockid has the database assign the next one
+   if (sqlite3_bind_int64(stmt, 1, storedFormat) ||
+       sqlite3_bind_double(stmt, 2, row.sumMin) ||
+       sqlite3_bind_double(stmt, 3, row.sumMax) ||
+       sqlite3_bind_double(stmt, 4, row.sumRms) ||
+       sqlite3_bind_blob(stmt, 5, row.summary256.get(), row.summary256Bytes, SQLITE_STATIC) ||
+       sqlite3_bind_blob(stmt, 6, row.summary64k.get(), row.summary64kBytes, SQLITE_STATIC) ||
+       sqlite3_bind_blob(stmt, 7, storedSamples, storedBytes, SQLITE_STATIC) ||
+       (row.id > 0
+          ? sqlite3_bind_int64(stmt, 8, row.id)
+          : sqlite3_bind_null(stmt, 8)))
    {
       wxASSERT_MSG(false, wxT("Binding failed...bug!!!"));
    }
@@ -702,22 +1969,18 @@ void SqliteSampleBlock::Commit(Sizes sizes)
 
       // Just showing the user a simple message, not the library error too
       // which isn't internationalized
-      Conn()->ThrowException( true );
+      conn.ThrowException( true );
    }
 
    // Retrieve returned data
-   mBlockID = sqlite3_last_insert_rowid(db);
-
-   // Reset local arrays
-   mSamples.reset();
-   mSummary256.reset();
-   mSummary64k.reset();
+   if (row.id <= 0)
+      row.id = sqlite3_last_insert_rowid(db);
 
    // Clear statement bindings and rewind statement
    sqlite3_clear_bindings(stmt);
    sqlite3_reset(stmt);
 
-   mValid = true;
+   return compressed;
 }
 
 void SqliteSampleBlock::Delete()
@@ -778,25 +2041,27 @@ auto SqliteSampleBlock::SetSizes(
 
 /// Calculates summary block data describing this sample data.
 ///
-/// This method also has the side effect of setting the mSumMin,
-/// mSumMax, and mSumRms members of this class.
+/// This method also has the side effect of setting the sumMin,
+/// sumMax, and sumRms members of the row.
 ///
-void SqliteSampleBlock::CalcSummary(Sizes sizes)
+void SqliteSampleBlock::CalcSummary(SampleBlockRow &row)
 {
-   const auto mSummary256Bytes = sizes.first;
-   const auto mSummary64kBytes = sizes.second;
+   const auto mSummary256Bytes = row.summary256Bytes;
+   const auto mSummary64kBytes = row.summary64kBytes;
+   const auto mSampleFormat = row.format;
+   const auto mSampleCount = row.sampleCount;
 
    Floats samplebuffer;
    float *samples;
 
    if (mSampleFormat == floatSample)
    {
-      samples = (float *) mSamples.get();
+      samples = (float *) row.samples.get();
    }
    else
    {
       samplebuffer.reinit((unsigned) mSampleCount);
-      CopySamples(mSamples.get(),
+      CopySamples(row.samples.get(),
                   mSampleFormat,
                   (samplePtr) samplebuffer.get(),
                   floatSample,
@@ -804,11 +2069,11 @@ void SqliteSampleBlock::CalcSummary(Sizes sizes)
       samples = samplebuffer.get();
    }
    
-   mSummary256.reinit(mSummary256Bytes);
-   mSummary64k.reinit(mSummary64kBytes);
+   row.summary256.reinit(mSummary256Bytes);
+   row.summary64k.reinit(mSummary64kBytes);
 
-   float *summary256 = (float *) mSummary256.get();
-   float *summary64k = (float *) mSummary64k.get();
+   float *summary256 = (float *) row.summary256.get();
+   float *summary64k = (float *) row.summary64k.get();
 
    float min;
    float max;
@@ -868,7 +2133,7 @@ void SqliteSampleBlock::CalcSummary(Sizes sizes)
    }
 
    // Calculate now while we can do it accurately
-   mSumRms = sqrt(totalSquares / mSampleCount);
+   row.sumRms = sqrt(totalSquares / mSampleCount);
 
    // Recalc 64K summaries
    sumLen = (mSampleCount + 65535) / 65536;
@@ -933,8 +2198,8 @@ void SqliteSampleBlock::CalcSummary(Sizes sizes)
       }
    }
 
-   mSumMin = min;
-   mSumMax = max;
+   row.sumMin = min;
+   row.sumMax = max;
 }
 
 // Inject our database implementation at startup
@@ -0,0 +1,140 @@
+/**********************************************************************
+
+   Audacity - A Digital Audio Editor
+   Copyright 1999-2020 Audacity Team
+   License: wxwidgets
+
+   IAL: batch labeling for scripts and macros
+
+******************************************************************//**
+
+\file LabelFilesCommand.cpp
+\brief Definitions for LabelFilesCommand class
+
+*//*******************************************************************/
+
+#include "../Audacity.h"
+#include "LabelFilesCommand.h"
+
+#include <algorithm>
+#include <wx/ffile.h>
+
+#include "LoadCommands.h"
+#include "CommandContext.h"
+#include "../Shuttle.h"
+#include "../ShuttleGui.h"
+#include "../labeler/IALBatchLabeler.hpp"
+
+const ComponentInterfaceSymbol LabelFilesCommand::Symbol
+{ XO("Label Files") };
+
+namespace{ BuiltinCommandsModule::Registration< LabelFilesCommand > reg; }
+
+enum {
+   kLabels,
+   kProject,
+   kBoth,
+   nOutputs
+};
+
+static const EnumValueSymbol kOutputs[nOutputs] =
+{
+   { XO("Labels") },
+   { XO("Project") },
+   { XO("Both") },
+};
+
+bool LabelFilesCommand::DefineParams( ShuttleParams & S ){
+   S.Define( mFiles, wxT("Files"), "" );
+   S.Define( mFileList, wxT("FileList"), "" );
+   S.Define( mOutputDir, wxT("OutputDir"), "" );
+   S.DefineEnum( mOutput, wxT("Output"), kLabels, kOutputs, nOutputs );
+   S.Define( mMaxFiles, wxT("MaxFiles"), 0, 0, 256 );
+   return true;
+}
+
+void LabelFilesCommand::PopulateOrExchange(ShuttleGui & S)
+{
+   S.AddSpace(0, 5);
+
+   S.StartMultiColumn(2, wxALIGN_CENTER);
+   {
+      S.TieTextBox(XXO("Files:"),mFiles,60);
+      S.TieTextBox(XXO("File List:"),mFileList,60);
+      S.TieTextBox(XXO("Output Folder:"),mOutputDir,60);
+      S.TieChoice( XXO("Output:"),
+         mOutput, Msgids( kOutputs, nOutputs ));
+      S.TieTextBox(XXO("Files at Once:"),mMaxFiles);
+   }
+   S.EndMultiColumn();
+}
+
+bool LabelFilesCommand::Apply(const CommandContext & context)
+{
+   // Files are given inline (separated by ';'), and/or one per line in
+   // a list file, which is handier for thousands of them
+   wxArrayString paths = IALParseBatchFileList( mFiles );
+   if ( !mFileList.empty() ) {
+      wxFFile listFile;
+      wxString text;
+      if ( !listFile.Open( mFileList ) || !listFile.ReadAll( &text ) ) {
+         context.Error( wxString::Format( wxT("Could not read file list: %s"), mFileList ) );
+         return false;
+      }
+      for ( const auto &path : IALParseBatchFileList( text ) )
+         paths.Add( path );
+   }
+
+   if ( paths.empty() ) {
+      context.Error( wxT("No files to label.") );
+      return false;
+   }
+
+   IALBatchOptions options;
+   options.outputDir = mOutputDir;
+   options.writeLabels = ( mOutput == kLabels || mOutput == kBoth );
+   options.writeProjects = ( mOutput == kProject || mOutput == kBoth );
+   options.maxFilesInFlight = (size_t) std::max( 0, mMaxFiles );
+
+   std::vector<IALBatchFileResult> results;
+   try {
+      results = RunBatchLabeling( context.project, paths, options,
+         [&]( const wxString &fileName, size_t filesDone, size_t filesTotal ) {
+            context.Progress( (double) filesDone / filesTotal );
+            return true;
+         } );
+   }
+   catch ( const std::exception &e ) {
+      // e.g. the model could not be loaded
+      context.Error( wxString::Format( wxT("Labeling failed: %s"), e.what() ) );
+      return false;
+   }
+
+   size_t failed = 0;
+   context.StartArray();
+   for ( const auto &result : results ) {
+      context.StartStruct();
+      context.AddItem( result.inputPath, "file" );
+      context.AddItem( (double) result.tracksLabeled, "tracks" );
+      context.AddItem( (double) result.labels, "labels" );
+      context.AddItem( result.seconds, "seconds" );
+      context.StartField( "outputs" );
+      context.StartArray();
+      for ( const auto &output : result.outputs )
+         context.AddItem( output );
+      context.EndArray();
+      context.EndField();
+      if ( !result.error.empty() ) {
+         context.AddItem( result.error, "error" );
+         ++failed;
+      }
+      context.EndStruct();
+   }
+   context.EndArray();
+
+   context.Status( wxString::Format( wxT("Labeled %d of %d file(s)"),
+      (int) ( results.size() - failed ), (int) paths.size() ) );
+
+   // One bad file doesn't fail the batch; the results say which
+   return failed < results.size();
+}
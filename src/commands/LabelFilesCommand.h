@@ -0,0 +1,51 @@
+/**********************************************************************
+
+   Audacity - A Digital Audio Editor
+   Copyright 1999-2020 Audacity Team
+   License: wxWidgets
+
+   IAL: batch labeling for scripts and macros
+
+******************************************************************//**
+
+\file LabelFilesCommand.h
+\brief Contains definition of LabelFilesCommand class.
+
+*//***************************************************************//**
+
+\class LabelFilesCommand
+\brief Command that imports a list of audio files, labels each one with
+the instrument labeler and writes out label files and/or projects,
+without touching the current project.
+
+*//*******************************************************************/
+
+#ifndef __LABEL_FILES_COMMAND__
+#define __LABEL_FILES_COMMAND__
+
+#include "Command.h"
+#include "CommandType.h"
+
+class LabelFilesCommand : public AudacityCommand
+{
+public:
+   static const ComponentInterfaceSymbol Symbol;
+
+   // ComponentInterface overrides
+   ComponentInterfaceSymbol GetSymbol() override {return Symbol;};
+   TranslatableString GetDescription() override {return XO("Labels the instruments in a list of audio files.");};
+   bool DefineParams( ShuttleParams & S ) override;
+   void PopulateOrExchange(ShuttleGui & S) override;
+   bool Apply(const CommandContext & context) override;
+
+   // AudacityCommand overrides
+   wxString ManualPage() override {return wxT("Extra_Menu:_Scriptables_II#label_files");};
+public:
+   wxString mFiles;
+   wxString mFileList;
+   wxString mOutputDir;
+   int mOutput;
+   int mMaxFiles;
+};
+
+#endif /* End of include guard: __LABEL_FILES_COMMAND__ */
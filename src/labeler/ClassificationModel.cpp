@@ -1,5 +1,10 @@
 #include "ClassificationModel.h"
 
+#include <algorithm>
+
+const int32_t ClassificationModel::kNotSure;
+const int32_t ClassificationModel::kSilence;
+
 
 /*
 @briefs: forward pass through the model and get a list of classes with the highest probabilities for every instance in the batch. 
@@ -35,59 +40,196 @@ std::vector<std::string> ClassificationModel::predictFromAudioSequence(const tor
    return predictions;
 }
 
-std::vector<std::string> ClassificationModel::constructLabelsFromProbits(const torch::Tensor confidences, 
-                                                       const torch::Tensor indices, 
-                                                       float confidenceThreshold)
+/*
+@brief: packs many variable-length frame sequences into as few forward passes as possible.
+   sequences are stacked along the batch dimension and right-padded with zeros up to the 
+   longest sequence (or to the fixed sequence length, for traced models). the outputs for padded 
+   steps are dropped, which is safe because the recurrent model only looks backwards in time.
+@params:
+   std::vector<torch::Tensor> sequences: audio sequences, each with shape (seq, 1, 1, chunkLen)
+   std::vector<torch::Tensor> *embeddings (optional): if given, also filled with each sequence's 
+      embeddings (see embed), each with shape (seq, embedding size), from the same packed batches
+@returns:
+   std::vector<torch::Tensor> probits: per-class probabilities for each sequence, each with shape (seq, n_classes)
+*/
+std::vector<torch::Tensor> ClassificationModel::predictSequenceBatch(const std::vector<torch::Tensor> &sequences,
+                                                                     std::vector<torch::Tensor> *embeddings)
 {
-   std::vector<std::string> predictions;
-   // iterate through confs and idxs
-   for (int i = 0; i < confidences.sizes()[0]; ++i){
-      // grab our confidence mesaure
-      auto conf = confidences.index({i}).item().to<float>();
-      auto idx = indices.index({i}).item().to<int>();
-
-      // return a not-sure if the probability is less than 0.3
-      std::string prediction;
-      if (conf < confidenceThreshold){
-         prediction = "not-sure";
-      } else {
-         prediction = classes.at(int(idx));
+   std::vector<torch::Tensor> results;
+   results.reserve(sequences.size());
+   if (embeddings){
+      embeddings->clear();
+      embeddings->reserve(sequences.size());
+   }
+
+   for (size_t batchStart = 0; batchStart < sequences.size(); batchStart += maxBatchSize)
+   {
+      size_t batchEnd = std::min(sequences.size(), batchStart + size_t(maxBatchSize));
+      int64_t batchSize = batchEnd - batchStart;
+
+      int64_t seqLen = fixedSequenceLength;
+      if (seqLen <= 0){
+         for (size_t i = batchStart; i < batchEnd; ++i){
+            seqLen = std::max(seqLen, sequences[i].size(0));
+         }
+      }
+
+      // shape (seq, batch, 1, chunkLen), zero (silent) past the end of each sequence
+      torch::Tensor batch = torch::zeros({seqLen, batchSize, 1, chunkLen}, torch::kFloat32);
+      for (int64_t b = 0; b < batchSize; ++b){
+         const torch::Tensor &sequence = sequences[batchStart + b];
+         assert(sequence.size(0) <= seqLen);
+         batch.narrow(0, 0, sequence.size(0)).select(1, b).copy_(sequence.select(1, 0));
+      }
+
+      // probits should be a tensor size (seq, batch, probit)
+      torch::Tensor probits = predict(batch);
+      torch::Tensor embedded;
+      if (embeddings){
+         embedded = hasEmbedding() ? embed(batch) : probits;
+      }
+
+      for (int64_t b = 0; b < batchSize; ++b){
+         int64_t length = sequences[batchStart + b].size(0);
+         results.push_back(probits.narrow(0, 0, length).select(1, b));
+         if (embeddings){
+            embeddings->push_back(embedded.narrow(0, 0, length).select(1, b));
+         }
       }
-      
-      predictions.push_back(prediction);
    }
-   return predictions;
+
+   return results;
 }
 
-// this is not actually a proper test and will be deleted
-void ClassificationModel::modelTest(torch::Tensor inputAudio){
-   try{
-      std::cout << " downmixing audio" << "\n";
-      // inputAudio = downmix(inputAudio);
-
-      std::cout << "doing predictions:" << "\n";
-      std::vector<std::string> predictions = predictFromAudioFrame(inputAudio);
-      
-      // log labels
-      for (const auto &e : predictions) std::cout << e << "\n";
-   }
-   catch (const std::exception &e){ // hopefully, the exception subclasses the std exception so this would work
-      std::cout << e.what() << "\n";
-   }
-   catch (...) {
-      std::cout << "an unknown error occured" << "\n";
+std::vector<std::vector<std::string>> ClassificationModel::predictFromAudioSequenceBatch(const std::vector<torch::Tensor> &sequences,
+                                                                                         float confidenceThreshold = 0.3)
+{
+   std::vector<std::vector<std::string>> predictions;
+
+   for (auto &probits : predictSequenceBatch(sequences))
+   {
+      predictions.push_back(predictFromProbits(probits, confidenceThreshold));
    }
+
+   return predictions;
 }
 
+/*
+@brief: turns already-computed class probabilities into labels, without running the model
+@params:
+   torch::Tensor probits: per-class probabilities with shape (seq, n_classes)
+   float confidenceThreshold: probabilities under this value will be labeled 'not-sure'
+*/
+std::vector<std::string> ClassificationModel::predictFromProbits(const torch::Tensor probits, float confidenceThreshold)
+{
+   return classNames(classIdsFromProbits(probits, confidenceThreshold));
+}
 
+std::vector<std::string> ClassificationModel::constructLabelsFromProbits(const torch::Tensor confidences, 
+                                                       const torch::Tensor indices, 
+                                                       float confidenceThreshold)
+{
+   return classNames(thresholdClassIds(confidences, indices, confidenceThreshold));
+}
 
+/*
+@brief: copies a tensor of class indices out in one contiguous transfer
+*/
+static std::vector<int32_t> copyClassIds(torch::Tensor ids)
+{
+   ids = ids.to(torch::kInt32).contiguous().view(-1);
+   const int32_t *data = ids.data_ptr<int32_t>();
+   return std::vector<int32_t>(data, data + ids.numel());
+}
+
+/*
+@brief: picks the most likely class for every row of probits, with whole-tensor operations
+   and a single copy out of the tensor, rather than a round trip per element.
+@params:
+   torch::Tensor probits: per-class probabilities with shape (..., n_classes)
+   float confidenceThreshold: rows whose best probability is under this value get kNotSure
+@returns:
+   std::vector<int32_t> classIds: one index into the class list (or kNotSure) per row
+*/
+std::vector<int32_t> ClassificationModel::classIdsFromProbits(const torch::Tensor probits, float confidenceThreshold)
+{
+   auto [confidences, indices] = probits.max(-1, false);
+   return thresholdClassIds(confidences, indices, confidenceThreshold);
+}
+
+std::vector<int32_t> ClassificationModel::thresholdClassIds(const torch::Tensor confidences,
+                                                            const torch::Tensor indices,
+                                                            float confidenceThreshold)
+{
+   return copyClassIds(indices.masked_fill(confidences < confidenceThreshold, kNotSure));
+}
+
+/*
+@brief: the k most likely classes for every row of probits, most likely first
+@params:
+   torch::Tensor probits: per-class probabilities with shape (..., n_classes)
+   int k: the number of classes to keep per row. clamped to the number of classes
+@returns (through classIds and confidences):
+   k entries per row, one row after another
+*/
+void ClassificationModel::topKFromProbits(const torch::Tensor probits, int k,
+                                          std::vector<int32_t> &classIds, std::vector<float> &confidences)
+{
+   k = int(std::min<int64_t>(k, probits.size(-1)));
+   auto [values, indices] = probits.topk(k, -1, /*largest = */ true, /*sorted = */ true);
+
+   classIds = copyClassIds(indices);
 
+   values = values.to(torch::kFloat32).contiguous().view(-1);
+   const float *data = values.data_ptr<float>();
+   confidences.assign(data, data + values.numel());
+}
+
+const std::string &ClassificationModel::className(int32_t classId)
+{
+   static const std::string notSure = "not-sure";
+   static const std::string silence = "silence";
+
+   if (classId == kSilence){
+      return silence;
+   }
+   if (classId < 0 || classId >= int32_t(classes.size())){
+      return notSure;
+   }
+   return classes[classId];
+}
+
+std::vector<std::string> ClassificationModel::classNames(const std::vector<int32_t> &classIds)
+{
+   std::vector<std::string> names;
+   names.reserve(classIds.size());
+   for (auto classId : classIds){
+      names.push_back(className(classId));
+   }
+   return names;
+}
 
 torch::Tensor ClassificationModel::predict(const torch::Tensor inputAudio, bool addSoftmax)
 {
    auto output = modelForward(inputAudio);
    // adding a softmax here
    auto probits = torch::softmax(output, -1);
-   std::cout << probits << '\n';
    return probits;
 }
+
+/*
+@brief: the model's internal representation of each frame, for comparing how frames sound rather than
+   what they are. models without an embed method fall back to their class probabilities, which still
+   place frames of similar instruments near each other.
+@params:
+   torch::Tensor inputAudio: the same input predict takes
+@returns:
+   torch::Tensor embeddings: one vector per frame, with shape (..., embedding size)
+*/
+torch::Tensor ClassificationModel::embed(const torch::Tensor inputAudio)
+{
+   if (!hasEmbedding()){
+      return predict(inputAudio);
+   }
+   return modelEmbed(inputAudio);
+}
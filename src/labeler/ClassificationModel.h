@@ -13,10 +13,28 @@ public:
     torch::Tensor predict(const torch::Tensor inputAudio, bool addSoftmax = true);
     std::vector<std::string> predictFromAudioFrame(const torch::Tensor audioBatch, float confidenceThreshold);
     std::vector<std::string> predictFromAudioSequence(const torch::Tensor audioSequence, float confidenceThreshold);
+    torch::Tensor embed(const torch::Tensor inputAudio);
+    std::vector<torch::Tensor> predictSequenceBatch(const std::vector<torch::Tensor> &sequences,
+                                                    std::vector<torch::Tensor> *embeddings = nullptr);
+    std::vector<std::vector<std::string>> predictFromAudioSequenceBatch(const std::vector<torch::Tensor> &sequences,
+                                                                        float confidenceThreshold);
+    std::vector<std::string> predictFromProbits(const torch::Tensor probits, float confidenceThreshold);
     std::vector<std::string> constructLabelsFromProbits(const torch::Tensor confidences, const torch::Tensor indices, 
                                             float confidenceThreshold);
 
-    void modelTest(torch::Tensor inputAudio);
+    // class ids are indices into the class list, or one of these
+    static const int32_t kNotSure = -1;
+    static const int32_t kSilence = -2;
+
+    std::vector<int32_t> classIdsFromProbits(const torch::Tensor probits, float confidenceThreshold);
+    std::vector<int32_t> thresholdClassIds(const torch::Tensor confidences, const torch::Tensor indices,
+                                           float confidenceThreshold);
+    void topKFromProbits(const torch::Tensor probits, int k,
+                         std::vector<int32_t> &classIds, std::vector<float> &confidences);
+
+    // strings are only made when labels are emitted
+    const std::string &className(int32_t classId);
+    std::vector<std::string> classNames(const std::vector<int32_t> &classIds);
 };
 
 
@@ -1,5 +1,29 @@
 #include "DeepModel.h"
 
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+
+#include <wx/log.h>
+
+#include <ATen/Parallel.h>
+#include <torch/csrc/jit/passes/freeze_module.h>
+
+static std::mutex inferenceOptionsMutex;
+static InferenceOptions inferenceOptions;
+
+/**
+ @brief: the quantized variant of a model lives next to it, e.g. ial-model.int8.pt for ial-model.pt
+*/
+static std::string quantizedModelPath(const std::string &modelPath){
+   std::string path = modelPath;
+   const std::string extension = ".pt";
+   if (path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0){
+      path.erase(path.size() - extension.size());
+   }
+   return path + ".int8.pt";
+}
+
 /**
  @brief: creates a classifier instance
  @param modelPath path to jit model (.pt) file.
@@ -7,8 +31,84 @@
  NOTE: the class file must have each class name separated by a newline
 */
 DeepModel::DeepModel(const std::string &modelPath, const std::string &classlistPath){
-   jitModel = loadModel(modelPath);
+   const InferenceOptions options = getInferenceOptions();
+
+   std::string loadPath = modelPath;
+   if (options.quantized && std::ifstream(quantizedModelPath(modelPath)).good()){
+      loadPath = quantizedModelPath(modelPath);
+      quantized = true;
+   }
+
+   jitModel = loadModel(loadPath);
+   // the metadata has to be read before freezing folds the attributes away
+   loadMetadata();
+   if (options.freeze){
+      optimizeModel();
+   }
+
    classes = loadClasslist(classlistPath);
+   // hash the file that was actually loaded, so that the two variants don't share cached predictions
+   modelHash = int64_t(hashFile(classlistPath, hashFile(loadPath, 14695981039346656037ULL)));
+}
+
+/**
+ @brief: sets how models are loaded and run. see InferenceOptions
+*/
+void DeepModel::setInferenceOptions(const InferenceOptions &options){
+   {
+      std::lock_guard<std::mutex> guard(inferenceOptionsMutex);
+      inferenceOptions = options;
+   }
+
+   if (options.intraOpThreads > 0){
+      at::set_num_threads(options.intraOpThreads);
+   }
+
+   if (options.interOpThreads > 0){
+      try {
+         at::set_num_interop_threads(options.interOpThreads);
+      }
+      catch (const c10::Error& e) {
+         // libtorch refuses once the pool is running; keep the current size
+         wxLogDebug("DeepModel: could not set inter-op threads: %s", e.what());
+      }
+   }
+
+   // dynamically quantized linear and lstm layers need a quantized engine that this cpu supports
+   if (options.quantized){
+      const auto &engines = at::globalContext().supportedQEngines();
+      if (std::find(engines.begin(), engines.end(), at::QEngine::FBGEMM) != engines.end()){
+         at::globalContext().setQEngine(at::QEngine::FBGEMM);
+      } else if (std::find(engines.begin(), engines.end(), at::QEngine::QNNPACK) != engines.end()){
+         at::globalContext().setQEngine(at::QEngine::QNNPACK);
+      }
+   }
+}
+
+InferenceOptions DeepModel::getInferenceOptions(){
+   std::lock_guard<std::mutex> guard(inferenceOptionsMutex);
+   return inferenceOptions;
+}
+
+/**
+ @brief: FNV-1a hash of a file's contents. unlike std::hash, this is stable across runs and platforms,
+    so it can be stored in a project.
+ @param filepath the file to hash
+ @param seed the hash to continue from
+*/
+uint64_t DeepModel::hashFile(const std::string &filepath, uint64_t seed) {
+   uint64_t hash = seed;
+   std::ifstream file(filepath, std::ios::binary);
+
+   char buffer[65536];
+   while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+      for (std::streamsize i = 0; i < file.gcount(); ++i) {
+         hash ^= (unsigned char)buffer[i];
+         hash *= 1099511628211ULL;
+      }
+   }
+
+   return hash;
 }
 
 /**
@@ -30,6 +130,49 @@ torch::jit::script::Module DeepModel::loadModel(const std::string &filepath) {
    return model;
 }
 
+/**
+ @brief: freezes the loaded module. parameters and attributes become constants in the graph, which lets
+    the jit fold and fuse far more of it. a module that can't be frozen is left as it is.
+*/
+void DeepModel::optimizeModel() {
+   // freezing only keeps forward, unless we ask for the other methods we call
+   std::vector<std::string> preserved;
+   if (embeddingMethod){
+      preserved.push_back("embed");
+   }
+
+   try {
+      jitModel = torch::jit::freeze_module(jitModel, preserved);
+   }
+   catch (const c10::Error& e) {
+      wxLogDebug("DeepModel: could not freeze model, running it unfrozen: %s", e.what());
+   }
+}
+
+/**
+ @brief: reads the framing the model was exported with from integer attributes on the scripted module:
+    sample_rate, window_length (the chunk length), hop_length and sequence_length. 
+    missing attributes keep their defaults, so older models behave as before.
+    also notes whether the module exports an embed method.
+*/
+void DeepModel::loadMetadata() {
+   auto readInt = [this](const char *name, int &value) {
+      if (jitModel.hasattr(name)) {
+         auto attr = jitModel.attr(name);
+         if (attr.isInt()) {
+            value = int(attr.toInt());
+         }
+      }
+   };
+
+   readInt("sample_rate", sampleRate);
+   readInt("window_length", chunkLen);
+   readInt("hop_length", hopLen);
+   readInt("sequence_length", fixedSequenceLength);
+
+   embeddingMethod = bool(jitModel.find_method("embed"));
+}
+
 /**
  @brief: returns a torch::jit::model specified by filepath
  @param filepath location of torch model
@@ -112,13 +255,28 @@ torch::Tensor DeepModel::modelForward(const torch::Tensor inputAudio){
    std::vector<torch::jit::IValue> inputs;
    inputs.push_back(inputAudio);
 
-   auto sz = inputAudio.sizes().vec();
-   // for (int i = 0; i < sz[3]; i++){
-   //    std::cout<<inputAudio[0][0][0][i]<<std::endl;
-   // }
-   
+   // we never train, so don't record anything for autograd
+   torch::NoGradGuard noGrad;
+
    // get class probabilities
    auto output = jitModel.forward({inputs}).toTensor();
    return output;
 }
 
+/*
+@brief: forward pass through the model's embed method, which models can export alongside forward
+   to expose the representation their classifier head sees
+@params:
+   torch::Tensor inputAudio: the same input forward takes
+@returns:
+   torch::Tensor embeddings: one vector per frame, with shape (..., embedding size)
+*/
+torch::Tensor DeepModel::modelEmbed(const torch::Tensor inputAudio){
+   std::vector<torch::jit::IValue> inputs;
+   inputs.push_back(inputAudio);
+
+   torch::NoGradGuard noGrad;
+
+   auto output = jitModel.get_method("embed")(inputs).toTensor();
+   return output;
+}
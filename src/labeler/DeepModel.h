@@ -7,10 +7,36 @@
 #include <torch/script.h>
 
 
+/**
+ @brief: process-wide settings for how models are loaded and run
+*/
+struct InferenceOptions {
+   // freeze the scripted module at load, folding its weights and attributes into the graph
+   bool freeze = true;
+   // load <model>.int8.pt, a dynamically quantized export of the model, in place of <model>.pt when it exists
+   bool quantized = false;
+   // sizes of libtorch's thread pools. values <= 0 keep libtorch's defaults
+   int intraOpThreads = 0;
+   int interOpThreads = 0;
+};
+
 class DeepModel {
    torch::jit::script::Module loadModel(const std::string &filepath);
+   void optimizeModel();
    
+   // the model's input window, in samples at sampleRate
    int chunkLen = 48000;
+   int sampleRate = 48000;
+
+   // how far apart consecutive windows start. a value <= 0 means one window length (no overlap)
+   int hopLen = 0;
+
+   // the traced LSTM only accepts sequences of exactly this many frames.
+   // a value <= 0 means the model accepts any sequence length
+   int fixedSequenceLength = 10;
+
+   // upper bound on the number of sequences packed into one forward pass
+   int maxBatchSize = 64;
 
    public:
       
@@ -19,17 +45,48 @@ class DeepModel {
       DeepModel(const std::string &modelPath, const std::string &classlistPath);
 
       const std::vector<std::string> &getClasslist() {return classes;}
+      // identifies the model weights and class list, e.g. to invalidate cached predictions
+      const int64_t getModelHash() {return modelHash;}
       const int getChunkLen() {return chunkLen;}
       void setChunkLen(int newLen) {chunkLen = newLen;}
+      const int getSampleRate() {return sampleRate;}
+      void setSampleRate(int newRate) {sampleRate = newRate;}
+      // never more than the chunk length, so that every sample is covered by some window
+      const int getHopLen() {return (hopLen > 0 && hopLen < chunkLen) ? hopLen : chunkLen;}
+      void setHopLen(int newLen) {hopLen = newLen;}
+      const int getFixedSequenceLength() {return fixedSequenceLength;}
+      void setFixedSequenceLength(int newLen) {fixedSequenceLength = newLen;}
+      const int getMaxBatchSize() {return maxBatchSize;}
+      void setMaxBatchSize(int newSize) {maxBatchSize = newSize;}
 
       torch::Tensor downmix(const torch::Tensor audioBatch);
       torch::Tensor padAndReshape(const torch::Tensor audio);
 
       torch::Tensor modelForward(const torch::Tensor inputAudio);
 
+      // true if the scripted module has an embed method, which takes the same input as forward
+      // and returns its internal representation of each frame
+      const bool hasEmbedding() {return embeddingMethod;}
+      torch::Tensor modelEmbed(const torch::Tensor inputAudio);
+
+      // applies the thread counts right away; the rest takes effect for models loaded afterwards.
+      // the inter-op pool can only be sized before libtorch first uses it, so call this at startup
+      static void setInferenceOptions(const InferenceOptions &options);
+      static InferenceOptions getInferenceOptions();
+
+      // true if the quantized variant of the model was loaded
+      const bool isQuantized() {return quantized;}
+
    protected:
+      void loadMetadata();
+
       torch::jit::script::Module jitModel;
       std::vector<std::string> classes;
+      int64_t modelHash = 0;
+      bool quantized = false;
+      bool embeddingMethod = false;
+
+      static uint64_t hashFile(const std::string &filepath, uint64_t seed);
 };
 
 #endif
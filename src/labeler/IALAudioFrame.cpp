@@ -9,6 +9,8 @@
 
 #include <math.h>
 #include <algorithm>
+#include <chrono>
+#include <map>
 #include "portaudio.h"
 #include <tgmath.h>
 #include <string>
@@ -19,7 +21,9 @@
 #include "../WaveTrack.h"
 #include "../Track.h"
 #include "../WaveClip.h"
-#include "../FileNames.h"
+#include "../Sequence.h"
+#include "../LabelTrack.h"
+#include "../Resample.h"
 #include "ClassificationModel.h"
 #include "IALLabeler.hpp"
 
@@ -40,59 +44,71 @@ bool trackInTrackList(TrackList& tracklist, std::shared_ptr<LabelTrack> track){
 // #pragma mark AudioFrame - Public
 
 IALAudioFrame::IALAudioFrame(IALAudioFrameCollection &collection, const sampleCount start, const size_t desiredLength)
-    : collection(collection), start(start), desiredLength(desiredLength), cachedHash(arc4random())
+    : collection(collection), start(start), desiredLength(desiredLength), cachedHash(0), hasCachedHash(false), currentHash(0),
+      cachedClassId(ClassificationModel::kSilence)
 {
 }
 
-//TODO: handle when locking the track fails. (i.e. track was destroyed)
-AudacityLabel IALAudioFrame::getAudacityLabel(std::string labelstr){
-    std::weak_ptr<WaveTrack> weakTrack = collection.getLeaderTrack();
-    std::shared_ptr<WaveTrack> strongTrack = weakTrack.lock();
+bool IALAudioFrame::labelSpan(sampleCount &spanStart, size_t &spanLength)
+{
+    std::shared_ptr<WaveTrack> strongTrack = collection.getLeaderTrack().lock();
+    if (!strongTrack)
+    {
+        return false;
+    }
 
-    if (std::shared_ptr<WaveTrack> strongTrack = weakTrack.lock())
+    spanStart = start;
+    spanLength = sourceLength(*strongTrack);
+
+    // overlapping frames each label only the stretch up to where the next one starts
+    if (&collection.audioFrames.back() != this)
     {
-        float sR = float(collection.trackSampleRate());
-        float startSample = float(start.as_double());
-        float lenSample = float(sourceLength(*strongTrack));
-        float startTime = startSample / sR;
-        float endTime = (startSample + lenSample)/sR;
+        spanLength = std::min(spanLength, collection.hopLength());
+    }
+
+    return true;
+}
+
+AudacityLabel IALAudioFrame::getAudacityLabel(std::string labelstr){
+    sampleCount spanStart;
+    size_t spanLength;
 
-        return AudacityLabel(startTime, endTime, labelstr);
+    if (labelSpan(spanStart, spanLength))
+    {
+        double sR = double(collection.trackSampleRate());
+        return AudacityLabel(float(spanStart.as_double() / sR), float((spanStart.as_double() + spanLength) / sR), labelstr);
     } else{
         return AudacityLabel(0, 0, "error");
     }
-    
 }
 
-// label the current audio frame.
-AudacityLabel IALAudioFrame::label()
+AudacityLabel IALAudioFrame::getLabel()
 {
-    if (!audioDidChange())
-    {
-        return cachedLabel;
-    }
-    
-    if (audioIsSilent())
-    {
-        cachedLabel = getAudacityLabel("silence");
-        return cachedLabel;
-    }
-    
-    torch::Tensor modelInput = downmixedAudio();
-    std::vector<std::string> predictions = collection.classifier.predictFromAudioFrame(modelInput, 0.3);
-
-    cachedLabel = getAudacityLabel(predictions[0]);
-    return cachedLabel;
+    return getAudacityLabel(collection.classifier.className(cachedClassId));
 }
 
-
-// label the current audio frame.
-AudacityLabel IALAudioFrame::setLabel(const std::string label)
+size_t IALAudioFrame::index() const
 {
-    cachedLabel = getAudacityLabel(label);
-    return cachedLabel;
+    return size_t(this - collection.audioFrames.data());
 }
 
+/**
+ @brief Adds the time from its construction to its destruction to a stage total.
+ */
+class IALStageTimer
+{
+public:
+    explicit IALStageTimer(double &total) : total(total), begin(std::chrono::steady_clock::now()) {}
+    ~IALStageTimer()
+    {
+        total += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+private:
+    double &total;
+    const std::chrono::steady_clock::time_point begin;
+};
+
 // #pragma mark AudioFrame - Private
 
 bool IALAudioFrame::audioIsSilent(float threshold)
@@ -114,45 +130,80 @@ bool IALAudioFrame::audioIsSilent(float threshold)
     return silent;
 }
 
-// This change detector works by hashing the audio sample at the start, middle, and end of an audio frame
-// and then summing their totals. If the result matches the cached result, then there is a VERY high chance
-// the audio did not change.
-bool IALAudioFrame::audioDidChange()
+// fingerprints are stored in the project, so this must give the same result in every run
+static void hashCombine(size_t &seed, long long value)
 {
-    float sampleTotal = 0.0f;
-    
+    seed ^= size_t(value) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+size_t IALAudioFrame::fingerprint()
+{
+    size_t hash = 0;
+    hashCombine(hash, start.as_long_long());
+    hashCombine(hash, desiredLength);
+
+    const sampleCount frameEnd = start + desiredLength;
+
     collection.iterateChannels([&](WaveTrack &channel, size_t idx, bool *stop)
     {
-        sampleFormat format = channel.GetSampleFormat();
-        size_t actualLength = sourceLength(channel);
-        
-        // Grab first, middle, and last sample from each track
-        SampleBuffer startBuffer(1, format);
-        channel.Get(startBuffer.ptr(), format, start, 1);
-        
-        SampleBuffer middleBuffer(1, format);
-        channel.Get(middleBuffer.ptr(), format, (start.as_size_t() + actualLength) / 2, 1);
-        
-        SampleBuffer endBuffer(1, format);
-        channel.Get(endBuffer.ptr(), format, start.as_size_t() + actualLength, 1);
-        
-        float startSample = *(float *)startBuffer.ptr();
-        float midSample = *(float *)middleBuffer.ptr();
-        float endSample = *(float *)startBuffer.ptr();
-        
-        sampleTotal += startSample + midSample + endSample;
+        hashCombine(hash, idx);
+        hashCombine(hash, (long long)channel.GetRate());
+
+        for (const auto &clip : channel.GetClips())
+        {
+            const sampleCount clipStart = clip->GetStartSample();
+            const sampleCount spanStart = std::max(start, clipStart);
+            const sampleCount spanEnd = std::min(frameEnd, clip->GetEndSample());
+            if (spanStart >= spanEnd)
+            {
+                continue;
+            }
+
+            // find the blocks of the clip's sequence that overlap the frame
+            const BlockArray &blocks = *clip->GetSequenceBlockArray();
+            const sampleCount seqStart = spanStart - clipStart;
+            const sampleCount seqEnd = spanEnd - clipStart;
+
+            auto block = std::upper_bound(blocks.begin(), blocks.end(), seqStart,
+                [](const sampleCount &pos, const SeqBlock &b){ return pos < b.start; });
+            if (block != blocks.begin())
+            {
+                --block;
+            }
+
+            for (; block != blocks.end() && block->start < seqEnd; ++block)
+            {
+                const sampleCount blockEnd = block->start + block->sb->GetSampleCount();
+                const sampleCount overlapStart = std::max(seqStart, block->start);
+                const sampleCount overlapEnd = std::min(seqEnd, blockEnd);
+                if (overlapStart >= overlapEnd)
+                {
+                    continue;
+                }
+
+                hashCombine(hash, block->sb->GetBlockID());
+                // where the span lands in the frame, where it starts in the block, and how long it is
+                hashCombine(hash, (clipStart + overlapStart - start).as_long_long());
+                hashCombine(hash, (overlapStart - block->start).as_long_long());
+                hashCombine(hash, (overlapEnd - overlapStart).as_long_long());
+            }
+        }
     });
-    
-    std::hash<float> float_hasher;
-    size_t newHash = float_hasher(sampleTotal);
 
-    if (cachedHash != newHash)
-    {
-        cachedHash = size_t(newHash);
-        return true;
-    }
-    
-    return false;
+    return hash;
+}
+
+bool IALAudioFrame::audioDidChange()
+{
+    currentHash = fingerprint();
+
+    return !hasCachedHash || cachedHash != currentHash;
+}
+
+void IALAudioFrame::fingerprintLabeled()
+{
+    cachedHash = currentHash;
+    hasCachedHash = true;
 }
 
 size_t IALAudioFrame::sourceLength(WaveTrack &track)
@@ -162,70 +213,52 @@ size_t IALAudioFrame::sourceLength(WaveTrack &track)
     return std::min(start.as_size_t() + desiredLength, lastSample.as_size_t()) - start.as_size_t();
 }
 
-//TODO: test with  non-float input audio
 torch::Tensor IALAudioFrame::downmixedAudio(sampleFormat format, int sampleRate)
 {
-    // auto buffer = std::make_unique<SampleBuffer>(desiredLength, format);
-    size_t numChannels = collection.numChannels();
-    
-    std::vector<torch::Tensor> channels;
-
-    collection.iterateChannels([&](WaveTrack &channel, size_t idx, bool *stop)
+    const int chunkLen = collection.classifier.getChunkLen();
+    if (sampleRate <= 0)
     {
-        sampleFormat originalFormat = channel.GetSampleFormat();
-        double originalSampleRate = channel.GetRate();
-        size_t actualLength = sourceLength(channel);
-        
-        // SampleBuffer channelBuffer = SampleBuffer(desiredLength, format);
-        AudacityProject *project = channel.GetOwner()->GetOwner();
-        SampleBlockFactoryPtr sbFactory = WaveTrackFactory::Get(*project).GetSampleBlockFactory();
-
-        // copy channel's samples into buffer
-        SampleBuffer buffer(actualLength, originalFormat);
-        // fill up the buffer
-        channel.Get(buffer.ptr(), originalFormat, start, actualLength);
-
-        // make a separate clip where we will do the necessary conversions 
-        WaveClip conversionClip(sbFactory, originalFormat, channel.GetRate(), channel.GetWaveColorIndex());
-
-        // fill the clip with our buffer
-        conversionClip.Append(buffer.ptr(), originalFormat, desiredLength);
-        conversionClip.Flush();
-        // conversionClip.SetSamples(buffer.ptr(), originalFormat, start, actualLength);
-
-        // do the conversions
-        conversionClip.ConvertToSampleFormat(floatSample);
-        conversionClip.Resample(sampleRate);
-
-        // copy channel's samples into buffer
-        SampleBuffer outBuffer(conversionClip.GetNumSamples().as_size_t(), floatSample);
-        conversionClip.GetSamples(outBuffer.ptr(), floatSample, conversionClip.GetStartSample(), conversionClip.GetNumSamples().as_size_t());
-        
-        torch::Tensor bufTensor = torch::from_blob(outBuffer.ptr(),
-                                                       desiredLength,
-                                                       torch::TensorOptions().dtype(torch::kFloat32));
-
-        torch::Tensor channelTensor = bufTensor.clone();
+        sampleRate = collection.classifier.getSampleRate();
+    }
+    const double trackRate = collection.trackSampleRate();
+    const bool needsResample = (trackRate != double(sampleRate));
+
+    // the model's input tensor is allocated once and filled in place. if the track is
+    // already at the model's rate, the samples are read straight into it; otherwise
+    // they are mixed into a scratch buffer and resampled into it.
+    torch::Tensor frameTensor = torch::zeros({chunkLen}, torch::TensorOptions().dtype(torch::kFloat32));
+    float *frameData = frameTensor.data_ptr<float>();
+
+    Floats mixBuffer;
+    float *mix = frameData;
+    size_t mixLength = std::min(desiredLength, size_t(chunkLen));
+    if (needsResample)
+    {
+        mixBuffer.reinit(desiredLength, true);
+        mix = mixBuffer.get();
+        mixLength = desiredLength;
+    }
 
-        buffer.Free();
-        
-        channels.emplace_back(channelTensor);
+    collection.mixChannels(start, mixLength, mix);
 
-    });
-    
-    torch::Tensor samples = torch::stack(torch::TensorList(channels), 0).unsqueeze(0);
+    if (needsResample)
+    {
+        IALStageTimer resampleTimer(collection.stageTimings.resample);
+        double factor = double(sampleRate) / trackRate;
+        Resample resampler(true, factor, factor);
+        resampler.Process(factor, mix, mixLength, true, frameData, chunkLen);
+    }
 
-    // Downmix, then shape appropriately for the model.
-    torch::Tensor monoAudio = collection.classifier.downmix(samples);
-    return collection.classifier.padAndReshape(monoAudio);
+    // shape appropriately for the model: (batch, 1, chunkLen)
+    return frameTensor.view({1, 1, chunkLen});
 }
 
 // #pragma mark Collection - Public
 
 // constructor. 
 // each audacity track should have a framecollection, which should have a label track for itself.
-IALAudioFrameCollection::IALAudioFrameCollection(ClassificationModel &classifier, std::weak_ptr<WaveTrack> channel)
-    : classifier(classifier)
+IALAudioFrameCollection::IALAudioFrameCollection(ClassificationModel &classifier, std::weak_ptr<WaveTrack> channel, IALLabelCache *labelCache)
+    : classifier(classifier), labelCache(labelCache)
 {
     if (std::shared_ptr<WaveTrack> strongChannel = channel.lock())
     {
@@ -235,14 +268,18 @@ IALAudioFrameCollection::IALAudioFrameCollection(ClassificationModel &classifier
 }
 
 // adds a channel to the frame collection, only if it belongs to the same leader as the rest of the collection. 
-// question: does the id of a channel equal the id of its leader track? that seems to be the assumption here
 bool IALAudioFrameCollection::addChannel(std::weak_ptr<WaveTrack> channel)
 {
     if (!containsChannel(channel))
     {
         if (std::shared_ptr<WaveTrack> strongChannel = channel.lock())
         {
+            // every channel has its own id, so compare the id of the channel's leader
             TrackId trackId = strongChannel->GetId();
+            if (auto owner = strongChannel->GetOwner())
+            {
+                trackId = (*owner->FindLeader(strongChannel.get()))->GetId();
+            }
             
             if (trackId == leaderTrackId)
             {
@@ -270,9 +307,34 @@ size_t IALAudioFrameCollection::numChannels()
 
 std::weak_ptr<WaveTrack> IALAudioFrameCollection::getLeaderTrack()
 {
+    if (!snapshot.empty())
+    {
+        return snapshot[0];
+    }
+
+    if (channels.empty())
+    {
+        return std::weak_ptr<WaveTrack>();
+    }
+
     return channels[0];
 }
 
+void IALAudioFrameCollection::snapshotChannels()
+{
+    snapshot.clear();
+
+    iterateChannels([&](WaveTrack &channel, size_t idx, bool *stop)
+    {
+        snapshot.push_back(std::static_pointer_cast<WaveTrack>(channel.Duplicate()));
+    });
+}
+
+void IALAudioFrameCollection::releaseSnapshot()
+{
+    snapshot.clear();
+}
+
 // #pragma mark Collection - Private
 
 // iterate through channels
@@ -281,6 +343,22 @@ void IALAudioFrameCollection::iterateChannels(std::function<void (WaveTrack &, s
     bool stopIteration = false;
     size_t currentIdx = 0;
     size_t iterIdx = 0;
+
+    // a background pass must only ever read the copies, never the live tracks
+    if (!snapshot.empty())
+    {
+        for (auto &strongTrack : snapshot)
+        {
+            loopBlock(*strongTrack, currentIdx, &stopIteration);
+            currentIdx += 1;
+
+            if (stopIteration)
+            {
+                break;
+            }
+        }
+        return;
+    }
     
     for (std::weak_ptr<WaveTrack> weakTrack : channels)
     {
@@ -343,6 +421,105 @@ void IALAudioFrameCollection::handleDeletedChannel(size_t deletedChannelIdx)
     updateCollectionLength();
 }
 
+void IALAudioFrameCollection::mixChannels(sampleCount mixStart, size_t mixLength, float *mix)
+{
+    IALStageTimer fetchTimer(stageTimings.fetch);
+
+    Floats channelBuffer;
+    size_t numChannels = 0;
+
+    iterateChannels([&](WaveTrack &channel, size_t idx, bool *stop)
+    {
+        const sampleCount trackEnd = channel.TimeToLongSamples(channel.GetEndTime());
+        size_t actualLength = trackEnd > mixStart ? limitSampleBufferSize(mixLength, trackEnd - mixStart) : 0;
+
+        // WaveTrack::Get converts to float for us, so there is no need for a conversion clip
+        if (numChannels == 0)
+        {
+            channel.Get((samplePtr)mix, floatSample, mixStart, actualLength);
+        }
+        else
+        {
+            if (!channelBuffer)
+            {
+                channelBuffer.reinit(mixLength);
+            }
+
+            channel.Get((samplePtr)channelBuffer.get(), floatSample, mixStart, actualLength);
+
+            float *src = channelBuffer.get();
+            for (size_t i = 0; i < actualLength; i++)
+            {
+                mix[i] += src[i];
+            }
+        }
+
+        numChannels += 1;
+    });
+
+    // Downmix (average) the channels in place.
+    if (numChannels > 1)
+    {
+        float scale = 1.0f / numChannels;
+        for (size_t i = 0; i < mixLength; i++)
+        {
+            mix[i] *= scale;
+        }
+    }
+}
+
+torch::Tensor IALAudioFrameCollection::sequenceAudio(const FrameSequence &frameSequence)
+{
+    const int chunkLen = classifier.getChunkLen();
+    const double trackRate = trackSampleRate();
+    const double modelRate = classifier.getSampleRate();
+
+    if (trackRate == modelRate)
+    {
+        std::vector<torch::Tensor> audioVector;
+        for (auto frame : frameSequence)
+        {
+            audioVector.emplace_back(frame->downmixedAudio());
+        }
+
+        // each frame has shape (batch, 1, chunkLen), so stacking gives (seq, batch, 1, chunkLen)
+        return torch::stack(torch::TensorList(audioVector), /*dim = */ 0);
+    }
+
+    // the frames of a sequence follow one another, so the stretch they cover is mixed and resampled in one go
+    // and each frame is cut out of the result, rather than setting up a resampler for every frame
+    const sampleCount spanStart = frameSequence.front()->start;
+    const size_t spanLength = (frameSequence.back()->start - spanStart).as_size_t() + frameSequence.back()->desiredLength;
+
+    Floats mix(spanLength, true);
+    mixChannels(spanStart, spanLength, mix.get());
+
+    const double factor = modelRate / trackRate;
+    const size_t resampledCapacity = size_t(std::ceil(spanLength * factor)) + chunkLen;
+    Floats resampled(resampledCapacity, true);
+    size_t resampledLength = 0;
+    {
+        IALStageTimer resampleTimer(stageTimings.resample);
+        Resample resampler(true, factor, factor);
+        resampledLength = resampler.Process(factor, mix.get(), spanLength, true, resampled.get(), resampledCapacity).second;
+    }
+
+    torch::Tensor audio = torch::zeros({int64_t(frameSequence.size()), 1, 1, chunkLen},
+                                       torch::TensorOptions().dtype(torch::kFloat32));
+    float *audioData = audio.data_ptr<float>();
+    for (size_t frameIdx = 0; frameIdx < frameSequence.size(); frameIdx++)
+    {
+        const size_t offset = size_t(std::llround((frameSequence[frameIdx]->start - spanStart).as_double() * factor));
+        if (offset < resampledLength)
+        {
+            std::copy_n(resampled.get() + offset, std::min(size_t(chunkLen), resampledLength - offset),
+                        audioData + frameIdx * chunkLen);
+        }
+    }
+
+    return audio;
+}
+
 size_t IALAudioFrameCollection::trackSampleRate()
 {
     size_t sampleRate;
@@ -365,36 +542,95 @@ size_t IALAudioFrameCollection::trackSampleRate()
 
 void IALAudioFrameCollection::updateCollectionLength()
 {
-    size_t maxFrameCount = 0;
-    
+    const size_t window = windowLength();
+    const size_t hop = hopLength();
+
+    sampleCount trackLength = 0;
     iterateChannels([&](WaveTrack &channel, size_t idx, bool *stop)
     {
-        // NOTE: this assumes that the time window for a frame collection is 1 second
-        size_t framesInChannel = ceil(channel.GetEndTime());
-        maxFrameCount = std::max(maxFrameCount, framesInChannel);
+        trackLength = std::max(trackLength, channel.TimeToLongSamples(channel.GetEndTime()));
     });
-    
-    if (audioFrames.size() != maxFrameCount)
+
+    // enough windows, hop apart, to reach the end of the longest channel
+    size_t frameCount = 0;
+    if (trackLength > 0)
     {
-        size_t previousFrameCount = audioFrames.size();
-    
-        if (previousFrameCount < maxFrameCount)
+        frameCount = (trackLength <= sampleCount(window)) ? 1 : ((trackLength - window).as_size_t() + hop - 1) / hop + 1;
+    }
+
+    // frames laid out for another framing can't be reused
+    if (!audioFrames.empty() &&
+        (audioFrames[0].desiredLength != window || (audioFrames.size() > 1 && audioFrames[1].start != sampleCount(hop))))
+    {
+        audioFrames.clear();
+        probitStore.clear();
+        embeddingStore.clear();
+        for (auto &vocabulary : vocabularies)
         {
-            size_t sampleRate = trackSampleRate();
-            
-            // append new audio frames for the seconds we're missing
-            for (size_t frameIdx = previousFrameCount; frameIdx < maxFrameCount; frameIdx++)
-            {
-                sampleCount startSample = frameIdx * sampleRate;
-                audioFrames.emplace_back(IALAudioFrame(*this, startSample, sampleRate));
-            }
+            vocabulary.probitStore.clear();
         }
-        
-        else
+    }
+
+    if (audioFrames.size() < frameCount)
+    {
+        // append new audio frames for the windows we're missing
+        for (size_t frameIdx = audioFrames.size(); frameIdx < frameCount; frameIdx++)
         {
-            audioFrames.resize(maxFrameCount, IALAudioFrame(*this, sampleCount(0), 0));
+            sampleCount startSample = sampleCount(frameIdx) * hop;
+            audioFrames.emplace_back(IALAudioFrame(*this, startSample, window));
         }
     }
+    else if (audioFrames.size() > frameCount)
+    {
+        audioFrames.resize(frameCount, IALAudioFrame(*this, sampleCount(0), 0));
+    }
+
+    probitStore.resize(audioFrames.size());
+    embeddingStore.resize(audioFrames.size());
+    for (auto &vocabulary : vocabularies)
+    {
+        vocabulary.probitStore.resize(audioFrames.size());
+    }
+}
+
+void IALAudioFrameCollection::setVocabularies(const std::vector<std::pair<std::string, std::shared_ptr<ClassificationModel>>> &models)
+{
+    std::vector<IALVocabulary> updated;
+    updated.reserve(models.size());
+
+    for (const auto &model : models)
+    {
+        auto existing = std::find_if(vocabularies.begin(), vocabularies.end(), [&](const IALVocabulary &vocabulary)
+        {
+            return vocabulary.classifier == model.second;
+        });
+
+        if (existing != vocabularies.end())
+        {
+            updated.push_back(std::move(*existing));
+            updated.back().name = model.first;
+            continue;
+        }
+
+        IALVocabulary vocabulary;
+        vocabulary.name = model.first;
+        vocabulary.classifier = model.second;
+        vocabulary.probitStore.resize(audioFrames.size());
+        vocabulary.labelTrack = std::make_shared<LabelTrack>();
+        updated.push_back(std::move(vocabulary));
+    }
+
+    vocabularies = std::move(updated);
+}
+
+size_t IALAudioFrameCollection::windowLength()
+{
+    return size_t(std::lround(double(classifier.getChunkLen()) * trackSampleRate() / classifier.getSampleRate()));
+}
+
+size_t IALAudioFrameCollection::hopLength()
+{
+    return std::max<size_t>(1, std::lround(double(classifier.getHopLen()) * trackSampleRate() / classifier.getSampleRate()));
 }
 
 //TODO: handle when locking the track fails. (i.e. track was destroyed)
@@ -409,226 +645,658 @@ void IALAudioFrameCollection::setTrackTitle(const std::string &trackTitle){
  
 }
 
-bool compareLabelCounts(std::pair<std::string, int> a, std::pair<std::string, int> b){
-    return a.second < b.second;
-}
+// fetch the cached probits of every frame in the sequence, if the project has all of them
+static bool lookupCachedSequence(IALLabelCache &cache, ClassificationModel &classifier,
+                                 const std::vector<IALAudioFrame *> &frameSequence, torch::Tensor &probits)
+{
+    std::vector<torch::Tensor> frameProbits;
+    for (auto frame : frameSequence)
+    {
+        std::vector<float> cached;
+        if (!cache.lookup(frame->getFingerprint(), classifier.getModelHash(), cached)
+            || cached.size() != classifier.getClasslist().size())
+        {
+            return false;
+        }
+        frameProbits.emplace_back(torch::tensor(cached));
+    }
 
-std::string IALAudioFrameCollection::mostCommonLabel(const std::vector<AudacityLabel> &labels){
-    // we should get the most common label in a given set of UNCOALESCED predictions
-    // if the most common label is silence, use the second most common label
-    // if there is no other common label, simply return silence
-    // if the labels are empty, return silence
+    probits = torch::stack(torch::TensorList(frameProbits), 0);
+    return true;
+}
 
-    std::string mostFreqLabel;
-    if (labels.empty())
+// fetch the cached embedding of every frame in the sequence, if the project has all of them
+static bool lookupCachedEmbeddings(IALLabelCache &cache, ClassificationModel &classifier,
+                                   const std::vector<IALAudioFrame *> &frameSequence,
+                                   std::vector<std::vector<int8_t>> &embeddings)
+{
+    embeddings.resize(frameSequence.size());
+    for (size_t i = 0; i < frameSequence.size(); i++)
     {
-        mostFreqLabel = "silence";
-        return mostFreqLabel;
+        if (!cache.lookupEmbedding(frameSequence[i]->getFingerprint(), classifier.getModelHash(), embeddings[i]))
+        {
+            return false;
+        }
     }
-    else
+    return true;
+}
+
+void IALAudioFrameCollection::labelAudioSubsequences(std::vector<FrameSequence> &frameSequences, IALLabelingResult &result)
+{
+    // what one model has to do for this group of sequences. the collection's own classifier is always the first
+    struct ModelPass
     {
-        // make a dict with key label and value count
-        std::map<std::string, int> counter;
+        ClassificationModel &model;
+        IALProbitStore &store;
+        std::vector<IALCachedPrediction> &newPredictions;
+        bool embed;
+
+        // the sequences that get new probits, and their probits
+        std::vector<FrameSequence *> sequences;
+        std::vector<torch::Tensor> sequenceProbits;
+
+        // the sequences that go through the model, as indices into sequences, and their audio
+        std::vector<size_t> inferred;
+        std::vector<torch::Tensor> audio;
+    };
+
+    std::vector<ModelPass> passes;
+    passes.reserve(1 + vocabularies.size());
+    passes.push_back({ classifier, probitStore, result.newPredictions, storeEmbeddings });
+    for (size_t vocabIdx = 0; vocabIdx < vocabularies.size(); vocabIdx++)
+    {
+        passes.push_back({ *vocabularies[vocabIdx].classifier, vocabularies[vocabIdx].probitStore,
+                           result.vocabularies[vocabIdx].newPredictions, false });
+    }
 
-        for (auto label: labels){
-            // if we haven't seen the label b4, initialize to 0 
-            if (counter.find(label.label) == counter.end()){
-                counter[label.label] = 0;
+    for (auto &frameSequence : frameSequences)
+    {
+        // if none of the frames in this sequence have changed, don't redo the computation
+        bool frameSequenceHasChanged = false;
+        for (auto frame : frameSequence)
+        {
+            if (frame->audioDidChange()){
+                frameSequenceHasChanged = true;
             }
-            // increment counter
-            counter[label.label] += 1;
         }
 
-        // sort map by value by putting it into a vector
-        std::vector<std::pair<std::string, int>> sortedCounter;
-        std::map<std::string, int>::iterator it;
-        for (it=counter.begin(); it!=counter.end(); it++){
-            sortedCounter.push_back(std::make_pair(it->first, it->second));
-        }
+        // fetched and resampled at most once, however many models need it
+        torch::Tensor fetchedAudio;
+
+        for (auto &pass : passes)
+        {
+            bool needsProbits = frameSequenceHasChanged;
+            for (auto frame : frameSequence)
+            {
+                // frames labeled before this vocabulary, or embeddings, were turned on still need them
+                if (!pass.store.has(frame->index()) || (pass.embed && !embeddingStore.has(frame->index()))){
+                    needsProbits = true;
+                }
+            }
 
-        std::sort(sortedCounter.rbegin(), sortedCounter.rend(), compareLabelCounts);
+            if (!needsProbits)
+            {
+                continue;
+            }
 
-        mostFreqLabel = sortedCounter[0].first;
+            pass.sequences.push_back(&frameSequence);
+            pass.sequenceProbits.emplace_back();
 
-        // if the most common label is silence, just grab the second most common label
-        if (mostFreqLabel == "silence" && sortedCounter.size() > 1){
-            mostFreqLabel = sortedCounter[1].first;
+            // the project may have seen this audio before, e.g. when it is reopened
+            std::vector<std::vector<int8_t>> cachedEmbeddings;
+            if (labelCache && lookupCachedSequence(*labelCache, pass.model, frameSequence, pass.sequenceProbits.back())
+                && (!pass.embed || lookupCachedEmbeddings(*labelCache, pass.model, frameSequence, cachedEmbeddings)))
+            {
+                for (size_t i = 0; i < cachedEmbeddings.size(); i++)
+                {
+                    embeddingStore.set(frameSequence[i]->index(), cachedEmbeddings[i]);
+                }
+                continue;
+            }
+
+            if (!fetchedAudio.defined())
+            {
+                fetchedAudio = sequenceAudio(frameSequence);
+                framesInferred += frameSequence.size();
+            }
+
+            pass.audio.push_back(fetchedAudio);
+            pass.inferred.push_back(pass.sequences.size() - 1);
         }
     }
-    return mostFreqLabel;
-}
 
-std::vector<AudacityLabel> IALAudioFrameCollection::coalesceLabels(const std::vector<AudacityLabel> &labels) {
-    std::vector<AudacityLabel> coalescedLabels;
-    
-    // if labels are empty, don't return 
-    if (labels.size() == 0) {
-        return coalescedLabels;
+    for (auto &pass : passes)
+    {
+        if (!pass.audio.empty())
+        {
+            // now, we can feed all of the sequences to the model at once
+            std::vector<torch::Tensor> predictions;
+            std::vector<torch::Tensor> embeddings;
+            {
+                IALStageTimer inferenceTimer(stageTimings.inference);
+                predictions = pass.model.predictSequenceBatch(pass.audio, pass.embed ? &embeddings : nullptr);
+            }
+
+            for (size_t i = 0; i < pass.inferred.size(); i++)
+            {
+                size_t seqIdx = pass.inferred[i];
+                pass.sequenceProbits[seqIdx] = predictions[i];
+
+                // remember what the model said, so the project can skip it next time
+                torch::Tensor probits = predictions[i].contiguous();
+                FrameSequence &frameSequence = *pass.sequences[seqIdx];
+                for (size_t frameIdx = 0; frameIdx < frameSequence.size(); frameIdx++)
+                {
+                    torch::Tensor frameProbits = probits[frameIdx].contiguous();
+                    const float *data = frameProbits.data_ptr<float>();
+                    pass.newPredictions.push_back({frameSequence[frameIdx]->getFingerprint(),
+                                                   std::vector<float>(data, data + frameProbits.numel()), {}});
+
+                    if (pass.embed)
+                    {
+                        std::vector<int8_t> embedding = IALEmbeddingStore::quantise(embeddings[i][frameIdx]);
+                        embeddingStore.set(frameSequence[frameIdx]->index(), embedding);
+                        pass.newPredictions.back().embedding = std::move(embedding);
+                    }
+                }
+            }
+        }
+
+        // the classes are set from the store once every sequence is in (see classifyStoredFrames)
+        for (size_t seqIdx = 0; seqIdx < pass.sequences.size(); seqIdx++)
+        {
+            FrameSequence &frameSequence = *pass.sequences[seqIdx];
+            for (size_t i = 0; i < frameSequence.size(); i++)
+            {
+                pass.store.set(frameSequence[i]->index(), pass.sequenceProbits[seqIdx][i]);
+            }
+        }
     }
-    
-    int startIdx = 0;
-    for (int i = 0; i < labels.size(); i++) {
-        
-        // Iterate over a range until a label differs from the previous label AND
-        // previous label end time is same as the current label's start time
 
-        // if the current label isn't the same as our base label, 
-        // OR the previous label does not at the same time as the current label starts
-        if (labels[i].label != labels[startIdx].label
-            || labels[i - 1].end != labels[i].start) {
-            coalescedLabels.push_back(AudacityLabel(labels[startIdx].start,
-                                                    labels[i - 1].end,
-                                                    labels[startIdx].label));
-            startIdx = i;
+    // only now that every model's probits are stored do the frames count as labeled
+    for (auto &frameSequence : frameSequences)
+    {
+        for (auto frame : frameSequence)
+        {
+            frame->fingerprintLabeled();
         }
     }
-    
-    coalescedLabels.push_back(AudacityLabel(labels[startIdx].start,
-                                            labels[labels.size() - 1].end,
-                                            labels[startIdx].label));
-    
-    return coalescedLabels;
 }
 
-std::vector<AudacityLabel> IALAudioFrameCollection::labelAudioSubsequence(std::vector<IALAudioFrame> &frameSequence)
+std::vector<bool> IALAudioFrameCollection::silenceMap(float threshold)
 {
-    // if none of the frames in this sequence have changed, don't redo the computation
-    bool frameSequenceHasChanged = false;
-    for (auto &frame : frameSequence)
+    std::vector<bool> silent(audioFrames.size(), true);
+
+    // the mean square a frame has to exceed to be heard
+    const double thresholdPower = std::pow(10.0, threshold / 10.0);
+
+    // per frame, the sum of squares and the number of samples that contributed to it
+    std::vector<double> sumSquares(audioFrames.size());
+    std::vector<double> counts(audioFrames.size());
+
+    // adds a run of samples with the given mean square to the frames it overlaps
+    auto accumulate = [&](sampleCount runStart, sampleCount runEnd, double meanSquare)
     {
-        if (frame.audioDidChange()){
-            frameSequenceHasChanged = true;
+        auto frame = std::upper_bound(audioFrames.begin(), audioFrames.end(), runStart,
+            [](const sampleCount &pos, const IALAudioFrame &f){ return pos < f.start; });
+        // frames may overlap, so step back over every earlier frame that still reaches the run
+        while (frame != audioFrames.begin() && (frame - 1)->start + (frame - 1)->desiredLength > runStart)
+        {
+            --frame;
         }
-    }
 
-    if (frameSequenceHasChanged)
+        for (; frame != audioFrames.end() && frame->start < runEnd; ++frame)
+        {
+            const sampleCount overlapStart = std::max(runStart, frame->start);
+            const sampleCount overlapEnd = std::min(runEnd, frame->start + frame->desiredLength);
+            if (overlapStart >= overlapEnd)
+            {
+                continue;
+            }
+
+            const size_t frameIdx = frame - audioFrames.begin();
+            const double overlap = (overlapEnd - overlapStart).as_double();
+            sumSquares[frameIdx] += meanSquare * overlap;
+            counts[frameIdx] += overlap;
+        }
+    };
+
+    Floats summary;
+    size_t summaryCapacity = 0;
+
+    iterateChannels([&](WaveTrack &channel, size_t idx, bool *stop)
     {
-        std::vector<torch::Tensor> audioVector;
+        std::fill(sumSquares.begin(), sumSquares.end(), 0.0);
+        std::fill(counts.begin(), counts.end(), 0.0);
 
-        // go through the entire sequence of labels and gather downmixedAudio()
-        for (auto &frame : frameSequence)
+        for (const auto &clip : channel.GetClips())
         {
-            audioVector.emplace_back(frame.downmixedAudio());
+            const sampleCount clipStart = clip->GetStartSample();
+
+            for (const auto &block : *clip->GetSequenceBlockArray())
+            {
+                const size_t blockLen = block.sb->GetSampleCount();
+                const size_t numRuns = (blockLen + 255) / 256;
+                const sampleCount blockStart = clipStart + block.start;
+
+                if (numRuns * 3 > summaryCapacity)
+                {
+                    summaryCapacity = numRuns * 3;
+                    summary.reinit(summaryCapacity);
+                }
+
+                // summaries are (min, max, rms) triples
+                if (!block.sb->GetSummary256(summary.get(), 0, numRuns))
+                {
+                    // the summary couldn't be read, so spread the block's overall level across it
+                    const float rms = block.sb->GetMinMaxRMS(false).RMS;
+                    accumulate(blockStart, blockStart + blockLen, double(rms) * rms);
+                    continue;
+                }
+
+                for (size_t run = 0; run < numRuns; run++)
+                {
+                    const sampleCount runStart = blockStart + run * 256;
+                    const size_t runLen = std::min<size_t>(256, blockLen - run * 256);
+                    const double rms = summary[run * 3 + 2];
+                    accumulate(runStart, runStart + runLen, rms * rms);
+                }
+            }
         }
 
-        //NOTE: temporary fix
-        while (audioVector.size() < 10){
-            audioVector.emplace_back(torch::zeros({1, 1, 48000}, torch::kFloat32));
+        for (size_t frameIdx = 0; frameIdx < audioFrames.size(); frameIdx++)
+        {
+            if (counts[frameIdx] > 0 && sumSquares[frameIdx] / counts[frameIdx] > thresholdPower)
+            {
+                silent[frameIdx] = false;
+            }
         }
+    });
 
-        // now we have a tensor with shape (batch, 1, chunkLen)
-        // see if we can call torch::stack() and get shape (seq, batch, 1, chunkLen)
-        torch::TensorList preStack = torch::TensorList(audioVector);
-        torch::Tensor audioStack = torch::stack(preStack, /*dim = */ 0);
+    return silent;
+}
 
-        // now, we can feed the sequence to the model 
-        std::vector<std::string> predictions = classifier.predictFromAudioSequence(audioStack, 0.3);
+IALLabelingResult IALAudioFrameCollection::labelAllFrames(const ProgressCallback &progress)
+{
+    IALLabelingResult result;
+    result.vocabularies.resize(vocabularies.size());
 
-        // update the labels for each AudioFrame
-        for (size_t i = 0; i < frameSequence.size(); i++)
+    // the models can't take sequences longer than this in one go
+    size_t maxSequenceLength = classifier.getFixedSequenceLength() > 0 ? classifier.getFixedSequenceLength() : 10;
+    for (auto &vocabulary : vocabularies)
+    {
+        if (vocabulary.classifier->getFixedSequenceLength() > 0)
         {
-            auto &frame = frameSequence[i];
-            frame.setLabel(predictions[i]);
+            maxSequenceLength = std::min(maxSequenceLength, size_t(vocabulary.classifier->getFixedSequenceLength()));
         }
     }
 
-    return gatherAudacityLabels(frameSequence);
-}
+    // sequences are gathered up and labeled a whole batch at a time, which bounds
+    // how much audio we hold in memory while still making few, large model calls
+    size_t batchSize = std::max(1, classifier.getMaxBatchSize());
 
-void IALAudioFrameCollection::labelAllFrames(const AudacityProject& project)
-{
-    // grab the tracklist
-    TrackList &tracklist = TrackList::Get(const_cast<AudacityProject&>(project));
+    std::vector<FrameSequence> labeledSequences;
+    std::vector<FrameSequence> pendingSequences;
+    FrameSequence frameSequence;
 
-    std::vector<AudacityLabel> predictions;
-    std::vector<IALAudioFrame> frameSequence;
+    auto closeSequence = [&]
+    {
+        if (frameSequence.empty())
+        {
+            return;
+        }
+
+        pendingSequences.push_back(frameSequence);
+        frameSequence.clear();
+
+        if (pendingSequences.size() == batchSize)
+        {
+            labelAudioSubsequences(pendingSequences, result);
+            labeledSequences.insert(labeledSequences.end(), pendingSequences.begin(), pendingSequences.end());
+            pendingSequences.clear();
+        }
+    };
+
+    stageTimings = IALStageTimings();
+    framesInferred = 0;
+
+    // embeddings that aren't kept up to date would only go stale
+    if (!storeEmbeddings)
+    {
+        embeddingStore.clear();
+    }
+
+    // decide which frames are silent up front, from the block summaries
+    std::vector<bool> silentFrames;
+    {
+        IALStageTimer silenceTimer(stageTimings.silence);
+        silentFrames = silenceMap();
+    }
+
+    size_t framesDone = 0;
     for (auto &frame : audioFrames)
     {   
-        // NOTE: THIS IS A TEMPORARY FIX (the if statement below)
-        // right now, the lstm model is traced, meaning that it will always need
-        // a fixed sequence length. If the model is scripted instead, this will not be necessary. 
-        if (frameSequence.size() == 10) 
-        {
-            // label whatever we have right now, append it to the big list of predictions
-            std::vector<AudacityLabel> labelSubsequence = labelAudioSubsequence(frameSequence);
-            predictions.insert(predictions.end(), labelSubsequence.begin(), labelSubsequence.end());
-            
-            // start from scratch for the next sequence!
-            frameSequence.clear();
+        if (progress && !progress(framesDone, audioFrames.size()))
+        {
+            result.cancelled = true;
+            return result;
         }
-        // if the current frame is silent, let's label what we have so far
-        if (frame.audioIsSilent())
+        const bool frameIsSilent = silentFrames[framesDone];
+        framesDone += 1;
+
+        if (frameSequence.size() == maxSequenceLength) 
+        {
+            closeSequence();
+        }
+
+        // silence breaks up the sequences; silent frames are not labeled
+        if (frameIsSilent)
         {   
-            if (!frameSequence.empty()){ //NOTE: temporary fix
-                // label whatever we have right now, append it to the big list of predictions
-                std::vector<AudacityLabel> labelSubsequence = labelAudioSubsequence(frameSequence);
-                predictions.insert(predictions.end(), labelSubsequence.begin(), labelSubsequence.end());
-                
-                // start from scratch for the next sequence!
-                frameSequence.clear();
-            }
-            
+            closeSequence();
         }
         else 
         {   
             // if the current frame is not  silent, then append it to our working sequence
-            frameSequence.emplace_back(frame); 
+            frameSequence.push_back(&frame); 
         }
     }
 
     // make final calls if needed
-    if (!frameSequence.empty()){
-        // label whatever we have right now, append it to the big list of predictions
-        std::vector<AudacityLabel> labelSubsequence = labelAudioSubsequence(frameSequence);
-        predictions.insert(predictions.end(), labelSubsequence.begin(), labelSubsequence.end());
-        
-        // start from scratch for the next sequence!
-        frameSequence.clear();
+    closeSequence();
+    labelAudioSubsequences(pendingSequences, result);
+    labeledSequences.insert(labeledSequences.end(), pendingSequences.begin(), pendingSequences.end());
+
+    if (progress)
+    {
+        progress(framesDone, audioFrames.size());
+    }
+
+    {
+        IALStageTimer coalesceTimer(stageTimings.coalesce);
+
+        std::vector<int32_t> classIds = classifyStoredFrames(classifier, probitStore, silentFrames);
+        for (size_t frameIdx = 0; frameIdx < audioFrames.size(); frameIdx++)
+        {
+            if (probitStore.has(frameIdx) && !silentFrames[frameIdx])
+            {
+                audioFrames[frameIdx].setClassId(classIds[frameIdx]);
+            }
+        }
+        coalesceFrames(classifier, probitStore, classIds, labeledSequences, result.labels, result.trackName);
+
+        for (size_t vocabIdx = 0; vocabIdx < vocabularies.size(); vocabIdx++)
+        {
+            IALVocabulary &vocabulary = vocabularies[vocabIdx];
+            IALVocabularyResult &vocabularyResult = result.vocabularies[vocabIdx];
+
+            classIds = classifyStoredFrames(*vocabulary.classifier, vocabulary.probitStore, silentFrames);
+            coalesceFrames(*vocabulary.classifier, vocabulary.probitStore, classIds, labeledSequences,
+                           vocabularyResult.labels, vocabularyResult.trackName);
+        }
+    }
+
+    if (storeEmbeddings)
+    {
+        for (const auto &sequence : labeledSequences)
+        {
+            for (auto frame : sequence)
+            {
+                result.embeddedFrames.push_back(frame->index());
+            }
+        }
     }
 
-    // make sure to call this before coalescing to get accurate results. 
-    std::string trackName = mostCommonLabel(predictions);
-    setTrackTitle(trackName);
+    result.timings = stageTimings;
+    result.framesInferred = framesInferred;
+    return result;
+}
 
-    predictions = coalesceLabels(predictions);
+void IALAudioFrameCollection::commitLabels(AudacityProject &project, const IALLabelingResult &result)
+{
+    // grab the tracklist
+    TrackList &tracklist = TrackList::Get(project);
 
-    // TODO: find a better way to create label tracks than this
-    if (!predictions.empty()){
-        wxString labelFileName = wxFileName(FileNames::DataDir(), trackName + ".txt").GetFullPath();
-        wxTextFile labelFile(labelFileName);
-        
-        // In the event of a crash, the file might still be there. If so, clear it out and get it ready for reuse. Otherwise, create a new one.
-        if (labelFile.Exists()) {
-            labelFile.Clear();
+    // the track may have been deleted while we were busy
+    if (getLeaderTrack().expired())
+    {
+        return;
+    }
+
+    setTrackTitle(result.trackName);
+
+    if (!result.labels.empty() || !result.vocabularies.empty()){
+        fillLabelTrack(result);
+    }
+
+    if (!result.labels.empty() && !trackInTrackList(tracklist, labelTrack)) {
+        tracklist.Add(labelTrack);
+    }
+
+    for (size_t vocabIdx = 0; vocabIdx < result.vocabularies.size() && vocabIdx < vocabularies.size(); vocabIdx++) {
+        auto &vocabTrack = vocabularies[vocabIdx].labelTrack;
+        if (!result.vocabularies[vocabIdx].labels.empty() && !trackInTrackList(tracklist, vocabTrack)) {
+            tracklist.Add(vocabTrack);
         }
-        else {
-            labelFile.Create();
+    }
+}
+
+// copies coalesced labels, with their alternatives, into a label track
+static void FillTrack(LabelTrack &track, const std::string &trackName, const std::vector<AudacityLabel> &audacityLabels)
+{
+    LabelArray labels;
+    labels.reserve(audacityLabels.size());
+    for (const auto &label : audacityLabels) {
+        labels.emplace_back(SelectedRegion(label.start, label.end), wxString(label.label));
+        for (const auto &className : label.classes) {
+            labels.back().classes.push_back(wxString(className));
         }
-        labelFile.Open();
-        
-        // Write each timestamp to file
-        for (auto &label : predictions) {
-            labelFile.AddLine(wxString(label.toStdString()));
+        labels.back().confidences = label.confidences;
+    }
+
+    track.SetName(wxString(trackName));
+    track.SetLabels(std::move(labels));
+}
+
+void IALAudioFrameCollection::fillLabelTrack(const IALLabelingResult &result)
+{
+    FillTrack(*labelTrack, result.trackName, result.labels);
+
+    for (size_t vocabIdx = 0; vocabIdx < result.vocabularies.size() && vocabIdx < vocabularies.size(); vocabIdx++) {
+        const IALVocabularyResult &vocabularyResult = result.vocabularies[vocabIdx];
+        FillTrack(*vocabularies[vocabIdx].labelTrack,
+                  vocabularyResult.trackName + " (" + vocabularies[vocabIdx].name + ")",
+                  vocabularyResult.labels);
+    }
+}
+
+std::vector<int32_t> IALAudioFrameCollection::classifyStoredFrames(ClassificationModel &model, const IALProbitStore &store,
+                                                                  const std::vector<bool> &silentFrames)
+{
+    std::vector<int32_t> frameClassIds(audioFrames.size(), ClassificationModel::kSilence);
+    std::vector<size_t> frameIdxs;
+    for (size_t frameIdx = 0; frameIdx < audioFrames.size(); frameIdx++)
+    {
+        if (!silentFrames[frameIdx] && store.has(frameIdx))
+        {
+            frameIdxs.push_back(frameIdx);
         }
+    }
+
+    if (frameIdxs.empty())
+    {
+        return frameClassIds;
+    }
+
+    torch::Tensor probits = store.rows(frameIdxs);
+
+    const size_t window = windowLength();
+    const size_t hop = hopLength();
+    if (hop < window)
+    {
+        // how many earlier frames still cover the start of a frame's hop
+        const size_t reach = (window - 1) / hop;
+        const size_t numClasses = store.numClasses();
 
-        labelTrack->SetName(wxString(trackName));
-        labelTrack->Import(labelFile);
+        torch::Tensor smoothed = probits.clone();
+        const float *in = probits.data_ptr<float>();
+        float *out = smoothed.data_ptr<float>();
 
-        if (!trackInTrackList(tracklist, labelTrack)) {
-            tracklist.Add(labelTrack);
+        for (size_t row = 0; row < frameIdxs.size(); row++)
+        {
+            int count = 1;
+            for (size_t other = row; other > 0 && frameIdxs[row] - frameIdxs[other - 1] <= reach; other--)
+            {
+                const float *otherRow = in + (other - 1) * numClasses;
+                for (size_t c = 0; c < numClasses; c++)
+                {
+                    out[row * numClasses + c] += otherRow[c];
+                }
+                count += 1;
+            }
+
+            for (size_t c = 0; c < numClasses; c++)
+            {
+                out[row * numClasses + c] /= count;
+            }
         }
 
-        labelFile.Close();
-        wxRemove(labelFileName);
+        probits = smoothed;
     }
+
+    std::vector<int32_t> classIds = model.classIdsFromProbits(probits, confidenceThreshold);
+    for (size_t row = 0; row < frameIdxs.size(); row++)
+    {
+        frameClassIds[frameIdxs[row]] = classIds[row];
+    }
+    return frameClassIds;
 }
 
-std::vector<AudacityLabel> IALAudioFrameCollection::gatherAudacityLabels(std::vector<IALAudioFrame> &frameSequence)
+void IALAudioFrameCollection::coalesceFrames(ClassificationModel &model, const IALProbitStore &store,
+                                             const std::vector<int32_t> &classIds,
+                                             const std::vector<FrameSequence> &frameSequences,
+                                             std::vector<AudacityLabel> &labels, std::string &trackName)
 {
-    std::vector<AudacityLabel> labels;
-    for (auto &frame : frameSequence)
+    const double sampleRate = double(trackSampleRate());
+
+    // how many frames of each class there are
+    std::map<int32_t, size_t> classCounts;
+
+    // the run of same-class frames we're building a label for
+    bool haveRun = false;
+    int32_t runClassId = ClassificationModel::kSilence;
+    sampleCount runStart = 0;
+    sampleCount runEnd = 0;
+
+    // the summed probabilities of the run's frames, and the mean of each emitted run, for the top-k alternatives
+    const size_t numClasses = store.numClasses();
+    const bool keepAlternatives = topK > 0 && numClasses > 0;
+    std::vector<float> frameProbits;
+    std::vector<float> runSum(numClasses);
+    size_t runFrames = 0;
+    std::vector<float> runMeans;
+    std::vector<size_t> runLabels;
+
+    auto addToRun = [&](IALAudioFrame *frame)
+    {
+        if (keepAlternatives && store.get(frame->index(), frameProbits))
+        {
+            for (size_t c = 0; c < numClasses; c++)
+            {
+                runSum[c] += frameProbits[c];
+            }
+            runFrames += 1;
+        }
+    };
+
+    auto emitRun = [&]
     {
-        labels.emplace_back(frame.getLabel());
+        labels.emplace_back(float(runStart.as_double() / sampleRate), float(runEnd.as_double() / sampleRate),
+                            model.className(runClassId));
+
+        if (runFrames > 0)
+        {
+            for (size_t c = 0; c < numClasses; c++)
+            {
+                runMeans.push_back(runSum[c] / runFrames);
+            }
+            runLabels.push_back(labels.size() - 1);
+        }
+        std::fill(runSum.begin(), runSum.end(), 0.0f);
+        runFrames = 0;
+    };
+
+    for (const auto &frameSequence : frameSequences)
+    {
+        for (auto frame : frameSequence)
+        {
+            sampleCount spanStart;
+            size_t spanLength;
+            if (!frame->labelSpan(spanStart, spanLength))
+            {
+                continue;
+            }
+
+            const int32_t classId = classIds[frame->index()];
+            classCounts[classId] += 1;
+
+            // extend the run if this frame carries on right where it ends
+            if (haveRun && classId == runClassId && spanStart == runEnd)
+            {
+                runEnd = spanStart + spanLength;
+                addToRun(frame);
+                continue;
+            }
+
+            if (haveRun)
+            {
+                emitRun();
+            }
+
+            haveRun = true;
+            runClassId = classId;
+            runStart = spanStart;
+            runEnd = spanStart + spanLength;
+            addToRun(frame);
+        }
+    }
+
+    if (haveRun)
+    {
+        emitRun();
     }
-    return labels;
-}
\ No newline at end of file
+
+    // the alternatives of every label, in one call
+    if (!runLabels.empty())
+    {
+        torch::Tensor means = torch::from_blob(runMeans.data(), {(int64_t)runLabels.size(), (int64_t)numClasses},
+                                               torch::TensorOptions().dtype(torch::kFloat32));
+        std::vector<int32_t> topIds;
+        std::vector<float> topConfidences;
+        model.topKFromProbits(means, topK, topIds, topConfidences);
+
+        const size_t k = topIds.size() / runLabels.size();
+        for (size_t run = 0; run < runLabels.size(); run++)
+        {
+            AudacityLabel &label = labels[runLabels[run]];
+            for (size_t i = run * k; i < (run + 1) * k; i++)
+            {
+                label.classes.push_back(model.className(topIds[i]));
+                label.confidences.push_back(topConfidences[i]);
+            }
+        }
+    }
+
+    // the most common class names the track. silence only wins if there is nothing else
+    int32_t trackClassId = ClassificationModel::kSilence;
+    size_t trackClassCount = 0;
+    for (const auto &classCount : classCounts)
+    {
+        if (classCount.first != ClassificationModel::kSilence && classCount.second > trackClassCount)
+        {
+            trackClassId = classCount.first;
+            trackClassCount = classCount.second;
+        }
+    }
+
+    trackName = model.className(trackClassId);
+}
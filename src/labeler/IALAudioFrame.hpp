@@ -9,16 +9,22 @@
 #define IALAudioFrame_hpp
 
 #include <stdio.h>
+#include <cstdint>
 #include <memory>
 #include <vector>
 #include <functional>
 
 #include <torch/script.h>
 
+#include "IALEmbeddingStore.hpp"
+#include "IALLabelCache.hpp"
+#include "IALProbitStore.hpp"
+
 class sampleCount;
 class WaveTrack;
 class SampleBuffer;
 class ClassificationModel;
+class LabelTrack;
 class TrackId;
 
 
@@ -26,6 +32,10 @@ struct AudacityLabel {
     float start;
     float end;
     std::string label;
+
+    // the classifier's best guesses for the label, best first, and its confidence in each
+    std::vector<std::string> classes;
+    std::vector<float> confidences;
     
     AudacityLabel() : start(0), end(0), label("") {};
     AudacityLabel(float _start, float _end, std::string _label) : start(float(_start)), end(float(_end)), label(_label) {};
@@ -36,8 +46,73 @@ struct AudacityLabel {
 };
 
 
+/**
+ @brief Wall-clock seconds spent in each stage of a labeling pass.
+ @discussion Fetch covers reading and downmixing the samples, resample covers converting them to the model's rate,
+ and coalesce covers turning the per-frame predictions into labels. Used by the labeler benchmark (see IALBenchmark).
+ */
+struct IALStageTimings {
+    double silence = 0;
+    double fetch = 0;
+    double resample = 0;
+    double inference = 0;
+    double coalesce = 0;
+};
+
+
+/**
+ @brief The labels of one extra vocabulary, from a labeling pass.
+ @discussion Kept apart from the primary labels so that each vocabulary gets its own label track (see IALVocabulary).
+ */
+struct IALVocabularyResult {
+    std::string trackName;
+    std::vector<AudacityLabel> labels;
+
+    // predictions made by the vocabulary's model on this pass, to be cached under its own model hash
+    std::vector<IALCachedPrediction> newPredictions;
+};
+
+
+/**
+ @brief The outcome of labeling a frame collection.
+ @discussion This is computed on a worker thread by IALAudioFrameCollection::labelAllFrames and later committed to the project
+ on the main thread by IALAudioFrameCollection::commitLabels.
+ */
+struct IALLabelingResult {
+    std::string trackName;
+    std::vector<AudacityLabel> labels;
+    bool cancelled = false;
+
+    // predictions made by the model on this pass, to be written to the project's cache
+    std::vector<IALCachedPrediction> newPredictions;
+
+    // the frames labeled on this pass, for the project's similarity index. only filled when embeddings are stored
+    std::vector<size_t> embeddedFrames;
+
+    // one per IALAudioFrameCollection::vocabularies, in the same order
+    std::vector<IALVocabularyResult> vocabularies;
+
+    IALStageTimings timings;
+    // the number of frames that went through the model, rather than being silent, unchanged or cached
+    size_t framesInferred = 0;
+};
+
+
 class IALAudioFrameCollection;
 
+/**
+ @brief A second classifier that labels the same frames as a collection's own, with its own class list and label track.
+ @discussion Vocabularies share the collection's framing, so the model must take the same rate, window and hop as the primary
+ classifier. Each frame's audio is fetched, downmixed and resampled once and then handed to every model, so a vocabulary only
+ adds the cost of its own inference.
+ */
+struct IALVocabulary {
+    std::string name;
+    std::shared_ptr<ClassificationModel> classifier;
+    IALProbitStore probitStore;
+    std::shared_ptr<LabelTrack> labelTrack;
+};
+
 /**
  @brief A lightweight representation of a defined frame of audio in a collection of single or multichannel tracks.
  @discussion The goal of this class is to keep track of a region that serves as input to the label prediction model. This class can make observations about
@@ -59,14 +134,6 @@ public:
      */
     const size_t desiredLength;
     
-    /**
-     @brief Returns the automatic label assigned to this audio frame.
-     @discussion This method will do a varying amount of work depending on how much has changed between the last calculation.
-     If nothing changed, then the cachedLabel will be returned. If change is detected, a silence check will be run, and if the audio is not silent,
-     the model will predict the label for the frame.
-     */
-    AudacityLabel label();
-    
     /**
      @brief The constructor for an audio frame that establishes the location of the frame
      @param collection The collection instance that this frame belongs to
@@ -80,11 +147,23 @@ public:
      @brief Detects whether the source audio in this frame has changed from the last time it was checked.
      be detected, then the rest of the frame does not need to be loaded or passed into a model.
      @returns a boolean indicating change.
-     @discussion This method picks the first, middle, and last sample in the frame, hashes them, and then sums them to produce one final
-     result. If this number differs from the cached number, then the audio has changed for this region. The idea is to minimize how much audio
-     needs to be fetch every pass.
+     @discussion This method compares the frame's fingerprint against the one kept by the last call to fingerprintLabeled. No audio is read.
+     The comparison doesn't change what is kept, so a frame whose labeling fails is still seen as changed the next time.
      */
     bool audioDidChange();
+
+    /**
+     @brief Keeps the fingerprint computed by the last call to audioDidChange, once the frame's new probits are stored.
+     */
+    void fingerprintLabeled();
+
+    /**
+     @brief Identifies the audio under this frame by the sample blocks it covers.
+     @discussion Sample blocks are immutable, so the (block id, offset, length) spans that cover the frame in every channel identify its
+     contents without reading a single sample. Any edit that touches the frame either replaces one of those blocks or moves a span.
+     @returns a hash of the spans, together with the sample rate and the frame's position.
+     */
+    size_t fingerprint();
     
     /**
      @brief Detects if the source audio frame is silent using RMS and converting to dBFS (deciBels Full-Scale)
@@ -96,16 +175,39 @@ public:
     /**
      @brief Returns a tensor of audio from the frame that is desiredLength samples long in the specified sample format and sample rate.
      @param format (optional) the bit representation of the samples of the audio to return. By default, 32-bit float is used
-     @param sampleRate (optional) the number of samples that occur in a single second of audio, in Hertz. By default, 48kHz is used.
+     @param sampleRate (optional) the number of samples that occur in a single second of audio, in Hertz. By default, the model's rate is used.
      @returns a torch tensor containing downmixed (averaged) audio of the channels
      @discussion The tensor contains desiredLength samples so that it returns the fixed size the instantiator expects when creating
-     the audio frame, even if the source audio is not of the proper length. Audio is resampled and sample format is changed if necessary
-     before copying to the buffer.
+     the audio frame, even if the source audio is not of the proper length. Samples are read from the track as floats directly into
+     the returned tensor (or, if resampling is needed, into one scratch buffer that is resampled into the tensor), so no intermediate
+     clips or sample blocks are created.
      */
-    torch::Tensor downmixedAudio(sampleFormat format=floatSample, int sampleRate=48000);
+    torch::Tensor downmixedAudio(sampleFormat format=floatSample, int sampleRate=0);
 
-    AudacityLabel setLabel(const std::string label);
-    AudacityLabel getLabel(){return cachedLabel;};
+    /**
+     @brief The class last predicted for this frame: an index into the classifier's class list, or one of its special ids.
+     @discussion Frames only keep the id; the label string is made when getLabel is called.
+     */
+    void setClassId(int32_t classId) {cachedClassId = classId;};
+    int32_t getClassId() const {return cachedClassId;};
+    AudacityLabel getLabel();
+
+    /**
+     @brief The stretch of the track that this frame's label covers, in samples of the track.
+     @discussion This is the whole frame, except that overlapping frames each cover only the stretch up to where the next one starts.
+     @returns false if the track no longer exists.
+     */
+    bool labelSpan(sampleCount &spanStart, size_t &spanLength);
+
+    /**
+     @brief The position of this frame in the collection's audioFrames.
+     */
+    size_t index() const;
+
+    /**
+     @brief The fingerprint computed by the last call to audioDidChange.
+     */
+    size_t getFingerprint() const {return currentHash;};
     
 private:
     /**
@@ -114,14 +216,20 @@ private:
     IALAudioFrameCollection &collection;
     
     /**
-     @brief The last computed hash of the audio frame, stored as a canary to check for audio changes
+     @brief The hash of the audio frame when it was last labeled, stored as a canary to check for audio changes
      */
     size_t cachedHash;
+    bool hasCachedHash;
+
+    /**
+     @brief The hash computed by the last call to audioDidChange
+     */
+    size_t currentHash;
     
     /**
-     @brief The last computed label of the audio frame, stored in case the label is requested before the audio changes.
+     @brief The last computed class of the audio frame, stored in case the label is requested before the audio changes.
      */
-    AudacityLabel cachedLabel;
+    int32_t cachedClassId;
     
     /**
      @brief The length of the frame within the context of the track. Either desiredLength or the remainder of the track, whichever is shorter.
@@ -145,30 +253,164 @@ class IALAudioFrameCollection : std::enable_shared_from_this<IALAudioFrameCollec
 {
 public:
     ClassificationModel &classifier;
+
+    /**
+     @brief The project's store of earlier predictions. May be null, in which case every changed frame goes through the model.
+     */
+    IALLabelCache *labelCache;
     
-    IALAudioFrameCollection(ClassificationModel &classifier, std::weak_ptr<WaveTrack> channel);
+    IALAudioFrameCollection(ClassificationModel &classifier, std::weak_ptr<WaveTrack> channel, IALLabelCache *labelCache = nullptr);
         
     size_t numChannels();
     void iterateChannels(std::function<void(WaveTrack &channel, size_t idx, bool *stop)> loopBlock);
     bool addChannel(std::weak_ptr<WaveTrack> channel);
     std::vector<IALAudioFrame> audioFrames;
     std::shared_ptr<LabelTrack> labelTrack;
+
+    /**
+     @brief The class probabilities of every labeled frame, indexed like audioFrames.
+     @discussion Labels are always derived from the store, so a new threshold or top-k only costs a pass over it.
+     */
+    IALProbitStore probitStore;
+
+    /**
+     @brief The confidence a frame's best class needs to be used rather than "not sure", and how many of the best classes each label keeps.
+     @discussion Set on the main thread before labeling, from the /IAL/ConfidenceThreshold and /IAL/TopK preferences (see IALLabeler).
+     */
+    float confidenceThreshold = 0.3f;
+    int topK = 3;
+
+    /**
+     @brief The embedding of every labeled frame, indexed like audioFrames. Only kept when storeEmbeddings is set.
+     @discussion Set on the main thread before labeling, from the /IAL/StoreEmbeddings preference. Turning it on makes the next pass
+     embed the frames that don't have an embedding yet, even if their audio hasn't changed.
+     */
+    IALEmbeddingStore embeddingStore;
+    bool storeEmbeddings = false;
+
+    /**
+     @brief Extra classifiers that label the same frames, each into its own label track.
+     @discussion Set on the main thread before labeling, with setVocabularies.
+     */
+    std::vector<IALVocabulary> vocabularies;
+
+    /**
+     @brief Replaces the vocabularies with the given (name, model) pairs.
+     @discussion A vocabulary whose model is unchanged keeps its stored probabilities and label track.
+     */
+    void setVocabularies(const std::vector<std::pair<std::string, std::shared_ptr<ClassificationModel>>> &models);
     size_t trackSampleRate();
 
     std::weak_ptr<WaveTrack> getLeaderTrack();
+
+    /**
+     @brief Lays frames over the whole track, windowLength long and hopLength apart, reusing the frames that are already there.
+     @discussion If the framing has changed since the frames were made, e.g. because the track was resampled, they are all replaced.
+     */
     void updateCollectionLength();
 
+    /**
+     @brief The length of each frame, and the distance between the starts of consecutive frames, in samples of the track.
+     @discussion Both come from the classifier's metadata (see DeepModel::loadMetadata), converted to the track's rate. When the hop
+     is shorter than the window, frames overlap and each frame's label is smoothed over the frames that cover it.
+     */
+    size_t windowLength();
+    size_t hopLength();
+
+    /**
+     @brief Takes a copy of the channels for a background labeling pass.
+     @discussion The copies share their sample blocks with the originals, so this is cheap. While a snapshot is held,
+     iterateChannels visits the copies instead of the live tracks, so edits made in the meantime cannot race with the worker.
+     Both methods must be called on the main thread.
+     */
+    void snapshotChannels();
+    void releaseSnapshot();
+
+    /**
+     @brief Reports the number of frames labeled so far. Returning false cancels the pass.
+     */
+    using ProgressCallback = std::function<bool(size_t framesDone, size_t framesTotal)>;
+
     void setTrackTitle(const std::string& trackTitle);
-    std::string mostCommonLabel(const std::vector<AudacityLabel> &labels);
-    void labelAllFrames(const AudacityProject& project);
-    std::vector<AudacityLabel> coalesceLabels(const std::vector<AudacityLabel> &labels);
+
+    /**
+     @brief Finds the silent frames of the whole collection in one pass, without reading any audio.
+     @param threshold (optional) the RMS level in dBFS that a frame must exceed in some channel to not be silent, as in IALAudioFrame::audioIsSilent.
+     @returns one flag per frame in audioFrames, set where the frame is silent.
+     @discussion Every sample block stores the RMS of each run of 256 samples, so the mean square of a frame can be built from those
+     summaries alone. A run that straddles a frame boundary is split between the two frames in proportion to its overlap, so frames
+     that sit right at the threshold may be judged differently than by audioIsSilent.
+     */
+    std::vector<bool> silenceMap(float threshold=-80);
+
+    /**
+     @brief Runs the classifier over every frame and returns the coalesced labels.
+     @discussion This does not modify the project, and is safe to call from a worker thread while a snapshot is held.
+     */
+    IALLabelingResult labelAllFrames(const ProgressCallback &progress);
+
+    /**
+     @brief Names the leader track and writes the labels into this collection's label tracks, adding them to the project if needed.
+     @discussion Must be called on the main thread.
+     */
+    void commitLabels(AudacityProject &project, const IALLabelingResult &result);
+
+    /**
+     @brief Writes the result's labels and names into labelTrack and the vocabularies' label tracks, without touching the project.
+     @discussion Used by commitLabels, and by the batch labeler, which never adds its tracks to a project (see IALBatchLabeler).
+     */
+    void fillLabelTrack(const IALLabelingResult &result);
     std::vector<AudacityLabel> createAudacityLabels(const std::vector<std::string> &embeddingLabels);
 private:
     std::vector<std::weak_ptr<WaveTrack>> channels;
+    std::vector<std::shared_ptr<WaveTrack>> snapshot;
+
+    // accumulated over the current labelAllFrames pass
+    IALStageTimings stageTimings;
+    size_t framesInferred = 0;
+    friend class IALAudioFrame;
     TrackId leaderTrackId;
 
-    std::vector<AudacityLabel> labelAudioSubsequence(std::vector<IALAudioFrame> &frameSequence);
-    std::vector<AudacityLabel> gatherAudacityLabels(std::vector<IALAudioFrame> &frameSequence);
+    using FrameSequence = std::vector<IALAudioFrame *>;
+
+    /**
+     @brief Reads mixLength samples of every channel from mixStart, as floats, and averages them into mix.
+     @discussion Samples past the end of a channel are left as they are in mix, so it should be zeroed first.
+     */
+    void mixChannels(sampleCount mixStart, size_t mixLength, float *mix);
+
+    /**
+     @brief The model input for a sequence of consecutive frames, shaped (seq, batch, 1, chunkLen).
+     @discussion When the track isn't at the model's rate, the stretch the sequence covers is mixed and resampled in a single call,
+     and each frame is cut out of the result, rather than resampling every frame on its own.
+     */
+    torch::Tensor sequenceAudio(const FrameSequence &frameSequence);
+
+    /**
+     @brief Labels a group of frame sequences with as few model calls as possible.
+     @discussion Sequences whose frames have not changed keep their stored probabilities, and sequences whose frames are all in the
+     project's label cache are labeled from it. The audio of the rest is fetched once and packed into a single batch per model (see
+     ClassificationModel::predictSequenceBatch), for the classifier and then for each vocabulary. New predictions are appended to
+     the result's. When embeddings are stored, they are fetched or computed alongside the classifier's probabilities.
+     */
+    void labelAudioSubsequences(std::vector<FrameSequence> &frameSequences, IALLabelingResult &result);
+    /**
+     @brief Turns the classified frames into labels and a track name.
+     @discussion Consecutive frames of the same class are merged by class id, so a label string is made once per merged label
+     rather than once per frame. Each label keeps the topK classes of the average of its frames' probabilities. The track is named
+     after its most common class, passing over silence if there is anything else.
+     */
+    void coalesceFrames(ClassificationModel &model, const IALProbitStore &store, const std::vector<int32_t> &classIds,
+                        const std::vector<FrameSequence> &frameSequences,
+                        std::vector<AudacityLabel> &labels, std::string &trackName);
+
+    /**
+     @brief The class of each non-silent frame in the store, at the current confidenceThreshold, indexed like audioFrames.
+     @discussion When frames overlap, a frame's probabilities are first averaged with those of the earlier frames that cover it.
+     All of the frames are thresholded in a single call. Frames without probabilities are silence.
+     */
+    std::vector<int32_t> classifyStoredFrames(ClassificationModel &model, const IALProbitStore &store,
+                                              const std::vector<bool> &silentFrames);
     void labelAudioSequence(); 
 
     bool containsChannel(std::weak_ptr<WaveTrack> channel);
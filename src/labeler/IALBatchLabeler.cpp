@@ -0,0 +1,375 @@
+//
+//  IALBatchLabeler.cpp
+//  Audacity
+//
+
+#include "IALBatchLabeler.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+#include <wx/filename.h>
+#include <wx/textfile.h>
+#include <wx/tokenzr.h>
+
+#include "IALAudioFrame.hpp"
+#include "IALLabeler.hpp"
+#include "IALWorkerPool.hpp"
+#include "ClassificationModel.h"
+#include "../LabelTrack.h"
+#include "../Project.h"
+#include "../ProjectFileIO.h"
+#include "../Tags.h"
+#include "../Track.h"
+#include "../WaveTrack.h"
+#include "../import/Import.h"
+
+#pragma mark File Lists
+
+wxArrayString IALParseBatchFileList(const wxString &text)
+{
+    wxArrayString paths;
+    wxStringTokenizer lines(text, wxT("\r\n;"), wxTOKEN_STRTOK);
+    while (lines.HasMoreTokens())
+    {
+        wxString path = lines.GetNextToken().Strip(wxString::both);
+        if (!path.empty() && !path.StartsWith(wxT("#")))
+        {
+            paths.Add(path);
+        }
+    }
+    return paths;
+}
+
+#pragma mark Files In Flight
+
+/**
+ @brief One input file, from its import to its outputs.
+ @discussion The workers only touch their own collection, labeling and error, and the pending count. Everything else belongs to
+ the main thread.
+ */
+struct IALBatchFile
+{
+    IALBatchFileResult result;
+    std::chrono::steady_clock::time_point begin;
+
+    std::shared_ptr<TrackList> tracks;
+    std::vector<std::unique_ptr<IALAudioFrameCollection>> collections;
+    std::vector<IALLabelingResult> labelings;
+    std::vector<std::string> errors;
+
+    // set when the batch is unwinding, so that the workers stop at the next frame
+    std::atomic<bool> cancelled{ false };
+
+    void trackDone()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        pending -= 1;
+        condition.notify_all();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this]{ return pending == 0; });
+    }
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    size_t pending = 0;
+};
+
+/**
+ @brief Imports a file into a track list of its own, named and grouped as Import would name and group them in a project.
+ */
+static bool ImportFile(AudacityProject &project, IALBatchFile &file)
+{
+    TrackHolders newTracks;
+    Tags tags;
+    TranslatableString errorMessage;
+
+    const bool imported = Importer::Get().Import(project, file.result.inputPath, &WaveTrackFactory::Get(project),
+                                                 newTracks, &tags, errorMessage);
+    if (!imported || newTracks.empty())
+    {
+        file.result.error = errorMessage.empty() ? wxString(wxT("Nothing could be imported")) : errorMessage.Translation();
+        return false;
+    }
+
+    file.tracks = TrackList::Create(nullptr);
+    const wxString nameBase = wxFileName(file.result.inputPath).GetName();
+    int groupIdx = 0;
+    for (auto &group : newTracks)
+    {
+        if (group.empty())
+        {
+            continue;
+        }
+
+        groupIdx += 1;
+        const wxString name = newTracks.size() > 1 ? nameBase + wxString::Format(wxT(" %d"), groupIdx) : nameBase;
+
+        auto first = group.begin()->get();
+        for (auto &channel : group)
+        {
+            channel->SetName(name);
+            file.tracks->Add(channel);
+        }
+        file.tracks->GroupChannels(*first, group.size());
+    }
+
+    return true;
+}
+
+/**
+ @brief Queues every track of the file on the worker pool, one task per track.
+ */
+static void StartLabeling(ClassificationModel &classifier,
+                          const std::vector<std::pair<std::string, std::shared_ptr<ClassificationModel>>> &vocabularies,
+                          IALBatchFile &file)
+{
+    for (WaveTrack *leader : file.tracks->Leaders<WaveTrack>())
+    {
+        // no label cache: imported audio has never been seen before
+        auto collection = std::make_unique<IALAudioFrameCollection>(classifier, leader->SharedPointer<WaveTrack>());
+        for (WaveTrack *channel : TrackList::Channels(leader))
+        {
+            collection->addChannel(channel->SharedPointer<WaveTrack>());
+        }
+        collection->updateCollectionLength();
+        collection->confidenceThreshold = IALLabeler::confidenceThreshold();
+        collection->topK = IALLabeler::topK();
+        collection->setVocabularies(vocabularies);
+        file.collections.push_back(std::move(collection));
+    }
+
+    file.labelings.resize(file.collections.size());
+    file.errors.resize(file.collections.size());
+
+    // nobody else holds the tracks, so the workers can read them without a snapshot.
+    // the file must outlive its tasks, see RunBatchLabeling
+    for (size_t idx = 0; idx < file.collections.size(); idx++)
+    {
+        IALBatchFile *pFile = &file;
+        {
+            std::lock_guard<std::mutex> guard(file.mutex);
+            file.pending += 1;
+        }
+        IALWorkerPool::Get().enqueue([pFile, idx]
+        {
+            try
+            {
+                pFile->labelings[idx] = pFile->collections[idx]->labelAllFrames([pFile](size_t, size_t)
+                {
+                    return !pFile->cancelled;
+                });
+            }
+            catch (const std::exception &e)
+            {
+                pFile->errors[idx] = e.what();
+            }
+            catch (...)
+            {
+                pFile->errors[idx] = "an unknown error occurred";
+            }
+
+            pFile->trackDone();
+        });
+    }
+}
+
+#pragma mark Outputs
+
+// wxTextFile appends to an existing file, and a stale project would be attached rather than replaced
+static bool ReplaceFile(const wxString &path)
+{
+    return !wxFileExists(path) || wxRemoveFile(path);
+}
+
+static void WriteLabelFile(const wxString &path, const std::vector<std::shared_ptr<LabelTrack>> &labelTracks,
+                           IALBatchFileResult &result)
+{
+    wxTextFile textFile(path);
+    if (!ReplaceFile(path) || !textFile.Create())
+    {
+        result.error = wxString::Format(wxT("Couldn't write to file: %s"), path);
+        return;
+    }
+
+    for (const auto &labelTrack : labelTracks)
+    {
+        labelTrack->Export(textFile);
+    }
+
+    if (!textFile.Write())
+    {
+        result.error = wxString::Format(wxT("Couldn't write to file: %s"), path);
+        return;
+    }
+    textFile.Close();
+    result.outputs.Add(path);
+}
+
+static void WriteProjectFile(AudacityProject &project, const wxString &path, IALBatchFile &file,
+                             const std::vector<std::shared_ptr<LabelTrack>> &labelTracks)
+{
+    for (const auto &labelTrack : labelTracks)
+    {
+        file.tracks->Add(labelTrack);
+    }
+
+    // a pruned copy of the project database, holding only the blocks of these tracks
+    if (!ReplaceFile(path) || !ProjectFileIO::Get(project).SaveCopy(path, file.tracks))
+    {
+        file.result.error = wxString::Format(wxT("Couldn't save project: %s"), path);
+        return;
+    }
+    file.result.outputs.Add(path);
+}
+
+/**
+ @brief Waits for the file's tracks to be labeled and writes its outputs.
+ */
+static void FinishFile(AudacityProject &project, IALBatchFile &file, const IALBatchOptions &options)
+{
+    file.wait();
+
+    std::vector<std::shared_ptr<LabelTrack>> labelTracks;
+    for (size_t idx = 0; idx < file.collections.size(); idx++)
+    {
+        if (!file.errors[idx].empty())
+        {
+            file.result.error = wxString(file.errors[idx]);
+            continue;
+        }
+
+        IALAudioFrameCollection &collection = *file.collections[idx];
+        const IALLabelingResult &labeling = file.labelings[idx];
+        collection.fillLabelTrack(labeling);
+        labelTracks.push_back(collection.labelTrack);
+        for (size_t vocabIdx = 0; vocabIdx < labeling.vocabularies.size(); vocabIdx++)
+        {
+            if (!labeling.vocabularies[vocabIdx].labels.empty())
+            {
+                labelTracks.push_back(collection.vocabularies[vocabIdx].labelTrack);
+            }
+        }
+
+        file.result.tracksLabeled += 1;
+        file.result.labels += labeling.labels.size();
+    }
+
+    if (file.result.error.empty())
+    {
+        wxFileName outputName(file.result.inputPath);
+        if (!options.outputDir.empty())
+        {
+            outputName.SetPath(options.outputDir);
+        }
+
+        if (options.writeLabels)
+        {
+            outputName.SetExt(wxT("txt"));
+            WriteLabelFile(outputName.GetFullPath(), labelTracks, file.result);
+        }
+        if (options.writeProjects && file.result.error.empty())
+        {
+            outputName.SetExt(wxT("aup3"));
+            WriteProjectFile(project, outputName.GetFullPath(), file, labelTracks);
+        }
+    }
+
+    // let go of the audio now, so its blocks leave the database before the next file comes in
+    file.collections.clear();
+    file.tracks.reset();
+
+    file.result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - file.begin).count();
+}
+
+#pragma mark Entry Point
+
+std::vector<IALBatchFileResult> RunBatchLabeling(AudacityProject &project, const wxArrayString &inputPaths,
+                                                 const IALBatchOptions &options, const IALBatchProgress &progress)
+{
+    std::vector<IALBatchFileResult> results;
+    ClassificationModel &classifier = IALLabeler::Get(project).getClassifier();
+    const auto vocabularies = IALLabeler::Get(project).getVocabularies();
+
+    if (!options.outputDir.empty() && !wxFileName::DirExists(options.outputDir))
+    {
+        wxFileName::Mkdir(options.outputDir, wxS_DIR_DEFAULT, wxPATH_MKDIR_FULL);
+    }
+
+    const size_t maxInFlight = options.maxFilesInFlight > 0 ? options.maxFilesInFlight : IALWorkerPool::Get().numThreads();
+    std::deque<std::unique_ptr<IALBatchFile>> inFlight;
+    bool stopped = false;
+
+    // an import or a write can throw, and the workers must be done with every file before the deque goes
+    auto cleanup = finally([&]
+    {
+        for (auto &file : inFlight)
+        {
+            file->cancelled = true;
+        }
+        for (auto &file : inFlight)
+        {
+            file->wait();
+        }
+    });
+
+    auto report = [&](const IALBatchFileResult &result)
+    {
+        results.push_back(result);
+        if (progress && !progress(result.inputPath, results.size(), inputPaths.size()))
+        {
+            stopped = true;
+        }
+    };
+
+    auto finishOldest = [&]
+    {
+        IALBatchFile &file = *inFlight.front();
+        FinishFile(project, file, options);
+        report(file.result);
+        inFlight.pop_front();
+    };
+
+    for (const auto &inputPath : inputPaths)
+    {
+        if (stopped)
+        {
+            break;
+        }
+
+        auto file = std::make_unique<IALBatchFile>();
+        file->result.inputPath = inputPath;
+        file->begin = std::chrono::steady_clock::now();
+
+        if (!ImportFile(project, *file))
+        {
+            file->result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - file->begin).count();
+            report(file->result);
+            continue;
+        }
+
+        inFlight.push_back(std::move(file));
+        StartLabeling(classifier, vocabularies, *inFlight.back());
+
+        while (inFlight.size() >= maxInFlight)
+        {
+            finishOldest();
+        }
+    }
+
+    // the files in flight are always finished, even when stopped
+    while (!inFlight.empty())
+    {
+        finishOldest();
+    }
+
+    return results;
+}
@@ -0,0 +1,68 @@
+//
+//  IALBatchLabeler.hpp
+//  Audacity
+//
+
+#ifndef IALBatchLabeler_hpp
+#define IALBatchLabeler_hpp
+
+#include <functional>
+#include <vector>
+
+#include <wx/arrstr.h>
+#include <wx/string.h>
+
+class AudacityProject;
+
+/**
+ @brief What a batch labeling run writes, and where.
+ */
+struct IALBatchOptions
+{
+    // outputs go here, named after each input file. empty puts them next to the input
+    wxString outputDir;
+    // a label file (as written by Export Labels) and/or a project holding the audio and its label tracks, per input
+    bool writeLabels = true;
+    bool writeProjects = false;
+    // the most files being labeled at any time, which bounds memory. 0 means one per worker of the pool
+    size_t maxFilesInFlight = 0;
+};
+
+/**
+ @brief The outcome of labeling one input file.
+ */
+struct IALBatchFileResult
+{
+    wxString inputPath;
+    size_t tracksLabeled = 0;
+    size_t labels = 0;
+    double seconds = 0;
+    // the files written for it
+    wxArrayString outputs;
+    // empty on success
+    wxString error;
+};
+
+/**
+ @brief Reports the number of files finished so far. Returning false stops the run once the files in flight are done.
+ */
+using IALBatchProgress = std::function<bool(const wxString &fileName, size_t filesDone, size_t filesTotal)>;
+
+/**
+ @brief Splits a list of input files given as text: one path per line, or several separated by ';'. Blank lines and lines starting with '#' are skipped.
+ */
+wxArrayString IALParseBatchFileList(const wxString &text);
+
+/**
+ @brief Imports, labels and writes out every file in turn, without adding anything to the project.
+ @param project supplies the sample block factory and the shared classifier (see IALLabeler::getClassifier). Imported audio only
+ lives in its database until the file's outputs are written.
+ @discussion Files are imported on the main thread, one at a time, and each of their tracks is labeled on the worker pool
+ (see IALWorkerPool), so the next file is imported while earlier ones are labeled. Every track goes through the model; the project's
+ label cache is not used, since freshly imported audio can't be in it. A file that fails to import or label is reported in its result
+ and the run carries on. Blocks the main thread until the last file is written, so it is meant for scripting (see LabelFilesCommand).
+ */
+std::vector<IALBatchFileResult> RunBatchLabeling(AudacityProject &project, const wxArrayString &inputPaths,
+                                                 const IALBatchOptions &options, const IALBatchProgress &progress = {});
+
+#endif /* IALBatchLabeler_hpp */
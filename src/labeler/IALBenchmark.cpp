@@ -0,0 +1,270 @@
+//
+//  IALBenchmark.cpp
+//  Audacity
+//
+
+#include "IALBenchmark.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <random>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <ATen/Parallel.h>
+
+#include "IALAudioFrame.hpp"
+#include "IALLabeler.hpp"
+#include "ClassificationModel.h"
+#include "../Project.h"
+#include "../SampleFormat.h"
+#include "../Track.h"
+#include "../WaveTrack.h"
+#include "../widgets/HelpSystem.h"
+#include "../widgets/ProgressDialog.h"
+
+#pragma mark Corpus
+
+std::vector<IALBenchmarkCase> IALDefaultBenchmarkCases()
+{
+    return {
+        // duration, channels, rate, silence
+        {  60, 1, 48000, 0.00 },
+        {  60, 2, 48000, 0.00 },
+        {  60, 1, 44100, 0.00 },
+        {  60, 2, 22050, 0.00 },
+        {  60, 1, 48000, 0.50 },
+        {  60, 2, 44100, 0.90 },
+        { 600, 1, 48000, 0.25 },
+        { 600, 2, 44100, 0.25 },
+    };
+}
+
+/**
+ @brief Makes a detached track for a benchmark case.
+ @discussion The track's sample blocks live in the project's database until the returned list is destroyed. Each one second frame is either silent or a tone under a little noise, with the tone changing from frame to frame.
+ The generator is seeded the same way every time, so every run labels the same audio.
+ */
+static std::shared_ptr<TrackList> GenerateTrack(AudacityProject &project, const IALBenchmarkCase &benchCase)
+{
+    auto &factory = WaveTrackFactory::Get(project);
+    auto tracks = TrackList::Create(nullptr);
+
+    std::vector<WaveTrack *> channels;
+    for (size_t i = 0; i < benchCase.numChannels; i++)
+    {
+        channels.push_back(tracks->Add(factory.NewWaveTrack(floatSample, benchCase.sampleRate)));
+    }
+    if (channels.size() > 1)
+    {
+        tracks->GroupChannels(*channels[0], channels.size());
+    }
+
+    std::mt19937 generator(1234);
+    std::uniform_real_distribution<float> noise(-1.0f, 1.0f);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+
+    const size_t frameLen = size_t(benchCase.sampleRate);
+    const size_t totalLen = size_t(benchCase.duration * benchCase.sampleRate);
+    Floats buffer{ frameLen };
+
+    for (size_t frameStart = 0; frameStart < totalLen; frameStart += frameLen)
+    {
+        const size_t len = std::min(frameLen, totalLen - frameStart);
+        const bool silent = coin(generator) < benchCase.silenceRatio;
+        const double frequency = 110.0 * (1 + (frameStart / frameLen) % 24);
+
+        for (size_t channelIdx = 0; channelIdx < channels.size(); channelIdx++)
+        {
+            for (size_t i = 0; i < len; i++)
+            {
+                const double phase = 2 * M_PI * frequency * (frameStart + i) / benchCase.sampleRate + channelIdx;
+                buffer[i] = silent ? 0.0f : float(0.25 * std::sin(phase)) + 0.05f * noise(generator);
+            }
+            channels[channelIdx]->Append((samplePtr)buffer.get(), floatSample, len);
+        }
+    }
+
+    for (auto channel : channels)
+    {
+        channel->Flush();
+    }
+
+    return tracks;
+}
+
+#pragma mark Measurement
+
+// the most memory the process has held so far, in bytes, or 0 if the platform can't tell us
+static size_t PeakMemoryBytes()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+#if defined(__APPLE__)
+    return size_t(usage.ru_maxrss);
+#else
+    // kilobytes everywhere but macOS
+    return size_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+struct IALBenchmarkRow
+{
+    wxString name;
+    size_t frames = 0;
+    size_t framesInferred = 0;
+    double seconds = 0;
+    IALStageTimings timings;
+    size_t peakMemory = 0;
+};
+
+/**
+ @brief Labels a single track from scratch and records how long it took.
+ @returns false if the benchmark was cancelled.
+ */
+static bool MeasureTrack(ClassificationModel &classifier, WaveTrack &leader, const wxString &name,
+                         const IALBenchmarkProgress &progress, std::vector<IALBenchmarkRow> &rows)
+{
+    // no label cache, so that every frame goes through the model
+    IALAudioFrameCollection collection(classifier, leader.SharedPointer<WaveTrack>());
+    for (WaveTrack *channel : TrackList::Channels(&leader))
+    {
+        collection.addChannel(channel->SharedPointer<WaveTrack>());
+    }
+    collection.updateCollectionLength();
+
+    const auto begin = std::chrono::steady_clock::now();
+    IALLabelingResult result = collection.labelAllFrames([&](size_t framesDone, size_t framesTotal)
+    {
+        return !progress || progress(name, framesDone, framesTotal);
+    });
+    const auto end = std::chrono::steady_clock::now();
+
+    if (result.cancelled)
+    {
+        return false;
+    }
+
+    IALBenchmarkRow row;
+    row.name = name;
+    row.frames = collection.audioFrames.size();
+    row.framesInferred = result.framesInferred;
+    row.seconds = std::chrono::duration<double>(end - begin).count();
+    row.timings = result.timings;
+    row.peakMemory = PeakMemoryBytes();
+    rows.push_back(row);
+
+    return true;
+}
+
+static wxString FormatReport(ClassificationModel &classifier, const std::vector<IALBenchmarkRow> &rows, bool cancelled)
+{
+    wxString report;
+    report += wxT("Labeler benchmark\n");
+    const InferenceOptions options = DeepModel::getInferenceOptions();
+    report += wxString::Format(wxT("Model hash %016llx (%s%s), %d classes, chunk %d samples, sequences of %d, batches of %d, %d torch threads\n\n"),
+                               (unsigned long long)classifier.getModelHash(),
+                               classifier.isQuantized() ? wxT("int8") : wxT("float"),
+                               options.freeze ? wxT(", frozen") : wxT(""),
+                               (int)classifier.getClasslist().size(),
+                               classifier.getChunkLen(), classifier.getFixedSequenceLength(), classifier.getMaxBatchSize(),
+                               (int)at::get_num_threads());
+
+    report += wxString::Format(wxT("%-32s %7s %8s %9s %8s %8s %8s %9s %8s %8s %8s\n"),
+                               wxT("track"), wxT("frames"), wxT("inferred"), wxT("frames/s"), wxT("total s"),
+                               wxT("silence"), wxT("fetch"), wxT("resample"), wxT("infer"), wxT("coalesce"), wxT("peak MB"));
+
+    for (const auto &row : rows)
+    {
+        report += wxString::Format(wxT("%-32s %7d %8d %9.1f %8.3f %8.3f %8.3f %9.3f %8.3f %8.3f %8.1f\n"),
+                                   row.name, (int)row.frames, (int)row.framesInferred,
+                                   row.seconds > 0 ? row.frames / row.seconds : 0.0, row.seconds,
+                                   row.timings.silence, row.timings.fetch, row.timings.resample,
+                                   row.timings.inference, row.timings.coalesce,
+                                   row.peakMemory / (1024.0 * 1024.0));
+    }
+
+    if (cancelled)
+    {
+        report += wxT("\nCancelled.\n");
+    }
+
+    return report;
+}
+
+#pragma mark Entry Points
+
+wxString RunLabelerBenchmark(AudacityProject &project, const IALBenchmarkProgress &progress)
+{
+    ClassificationModel &classifier = IALLabeler::Get(project).getClassifier();
+    std::vector<IALBenchmarkRow> rows;
+    bool cancelled = false;
+
+    for (const auto &benchCase : IALDefaultBenchmarkCases())
+    {
+        const wxString name = wxString::Format(wxT("%gs %dch %gHz %d%% silent"),
+                                               benchCase.duration, (int)benchCase.numChannels,
+                                               benchCase.sampleRate, (int)std::lround(benchCase.silenceRatio * 100));
+
+        auto tracks = GenerateTrack(project, benchCase);
+        WaveTrack *leader = *tracks->Leaders<WaveTrack>().begin();
+
+        if (!MeasureTrack(classifier, *leader, name, progress, rows))
+        {
+            cancelled = true;
+            break;
+        }
+    }
+
+    // real audio: whatever is open
+    for (auto pProject : AllProjects{})
+    {
+        if (cancelled)
+        {
+            break;
+        }
+
+        for (WaveTrack *leader : TrackList::Get(*pProject).Leaders<WaveTrack>())
+        {
+            if (!MeasureTrack(classifier, *leader, leader->GetName(), progress, rows))
+            {
+                cancelled = true;
+                break;
+            }
+        }
+    }
+
+    return FormatReport(classifier, rows, cancelled);
+}
+
+void ShowLabelerBenchmark(wxWindow *parent, AudacityProject &project)
+{
+    wxString report;
+    {
+        ProgressDialog progressDialog(XO("Labeler Benchmark"), XO("Labeling benchmark tracks"));
+        report = RunLabelerBenchmark(project, [&](const wxString &trackName, size_t framesDone, size_t framesTotal)
+        {
+            return progressDialog.Update((wxLongLong_t)framesDone, (wxLongLong_t)framesTotal,
+                                         Verbatim(trackName)) == ProgressResult::Success;
+        });
+    }
+
+    HelpSystem::ShowInfoDialog(parent, XO("Labeler Benchmark"), XO("Labeler throughput:"), report, 900, 450);
+}
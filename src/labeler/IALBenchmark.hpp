@@ -0,0 +1,57 @@
+//
+//  IALBenchmark.hpp
+//  Audacity
+//
+
+#ifndef IALBenchmark_hpp
+#define IALBenchmark_hpp
+
+#include <functional>
+#include <vector>
+
+#include <wx/string.h>
+
+class AudacityProject;
+class wxWindow;
+
+/**
+ @brief One generated track for the labeler benchmark.
+ */
+struct IALBenchmarkCase
+{
+    // in seconds
+    double duration;
+    size_t numChannels;
+    double sampleRate;
+    // the fraction of one second frames that are left silent
+    double silenceRatio;
+};
+
+/**
+ @brief Reports the progress of the benchmark. Returning false cancels it.
+ */
+using IALBenchmarkProgress = std::function<bool(const wxString &trackName, size_t framesDone, size_t framesTotal)>;
+
+/**
+ @brief The generated tracks the benchmark runs over: a spread of lengths, channel counts, sample rates and silence ratios.
+ */
+std::vector<IALBenchmarkCase> IALDefaultBenchmarkCases();
+
+/**
+ @brief Labels every generated track, and then every wave track open in any project, and returns a plain text report.
+ @param project supplies the sample block factory and the classifier. The generated tracks are never added to it.
+ @discussion For each track the report gives the frames per second through the whole pass, the time spent in each stage
+ (silence detection, fetch, resample, inference and coalescing, see IALStageTimings) and the peak memory of the process so far.
+ The label cache is bypassed and no tracks or labels are added to any project, so consecutive runs are comparable, e.g. before
+ and after swapping in new model weights. The generated audio is stored through the project's sample block factory, so its
+ blocks are written to the project's database while each track is measured, and deleted from it again once the track is
+ dropped. Runs synchronously on the main thread.
+ */
+wxString RunLabelerBenchmark(AudacityProject &project, const IALBenchmarkProgress &progress = {});
+
+/**
+ @brief Runs the benchmark behind a progress dialog and shows the report.
+ */
+void ShowLabelerBenchmark(wxWindow *parent, AudacityProject &project);
+
+#endif /* IALBenchmark_hpp */
@@ -0,0 +1,363 @@
+//
+//  IALEmbeddingIndex.cpp
+//  Audacity
+//
+
+#include "IALEmbeddingIndex.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include <torch/script.h>
+
+#include "IALAudioFrame.hpp"
+#include "IALEmbeddingStore.hpp"
+#include "../WaveTrack.h"
+
+const int IALEmbeddingIndex::kTables;
+const int IALEmbeddingIndex::kBits;
+
+// every project hashes with the same hyperplanes
+static const unsigned kHyperplaneSeed = 20201022;
+
+// how many of the best frames are gathered into ranges for each range asked for
+static const size_t kFramesPerRange = 8;
+
+// the scale of the quantised embeddings, so that a dot product of two of them is at most this
+static const float kFullScale = 127.0f * 127.0f;
+
+#pragma mark Updating
+
+void IALEmbeddingIndex::updateTrack(TrackId track, IALAudioFrameCollection &collection, const std::vector<size_t> &frames)
+{
+    const IALEmbeddingStore &store = collection.embeddingStore;
+    removeTrack(track);
+
+    if (store.numDimensions() == 0)
+    {
+        return;
+    }
+
+    // embeddings of different sizes can't be compared
+    if (store.numDimensions() != dimensions)
+    {
+        clear();
+        dimensions = store.numDimensions();
+        makeHyperplanes();
+    }
+
+    TrackEntries entries;
+    const double rate = double(collection.trackSampleRate());
+    for (size_t frame : frames)
+    {
+        const int8_t *row = store.row(frame);
+        sampleCount spanStart;
+        size_t spanLength;
+        if (!row || frame >= collection.audioFrames.size() || !collection.audioFrames[frame].labelSpan(spanStart, spanLength))
+        {
+            continue;
+        }
+
+        entries.starts.push_back(spanStart.as_double() / rate);
+        entries.ends.push_back((spanStart + spanLength).as_double() / rate);
+        entries.vectors.insert(entries.vectors.end(), row, row + dimensions);
+    }
+
+    if (entries.starts.empty())
+    {
+        return;
+    }
+
+    entries.hashes.resize(entries.starts.size() * kTables);
+    hash(entries.vectors.data(), entries.starts.size(), entries.hashes.data());
+
+    numEntries += entries.starts.size();
+    tracks[track] = std::move(entries);
+    bucketsDirty = true;
+}
+
+void IALEmbeddingIndex::removeTrack(TrackId track)
+{
+    auto iter = tracks.find(track);
+    if (iter == tracks.end())
+    {
+        return;
+    }
+
+    numEntries -= iter->second.starts.size();
+    tracks.erase(iter);
+    bucketsDirty = true;
+}
+
+void IALEmbeddingIndex::clear()
+{
+    tracks.clear();
+    numEntries = 0;
+    dimensions = 0;
+    hyperplanes.clear();
+    bucketsDirty = true;
+}
+
+std::vector<TrackId> IALEmbeddingIndex::indexedTracks() const
+{
+    std::vector<TrackId> ids;
+    for (const auto &track : tracks)
+    {
+        ids.push_back(track.first);
+    }
+    return ids;
+}
+
+#pragma mark Hashing
+
+void IALEmbeddingIndex::makeHyperplanes()
+{
+    std::mt19937 generator(kHyperplaneSeed);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+
+    hyperplanes.resize(size_t(kTables) * kBits * dimensions);
+    for (auto &value : hyperplanes)
+    {
+        value = normal(generator);
+    }
+}
+
+void IALEmbeddingIndex::hash(const int8_t *vectors, size_t count, uint16_t *hashes) const
+{
+    // every frame against every hyperplane in one product
+    torch::Tensor x = torch::from_blob(const_cast<int8_t *>(vectors), {(int64_t)count, (int64_t)dimensions},
+                                       torch::TensorOptions().dtype(torch::kInt8)).to(torch::kFloat32);
+    torch::Tensor planes = torch::from_blob(const_cast<float *>(hyperplanes.data()), {kTables * kBits, (int64_t)dimensions},
+                                            torch::TensorOptions().dtype(torch::kFloat32));
+
+    torch::Tensor bits = x.matmul(planes.t()).gt(0).to(torch::kInt32).view({(int64_t)count, kTables, kBits});
+    std::vector<int32_t> bitValues(kBits);
+    for (int bit = 0; bit < kBits; bit++)
+    {
+        bitValues[bit] = 1 << bit;
+    }
+    torch::Tensor weights = torch::tensor(bitValues, torch::TensorOptions().dtype(torch::kInt32));
+    torch::Tensor packed = (bits * weights).sum(-1).to(torch::kInt32).contiguous();
+
+    const int32_t *data = packed.data_ptr<int32_t>();
+    for (size_t i = 0; i < count * kTables; i++)
+    {
+        hashes[i] = uint16_t(data[i]);
+    }
+}
+
+void IALEmbeddingIndex::rebuildBuckets()
+{
+    refs.clear();
+    refs.reserve(numEntries);
+    for (const auto &track : tracks)
+    {
+        for (size_t frame = 0; frame < track.second.starts.size(); frame++)
+        {
+            refs.push_back({ &track.second, track.first, uint32_t(frame) });
+        }
+    }
+
+    // a counting sort of the frames by bucket, per table
+    const size_t numBuckets = size_t(1) << kBits;
+    bucketStarts.assign(kTables, std::vector<uint32_t>(numBuckets + 1, 0));
+    bucketFrames.assign(kTables, std::vector<uint32_t>(refs.size()));
+
+    for (int table = 0; table < kTables; table++)
+    {
+        std::vector<uint32_t> &starts = bucketStarts[table];
+        for (const auto &ref : refs)
+        {
+            starts[ref.entries->hashes[ref.frame * kTables + table] + 1] += 1;
+        }
+        for (size_t bucket = 0; bucket < numBuckets; bucket++)
+        {
+            starts[bucket + 1] += starts[bucket];
+        }
+
+        std::vector<uint32_t> fill(starts.begin(), starts.end() - 1);
+        for (uint32_t id = 0; id < refs.size(); id++)
+        {
+            const auto &ref = refs[id];
+            bucketFrames[table][fill[ref.entries->hashes[ref.frame * kTables + table]]++] = id;
+        }
+    }
+
+    seenBy.assign(refs.size(), 0);
+    searchCount = 0;
+    bucketsDirty = false;
+}
+
+#pragma mark Searching
+
+int32_t IALEmbeddingIndex::score(const int8_t *query, const EntryRef &ref) const
+{
+    const int8_t *row = ref.entries->vectors.data() + ref.frame * dimensions;
+    int32_t sum = 0;
+    for (size_t i = 0; i < dimensions; i++)
+    {
+        sum += int32_t(query[i]) * int32_t(row[i]);
+    }
+    return sum;
+}
+
+bool IALEmbeddingIndex::embeddingOf(TrackId track, double t0, double t1, std::vector<float> &query) const
+{
+    auto iter = tracks.find(track);
+    if (iter == tracks.end())
+    {
+        return false;
+    }
+
+    const TrackEntries &entries = iter->second;
+    query.assign(dimensions, 0.0f);
+    size_t count = 0;
+    for (size_t frame = 0; frame < entries.starts.size(); frame++)
+    {
+        if (entries.starts[frame] < t1 && entries.ends[frame] > t0)
+        {
+            const int8_t *row = entries.vectors.data() + frame * dimensions;
+            for (size_t i = 0; i < dimensions; i++)
+            {
+                query[i] += row[i];
+            }
+            count += 1;
+        }
+    }
+
+    double norm = 0;
+    for (float value : query)
+    {
+        norm += double(value) * value;
+    }
+    if (count == 0 || norm <= 0)
+    {
+        return false;
+    }
+
+    const float scale = float(1.0 / std::sqrt(norm));
+    for (auto &value : query)
+    {
+        value *= scale;
+    }
+    return true;
+}
+
+std::vector<IALSimilarRange> IALEmbeddingIndex::search(const std::vector<float> &query, size_t maxRanges,
+                                                       TrackId excludeTrack, double excludeT0, double excludeT1)
+{
+    std::vector<IALSimilarRange> ranges;
+    if (empty() || maxRanges == 0 || query.size() != dimensions)
+    {
+        return ranges;
+    }
+
+    if (bucketsDirty)
+    {
+        rebuildBuckets();
+    }
+
+    std::vector<int8_t> quantised(dimensions);
+    for (size_t i = 0; i < dimensions; i++)
+    {
+        quantised[i] = int8_t(std::lround(std::min(1.0f, std::max(-1.0f, query[i])) * 127));
+    }
+
+    uint16_t queryHashes[kTables];
+    hash(quantised.data(), 1, queryHashes);
+
+    searchCount += 1;
+    if (searchCount == 0)
+    {
+        std::fill(seenBy.begin(), seenBy.end(), 0);
+        searchCount = 1;
+    }
+
+    // (score, frame) of every frame ranked
+    std::vector<std::pair<int32_t, uint32_t>> candidates;
+    auto consider = [&](uint32_t id)
+    {
+        if (seenBy[id] == searchCount)
+        {
+            return;
+        }
+        seenBy[id] = searchCount;
+
+        const EntryRef &ref = refs[id];
+        if (ref.track == excludeTrack &&
+            ref.entries->starts[ref.frame] < excludeT1 && ref.entries->ends[ref.frame] > excludeT0)
+        {
+            return;
+        }
+        candidates.emplace_back(score(quantised.data(), ref), id);
+    };
+
+    for (int table = 0; table < kTables; table++)
+    {
+        // the query's own bucket, then each bucket one bit away
+        for (int probe = -1; probe < kBits; probe++)
+        {
+            const uint32_t bucket = queryHashes[table] ^ (probe < 0 ? 0 : (1u << probe));
+            const std::vector<uint32_t> &starts = bucketStarts[table];
+            for (uint32_t i = starts[bucket]; i < starts[bucket + 1]; i++)
+            {
+                consider(bucketFrames[table][i]);
+            }
+        }
+    }
+
+    // too few near neighbours, e.g. in a small project: rank everything
+    const size_t wanted = maxRanges * kFramesPerRange;
+    if (candidates.size() < wanted)
+    {
+        for (uint32_t id = 0; id < refs.size(); id++)
+        {
+            consider(id);
+        }
+    }
+
+    const size_t kept = std::min(wanted, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + kept, candidates.end(),
+        [](const std::pair<int32_t, uint32_t> &a, const std::pair<int32_t, uint32_t> &b){ return a.first > b.first; });
+    candidates.resize(kept);
+
+    // the best frames in track order, so that neighbours can be merged
+    std::sort(candidates.begin(), candidates.end(),
+        [this](const std::pair<int32_t, uint32_t> &a, const std::pair<int32_t, uint32_t> &b)
+        {
+            const EntryRef &refA = refs[a.second];
+            const EntryRef &refB = refs[b.second];
+            if (refA.track != refB.track)
+            {
+                return refA.track < refB.track;
+            }
+            return refA.frame < refB.frame;
+        });
+
+    for (const auto &candidate : candidates)
+    {
+        const EntryRef &ref = refs[candidate.second];
+        const double start = ref.entries->starts[ref.frame];
+        const double end = ref.entries->ends[ref.frame];
+        const float similarity = candidate.first / kFullScale;
+
+        if (!ranges.empty() && ranges.back().track == ref.track && start <= ranges.back().end + 1e-9)
+        {
+            ranges.back().end = std::max(ranges.back().end, end);
+            ranges.back().similarity = std::max(ranges.back().similarity, similarity);
+            continue;
+        }
+
+        ranges.push_back({ ref.track, start, end, similarity });
+    }
+
+    std::sort(ranges.begin(), ranges.end(),
+        [](const IALSimilarRange &a, const IALSimilarRange &b){ return a.similarity > b.similarity; });
+    if (ranges.size() > maxRanges)
+    {
+        ranges.resize(maxRanges);
+    }
+
+    return ranges;
+}
@@ -0,0 +1,116 @@
+//
+//  IALEmbeddingIndex.hpp
+//  Audacity
+//
+
+#ifndef IALEmbeddingIndex_hpp
+#define IALEmbeddingIndex_hpp
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "../Track.h"
+
+class IALAudioFrameCollection;
+
+/**
+ @brief A stretch of a track that sounds like the query, and how alike they are, from -1 to 1.
+ */
+struct IALSimilarRange
+{
+    TrackId track;
+    double start;
+    double end;
+    float similarity;
+};
+
+/**
+ @brief An approximate nearest neighbour index over the frame embeddings of every labeled track in a project.
+ @discussion Each track's frames are copied in from its collection's IALEmbeddingStore when its labels are committed. The frames
+ are hashed into kTables tables by the signs of their projections onto kBits random hyperplanes per table, so frames at a small
+ angle to each other tend to share a bucket. A search probes the query's bucket, and every bucket one bit away from it, in each
+ table, and ranks only the frames it finds there by their exact similarity; if that turns up too few frames, every frame is
+ ranked instead. Neither path runs the model.
+
+ The hyperplanes are drawn from a fixed seed, so a track's hashes only depend on its embeddings. The buckets themselves are rebuilt
+ lazily, on the first search after a track has changed. The embeddings outlive the project session in the label cache (see
+ IALLabelCache::lookupEmbedding), so relabeling a reopened project refills the index without inference.
+
+ Only used on the main thread.
+ */
+class IALEmbeddingIndex
+{
+public:
+    /**
+     @brief Replaces a track's frames with the given frames of its collection.
+     @param frames indices into the collection's audioFrames. Frames without an embedding are left out.
+     @discussion An embedding of a different size than the ones already indexed, e.g. from another model, empties the index first.
+     */
+    void updateTrack(TrackId track, IALAudioFrameCollection &collection, const std::vector<size_t> &frames);
+    void removeTrack(TrackId track);
+    void clear();
+
+    std::vector<TrackId> indexedTracks() const;
+    bool empty() const { return numEntries == 0; }
+    size_t size() const { return numEntries; }
+
+    /**
+     @brief The mean of a track's embeddings between t0 and t1, as a unit vector.
+     @returns false if no indexed frame of the track overlaps the range.
+     */
+    bool embeddingOf(TrackId track, double t0, double t1, std::vector<float> &query) const;
+
+    /**
+     @brief The ranges that are most similar to the query, best first.
+     @discussion Adjacent matching frames of a track are merged into one range, which takes the similarity of its best frame.
+     Frames of the excluded track between excludeT0 and excludeT1 (usually the query's own) are never returned.
+     */
+    std::vector<IALSimilarRange> search(const std::vector<float> &query, size_t maxRanges,
+                                        TrackId excludeTrack, double excludeT0, double excludeT1);
+
+    static const int kTables = 8;
+    static const int kBits = 12;
+
+private:
+    struct TrackEntries
+    {
+        std::vector<double> starts;
+        std::vector<double> ends;
+        // dimensions values per frame, quantised as in IALEmbeddingStore
+        std::vector<int8_t> vectors;
+        // kTables hashes per frame
+        std::vector<uint16_t> hashes;
+    };
+
+    struct EntryRef
+    {
+        const TrackEntries *entries;
+        TrackId track;
+        uint32_t frame;
+    };
+
+    void makeHyperplanes();
+    void hash(const int8_t *vectors, size_t count, uint16_t *hashes) const;
+    void rebuildBuckets();
+    int32_t score(const int8_t *query, const EntryRef &ref) const;
+
+    size_t dimensions = 0;
+    size_t numEntries = 0;
+    std::map<TrackId, TrackEntries> tracks;
+
+    // (kTables * kBits, dimensions), row major
+    std::vector<float> hyperplanes;
+
+    // every indexed frame, and per table, the frames in each bucket: bucketFrames[bucketStarts[b]] up to bucketFrames[bucketStarts[b + 1]]
+    bool bucketsDirty = true;
+    std::vector<EntryRef> refs;
+    std::vector<std::vector<uint32_t>> bucketStarts;
+    std::vector<std::vector<uint32_t>> bucketFrames;
+
+    // the search that last saw each frame, so that a frame found in several buckets is only ranked once
+    std::vector<uint32_t> seenBy;
+    uint32_t searchCount = 0;
+};
+
+#endif /* IALEmbeddingIndex_hpp */
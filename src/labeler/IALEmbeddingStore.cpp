@@ -0,0 +1,63 @@
+//
+//  IALEmbeddingStore.cpp
+//  Audacity
+//
+
+#include "IALEmbeddingStore.hpp"
+
+#include <algorithm>
+
+void IALEmbeddingStore::resize(size_t numFrames)
+{
+    values.resize(numFrames * dimensions, 0);
+    present.resize(numFrames, false);
+}
+
+void IALEmbeddingStore::clear()
+{
+    dimensions = 0;
+    values.clear();
+    present.assign(present.size(), false);
+}
+
+std::vector<int8_t> IALEmbeddingStore::quantise(const torch::Tensor &embedding)
+{
+    torch::Tensor flat = embedding.reshape({-1}).to(torch::kFloat32);
+    // a zero vector stays zero, and matches nothing
+    torch::Tensor unit = flat / flat.norm().clamp_min(1e-12);
+
+    torch::Tensor quantised = (unit.clamp(-1, 1) * 127).round().to(torch::kInt8).contiguous();
+    const int8_t *data = quantised.data_ptr<int8_t>();
+    return std::vector<int8_t>(data, data + quantised.numel());
+}
+
+void IALEmbeddingStore::set(size_t frame, const torch::Tensor &embedding)
+{
+    set(frame, quantise(embedding));
+}
+
+void IALEmbeddingStore::set(size_t frame, const std::vector<int8_t> &quantised)
+{
+    if (dimensions == 0)
+    {
+        dimensions = quantised.size();
+        values.assign(present.size() * dimensions, 0);
+    }
+
+    if (frame >= present.size() || quantised.size() != dimensions || dimensions == 0)
+    {
+        return;
+    }
+
+    std::copy(quantised.begin(), quantised.end(), values.begin() + frame * dimensions);
+    present[frame] = true;
+}
+
+const int8_t *IALEmbeddingStore::row(size_t frame) const
+{
+    if (!has(frame))
+    {
+        return nullptr;
+    }
+    return values.data() + frame * dimensions;
+}
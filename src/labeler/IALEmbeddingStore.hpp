@@ -0,0 +1,62 @@
+//
+//  IALEmbeddingStore.hpp
+//  Audacity
+//
+
+#ifndef IALEmbeddingStore_hpp
+#define IALEmbeddingStore_hpp
+
+#include <cstdint>
+#include <vector>
+
+#include <torch/script.h>
+
+/**
+ @brief The embedding of every frame of a collection, kept at one byte per dimension.
+ @discussion Embeddings are only ever compared by the angle between them, so each one is scaled to unit length and stored as
+ multiples of 1/127. Rows are indexed by the frame's position in the collection, like IALProbitStore. A row that was never set
+ reads as missing.
+ */
+class IALEmbeddingStore
+{
+public:
+    /**
+     @brief Grows or shrinks the store to numFrames rows, keeping the rows that remain.
+     */
+    void resize(size_t numFrames);
+    void clear();
+
+    size_t numDimensions() const { return dimensions; }
+    size_t numFrames() const { return present.size(); }
+    bool has(size_t frame) const { return frame < present.size() && present[frame]; }
+
+    /**
+     @brief Normalises and stores a frame's embedding.
+     @param embedding one value per dimension. The number of dimensions is fixed by the first row set after a clear.
+     */
+    void set(size_t frame, const torch::Tensor &embedding);
+
+    /**
+     @brief Stores an embedding that is already quantised, e.g. one read back from the project's cache.
+     */
+    void set(size_t frame, const std::vector<int8_t> &quantised);
+
+    /**
+     @brief The quantised embedding of a frame, numDimensions() long, or null if the frame has none.
+     */
+    const int8_t *row(size_t frame) const;
+
+    /**
+     @brief Quantises a unit-length vector the way the store does.
+     */
+    static std::vector<int8_t> quantise(const torch::Tensor &embedding);
+
+    size_t sizeInBytes() const { return values.size(); }
+
+private:
+    size_t dimensions = 0;
+    std::vector<int8_t> values;
+    std::vector<bool> present;
+};
+
+#endif /* IALEmbeddingStore_hpp */
@@ -0,0 +1,245 @@
+//
+//  IALLabelCache.cpp
+//  Audacity
+//
+
+#include "IALLabelCache.hpp"
+
+#include <algorithm>
+
+#include <sqlite3.h>
+#include <wx/string.h>
+
+#include "../DBConnection.h"
+#include "../Project.h"
+
+IALLabelCache::IALLabelCache(AudacityProject &project)
+    : project(project)
+{
+}
+
+DBConnection *IALLabelCache::connection()
+{
+    return ConnectionPtr::Get(project).mpConnection.get();
+}
+
+bool IALLabelCache::isPrepared(DBConnection *conn) const
+{
+    return conn && conn == preparedConnection && conn->DB() == preparedDB;
+}
+
+bool IALLabelCache::prepare(const std::vector<int64_t> &modelHashes)
+{
+    auto conn = connection();
+    if (!conn)
+    {
+        return false;
+    }
+
+    if (isPrepared(conn) && preparedModelHashes == modelHashes)
+    {
+        return true;
+    }
+
+    // projects saved before the cache existed won't have the table yet
+    int rc = sqlite3_exec(conn->DB(),
+        "CREATE TABLE IF NOT EXISTS main.labelcache"
+        "("
+        "  fingerprint          INTEGER,"
+        "  modelhash            INTEGER,"
+        "  probits              BLOB,"
+        "  PRIMARY KEY (fingerprint, modelhash)"
+        ") WITHOUT ROWID;",
+        nullptr, nullptr, nullptr);
+    if (rc == SQLITE_OK)
+    {
+        rc = sqlite3_exec(conn->DB(),
+            "CREATE TABLE IF NOT EXISTS main.labelembeddings"
+            "("
+            "  fingerprint          INTEGER,"
+            "  modelhash            INTEGER,"
+            "  embedding            BLOB,"
+            "  PRIMARY KEY (fingerprint, modelhash)"
+            ") WITHOUT ROWID;",
+            nullptr, nullptr, nullptr);
+    }
+    if (rc != SQLITE_OK)
+    {
+        return false;
+    }
+
+    // anything produced by a model or class list that isn't in use is stale
+    wxString hashList;
+    for (int64_t modelHash : modelHashes)
+    {
+        hashList += wxString::Format("%s%lld", hashList.empty() ? "" : ",", (long long) modelHash);
+    }
+    wxString sql;
+    sql.Printf("DELETE FROM main.labelcache WHERE modelhash NOT IN (%s);"
+               "DELETE FROM main.labelembeddings WHERE modelhash NOT IN (%s);",
+               hashList, hashList);
+    sqlite3_exec(conn->DB(), sql, nullptr, nullptr, nullptr);
+
+    preparedModelHashes = modelHashes;
+    preparedConnection = conn;
+    preparedDB = conn->DB();
+    return true;
+}
+
+bool IALLabelCache::lookup(size_t fingerprint, int64_t modelHash, std::vector<float> &probits)
+{
+    try
+    {
+        auto conn = connection();
+        if (!isPrepared(conn))
+        {
+            return false;
+        }
+
+        // Prepare and cache statement...automatically finalized at DB close
+        sqlite3_stmt *stmt = conn->Prepare(DBConnection::GetLabelCache,
+            "SELECT probits FROM labelcache WHERE fingerprint = ?1 AND modelhash = ?2;");
+
+        if (sqlite3_bind_int64(stmt, 1, (sqlite3_int64) fingerprint) ||
+            sqlite3_bind_int64(stmt, 2, modelHash))
+        {
+            wxASSERT_MSG(false, wxT("Binding failed...bug!!!"));
+        }
+
+        bool found = false;
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            const float *blob = (const float *) sqlite3_column_blob(stmt, 0);
+            size_t count = sqlite3_column_bytes(stmt, 0) / sizeof(float);
+            probits.assign(blob, blob + count);
+            found = count > 0;
+        }
+
+        // Clear statement bindings and rewind statement
+        sqlite3_clear_bindings(stmt);
+        sqlite3_reset(stmt);
+
+        return found;
+    }
+    catch (...)
+    {
+        // a cache that can't be read is just a miss
+        return false;
+    }
+}
+
+bool IALLabelCache::lookupEmbedding(size_t fingerprint, int64_t modelHash, std::vector<int8_t> &embedding)
+{
+    try
+    {
+        auto conn = connection();
+        if (!isPrepared(conn))
+        {
+            return false;
+        }
+
+        // Prepare and cache statement...automatically finalized at DB close
+        sqlite3_stmt *stmt = conn->Prepare(DBConnection::GetLabelEmbedding,
+            "SELECT embedding FROM labelembeddings WHERE fingerprint = ?1 AND modelhash = ?2;");
+
+        if (sqlite3_bind_int64(stmt, 1, (sqlite3_int64) fingerprint) ||
+            sqlite3_bind_int64(stmt, 2, modelHash))
+        {
+            wxASSERT_MSG(false, wxT("Binding failed...bug!!!"));
+        }
+
+        bool found = false;
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            const int8_t *blob = (const int8_t *) sqlite3_column_blob(stmt, 0);
+            size_t count = sqlite3_column_bytes(stmt, 0);
+            embedding.assign(blob, blob + count);
+            found = count > 0;
+        }
+
+        // Clear statement bindings and rewind statement
+        sqlite3_clear_bindings(stmt);
+        sqlite3_reset(stmt);
+
+        return found;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+void IALLabelCache::store(const std::vector<IALCachedPrediction> &predictions, int64_t modelHash)
+{
+    // predictions of a model that wasn't prepared would be purged by the next prepare anyway
+    auto conn = connection();
+    if (predictions.empty() || !isPrepared(conn) ||
+        std::find(preparedModelHashes.begin(), preparedModelHashes.end(), modelHash) == preparedModelHashes.end())
+    {
+        return;
+    }
+
+    // the cache is optional, so failures are silently dropped rather than reported
+    try
+    {
+        TransactionScope trans(*conn, "IALLabelCache");
+
+        // Prepare and cache statement...automatically finalized at DB close
+        sqlite3_stmt *stmt = conn->Prepare(DBConnection::PutLabelCache,
+            "INSERT OR REPLACE INTO labelcache (fingerprint, modelhash, probits)"
+            "                          VALUES(?1,?2,?3);");
+
+        sqlite3_stmt *embeddingStmt = conn->Prepare(DBConnection::PutLabelEmbedding,
+            "INSERT OR REPLACE INTO labelembeddings (fingerprint, modelhash, embedding)"
+            "                                VALUES(?1,?2,?3);");
+
+        for (auto &prediction : predictions)
+        {
+            if (!prediction.embedding.empty())
+            {
+                if (sqlite3_bind_int64(embeddingStmt, 1, (sqlite3_int64) prediction.fingerprint) ||
+                    sqlite3_bind_int64(embeddingStmt, 2, modelHash) ||
+                    sqlite3_bind_blob(embeddingStmt, 3, prediction.embedding.data(),
+                                      prediction.embedding.size(), SQLITE_STATIC))
+                {
+                    wxASSERT_MSG(false, wxT("Binding failed...bug!!!"));
+                }
+
+                int rc = sqlite3_step(embeddingStmt);
+
+                sqlite3_clear_bindings(embeddingStmt);
+                sqlite3_reset(embeddingStmt);
+
+                if (rc != SQLITE_DONE)
+                {
+                    return;
+                }
+            }
+
+            if (sqlite3_bind_int64(stmt, 1, (sqlite3_int64) prediction.fingerprint) ||
+                sqlite3_bind_int64(stmt, 2, modelHash) ||
+                sqlite3_bind_blob(stmt, 3, prediction.probits.data(),
+                                  prediction.probits.size() * sizeof(float), SQLITE_STATIC))
+            {
+                wxASSERT_MSG(false, wxT("Binding failed...bug!!!"));
+            }
+
+            int rc = sqlite3_step(stmt);
+
+            // Clear statement bindings and rewind statement
+            sqlite3_clear_bindings(stmt);
+            sqlite3_reset(stmt);
+
+            if (rc != SQLITE_DONE)
+            {
+                // leave the transaction to roll back; the cache is optional
+                return;
+            }
+        }
+
+        trans.Commit();
+    }
+    catch (...)
+    {
+    }
+}
@@ -0,0 +1,82 @@
+//
+//  IALLabelCache.hpp
+//  Audacity
+//
+
+#ifndef IALLabelCache_hpp
+#define IALLabelCache_hpp
+
+#include <cstdint>
+#include <vector>
+
+class AudacityProject;
+class DBConnection;
+struct sqlite3;
+
+/**
+ @brief The class probabilities the model produced for one frame, keyed by the frame's fingerprint.
+ @discussion The embedding is only kept when embeddings are being stored (see IALEmbeddingStore); it is empty otherwise.
+ */
+struct IALCachedPrediction {
+    size_t fingerprint;
+    std::vector<float> probits;
+    std::vector<int8_t> embedding;
+};
+
+/**
+ @brief Persists per-frame predictions in the labelcache table of the project database.
+ @discussion Frames are keyed by their sample block fingerprint (see IALAudioFrame::fingerprint) and by the hash of the model and
+ class list, so reopening a labeled project only runs the model on frames whose audio changed, and swapping the model invalidates
+ everything it did not produce. Frame embeddings are kept the same way, in the labelembeddings table, so that the project's
+ similarity index (see IALEmbeddingIndex) can be rebuilt without the model.
+ */
+class IALLabelCache
+{
+public:
+    explicit IALLabelCache(AudacityProject &project);
+
+    IALLabelCache(const IALLabelCache &) = delete;
+    IALLabelCache &operator= (const IALLabelCache &) = delete;
+
+    /**
+     @brief Creates the table in projects that predate it, and drops rows produced by any model but the given ones.
+     @discussion Must be called on the main thread before lookup is used on a worker, with the hashes of every model in use
+     (the classifier's and each vocabulary's). Only predictions of these models are stored.
+     @returns false if the cache can't be used, in which case lookups always miss.
+     */
+    bool prepare(const std::vector<int64_t> &modelHashes);
+
+    /**
+     @brief Fetches the cached prediction for a frame. Safe to call from a worker thread.
+     @returns true on a hit.
+     */
+    bool lookup(size_t fingerprint, int64_t modelHash, std::vector<float> &probits);
+
+    /**
+     @brief Fetches the cached embedding for a frame, quantised as in IALEmbeddingStore. Safe to call from a worker thread.
+     @returns true on a hit.
+     */
+    bool lookupEmbedding(size_t fingerprint, int64_t modelHash, std::vector<int8_t> &embedding);
+
+    /**
+     @brief Writes new predictions in a single transaction. Must be called on the main thread.
+     */
+    void store(const std::vector<IALCachedPrediction> &predictions, int64_t modelHash);
+
+private:
+    DBConnection *connection();
+
+    /**
+     @brief Whether prepare succeeded on this connection.
+     @discussion The connection is replaced when the project is saved under another name or reopened, and the new database
+     may not have the tables, so readiness is kept for the connection it was established on.
+     */
+    bool isPrepared(DBConnection *conn) const;
+
+    AudacityProject &project;
+    std::vector<int64_t> preparedModelHashes;
+    DBConnection *preparedConnection = nullptr;
+    sqlite3 *preparedDB = nullptr;
+};
+
+#endif /* IALLabelCache_hpp */
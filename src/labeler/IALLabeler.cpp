@@ -8,26 +8,65 @@
 
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <chrono>
 
 #include "IALLabeler.hpp"
 #include "ProjectHistory.h"
 
+#include <wx/app.h>
+#include <wx/log.h>
 #include <wx/textfile.h>
 
 #include "IALAudioFrame.hpp"
+#include "IALModelRegistry.hpp"
+#include "IALWorkerPool.hpp"
 #include "WaveTrack.h"
 #include "../WaveClip.h"
 #include "../Track.h"
 #include "../TrackUtilities.h"
 #include "../LabelTrack.h"
 #include "../ViewInfo.h"
+#include "../Prefs.h"
+#include "../ProjectStatus.h"
+#include "../ProjectWindow.h"
 #include "../SampleFormat.h"
+#include "../Resample.h"
+#include "../widgets/ProgressDialog.h"
 
 
 #pragma mark ClientData Initialization
 
 static const std::string kModelPath = wxFileName(FileNames::ResourcesDir(), wxT("ial-model.pt")).GetFullPath().ToStdString();
 static const std::string kInstrumentListPath = wxFileName(FileNames::ResourcesDir(), wxT("ial-instruments.txt")).GetFullPath().ToStdString();
+static const std::string kSeparationModelPath = wxFileName(FileNames::ResourcesDir(), wxT("separation-model.pt")).GetFullPath().ToStdString();
+static const std::string kSeparationInstrumentListPath = wxFileName(FileNames::ResourcesDir(), wxT("separation-instruments.txt")).GetFullPath().ToStdString();
+
+// the separation model separates one second chunks of 8kHz audio
+static const int kSeparationSampleRate = 8000;
+
+static std::shared_ptr<ClassificationModel> AcquireClassifier()
+{
+    return IALModelRegistry::Get().acquire<ClassificationModel>(kModelPath, kInstrumentListPath);
+}
+
+static std::shared_ptr<ClassificationModel> AcquireVocabulary(const wxString &name)
+{
+    const wxString folder = wxFileName(FileNames::ResourcesDir(), wxT("ial-weights")).GetFullPath();
+    wxFileName modelPath(folder, wxT("ial-model.pt"));
+    modelPath.AppendDir(name);
+    wxFileName instrumentListPath(folder, wxT("ial-instruments.txt"));
+    instrumentListPath.AppendDir(name);
+
+    return IALModelRegistry::Get().acquire<ClassificationModel>(modelPath.GetFullPath().ToStdString(),
+                                                                instrumentListPath.GetFullPath().ToStdString());
+}
+
+static std::shared_ptr<DeepModel> AcquireSeparationModel()
+{
+    return IALModelRegistry::Get().acquire<DeepModel>(kSeparationModelPath, kSeparationInstrumentListPath,
+                                                      [](DeepModel &model){ model.setChunkLen(kSeparationSampleRate); });
+}
 
 /**
  @brief An anonymous function that initializes an instance of IALLabeler.
@@ -67,24 +106,237 @@ const IALLabeler &IALLabeler::Get(const AudacityProject &project)
 #pragma mark Initializer
 
 IALLabeler::IALLabeler(AudacityProject &project)
-    : classifier(kModelPath, kInstrumentListPath), project(project), tracks(std::map<TrackId, IALAudioFrameCollection>())
+    : project(project), labelCache(project), tracks(std::map<TrackId, IALAudioFrameCollection>())
 {
+    TrackList::Get( project ).Bind(EVT_TRACKLIST_DELETION, &IALLabeler::onTrackListDeletion, this);
 }
 
+IALLabeler::~IALLabeler()
+{
+    // the workers hold pointers into our frame collections
+    cancelLabeling(true);
+    stopLiveLabeling(true);
+}
+
+#pragma mark Models
+
+ClassificationModel &IALLabeler::getClassifier()
+{
+    if (!classifier)
+    {
+        classifier = AcquireClassifier();
+    }
+
+    return *classifier;
+}
+
+auto IALLabeler::getVocabularies() -> const std::vector<std::pair<std::string, std::shared_ptr<ClassificationModel>>> &
+{
+    wxString names;
+    gPrefs->Read(wxT("/IAL/Vocabularies"), &names, wxT(""));
+    if (names == loadedVocabularies)
+    {
+        return vocabularies;
+    }
+
+    vocabularies.clear();
+    loadedVocabularies = names;
+
+    ClassificationModel &primary = getClassifier();
+    wxString skipped;
+    for (wxString name : wxSplit(names, ';'))
+    {
+        for (wxString part : wxSplit(name, ','))
+        {
+            part.Trim(true).Trim(false);
+            if (part.empty())
+            {
+                continue;
+            }
+
+            std::shared_ptr<ClassificationModel> model;
+            try
+            {
+                model = AcquireVocabulary(part);
+            }
+            catch (const std::exception &e)
+            {
+                // the status message names it among the skipped ones; the log says why
+                wxLogWarning(wxT("Could not load vocabulary %s: %s"), part, wxString(e.what()));
+            }
+
+            // the vocabulary is fed the classifier's frames, so it has to frame audio the same way
+            if (!model || model->getSampleRate() != primary.getSampleRate() ||
+                model->getChunkLen() != primary.getChunkLen() || model->getHopLen() != primary.getHopLen())
+            {
+                skipped += (skipped.empty() ? wxT("") : wxT(", ")) + part;
+                continue;
+            }
+
+            vocabularies.emplace_back(part.ToStdString(), model);
+        }
+    }
+
+    if (!skipped.empty())
+    {
+        ProjectStatus::Get( project ).Set(
+            XO("Skipped vocabularies that could not be loaded or don't match the classifier: %s").Format( skipped ));
+    }
+
+    return vocabularies;
+}
+
+void IALLabeler::configureInference()
+{
+    InferenceOptions options;
+
+    gPrefs->Read(wxT("/IAL/FreezeModels"), &options.freeze, true);
+    gPrefs->Read(wxT("/IAL/QuantizedModel"), &options.quantized, false);
+    gPrefs->Read(wxT("/IAL/IntraOpThreads"), &options.intraOpThreads, 0);
+    gPrefs->Read(wxT("/IAL/InterOpThreads"), &options.interOpThreads, 0);
+
+    DeepModel::setInferenceOptions(options);
+}
+
+void IALLabeler::warmUpModels()
+{
+    bool warmUp = true;
+    gPrefs->Read(wxT("/IAL/WarmUpModels"), &warmUp, true);
+    if (!warmUp)
+    {
+        return;
+    }
+
+    // create the registry before the pool, so it is destroyed after the workers have stopped
+    IALModelRegistry::Get();
+
+    IALWorkerPool::Get().enqueue([]
+    {
+        auto model = AcquireClassifier();
+
+        // the first forward pass is much slower than the rest, so run one on a silent frame
+        torch::NoGradGuard noGrad;
+        model->predictSequenceBatch({ torch::zeros({1, 1, 1, model->getChunkLen()}) });
+    });
+
+    IALWorkerPool::Get().enqueue([]
+    {
+        AcquireSeparationModel();
+    });
+}
+
+float IALLabeler::confidenceThreshold()
+{
+    double threshold = 0.3;
+    gPrefs->Read(wxT("/IAL/ConfidenceThreshold"), &threshold, 0.3);
+    return float(std::min(1.0, std::max(0.0, threshold)));
+}
+
+void IALLabeler::setConfidenceThreshold(float threshold)
+{
+    gPrefs->Write(wxT("/IAL/ConfidenceThreshold"), double(threshold));
+    gPrefs->Flush();
+}
+
+int IALLabeler::topK()
+{
+    int k = 3;
+    gPrefs->Read(wxT("/IAL/TopK"), &k, 3);
+    return std::max(0, k);
+}
+
+bool IALLabeler::storeEmbeddings()
+{
+    bool store = false;
+    gPrefs->Read(wxT("/IAL/StoreEmbeddings"), &store, false);
+    return store;
+}
+
+#pragma mark Background Labeling
+
+/**
+ @brief One queued labeling pass over a single frame collection.
+ @discussion The worker only touches the collection (which reads from its snapshot), the atomics and the result.
+ Everything else belongs to the main thread.
+ */
+struct IALLabeler::Job
+{
+    TrackId leaderId;
+    IALAudioFrameCollection *collection = nullptr;
+
+    std::atomic<bool> cancelled{ false };
+    std::atomic<size_t> framesDone{ 0 };
+    std::atomic<size_t> framesTotal{ 0 };
+
+    IALLabelingResult result;
+    // set by finish()
+    std::string error;
+
+    /**
+     @brief Called by the worker before it touches the collection.
+     @return false if the job was cancelled while it was still queued, in which case it must not be run.
+     */
+    bool start()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (cancelled)
+        {
+            return false;
+        }
+        started = true;
+        return true;
+    }
+
+    void cancel()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        cancelled = true;
+    }
+
+    /**
+     @brief Called by the worker once the job has ended, however it ended.
+     @param error why the job failed, or empty if it didn't.
+     */
+    void finish(std::string failure)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        error = std::move(failure);
+        done = true;
+        condition.notify_all();
+    }
+
+    /**
+     @brief Blocks until a running job has finished. Returns straight away for a job that hasn't started.
+     @discussion Must only be called after cancel(), so a job that hasn't started never will.
+     */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this]{ return done || !started; });
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool started = false;
+    bool done = false;
+};
+
 // # pragma mark Private
 
 void IALLabeler::labelTracks()
 {   
-    // try{
-    TrackList &tracklist = TrackList::Get(const_cast<AudacityProject&>(project));
-    const auto& playableTracks = tracklist.Any<PlayableTrack>();
+    TrackList &tracklist = TrackList::Get(project);
 
-    for (Track *track : playableTracks ){ 
-        // we want to arrange the tracks until after we're done iterating through them
-        labelTrack(track, false);
+    std::vector<JobPtr> jobs;
+    for (Track *track : tracklist.Leaders<WaveTrack>()){ 
+        if (auto job = makeJob(track)){
+            jobs.push_back(job);
+        }
     }
-    // arrange the tracks
-    arrangeTracks();
+
+    // we want to arrange the tracks until after we're done labeling all of them
+    startJobs(jobs, true);
 }
 
 // because we're only allowed to move the tracks either once down or up, 
@@ -112,156 +364,765 @@ void IALLabeler::arrangeTracks(){
             // then move the label track all the to the bottom
             TrackUtilities::DoMoveTrack(project, labelTrack, TrackUtilities::MoveChoice::OnMoveBottomID);
 
-            // auto history = ;
-            ProjectHistory::Get( project ).PushState(XO("Moved Labeled Track Pair"), XO("Move Labeled"));
-
         }
     } 
 }
 
 void IALLabeler::labelTrack(Track* track, bool arrange)
 {   
-    TrackList &tracklist = TrackList::Get(const_cast<AudacityProject&>(project));
-    const auto& playableTracks = tracklist.Any<PlayableTrack>();
+    std::vector<JobPtr> jobs;
+    if (auto job = makeJob(track)){
+        jobs.push_back(job);
+    }
+
+    startJobs(jobs, arrange);
+}
+
+void IALLabeler::cancelLabeling(bool wait)
+{
+    // jobs that are still queued, possibly behind other projects' jobs, are skipped by the workers
+    for (auto &job : activeJobs){
+        job->cancel();
+    }
+
+    if (wait){
+        for (auto &job : activeJobs){
+            job->wait();
+            // drop our copies of the tracks while the database is still open
+            job->collection->releaseSnapshot();
+        }
+        for (auto &job : finishedJobs){
+            job->collection->releaseSnapshot();
+        }
+
+        // nothing is committed to a project that is closing; onJobFinished ignores the jobs still to report back
+        activeJobs.clear();
+        finishedJobs.clear();
+        arrangeWhenDone = false;
+    }
+}
+
+auto IALLabeler::makeJob(Track* track) -> JobPtr
+{
+    TrackList &tracklist = TrackList::Get(project);
+
+    if (dynamic_cast<WaveTrack *>(track) == nullptr)
+    {
+        return nullptr;
+    }
+
+    Track *leader = *tracklist.FindLeader(track);
+    TrackId leaderID = leader->GetId();
+    std::shared_ptr<WaveTrack> leaderTrack = leader->SharedPointer<WaveTrack>();
+
+    // don't queue a track that is still being labeled
+    for (auto &job : activeJobs)
+    {
+        if (job->leaderId == leaderID)
+        {
+            return nullptr;
+        }
+    }
+
+    // find out if we have labeled this track before
+    // if we haven't, create a new entry 
+    auto pair = tracks.find(leaderID);
+    if (pair == tracks.end())
+    {
+        tracks.insert(std::make_pair(leaderID, IALAudioFrameCollection(getClassifier(), leaderTrack, &labelCache)));
+        pair = tracks.find(leaderID);
+    }
+
+    // grab the frame collection, and add any new channels to it
+    IALAudioFrameCollection& frameCollection = pair->second;
+    for (WaveTrack *channel : TrackList::Channels(leaderTrack.get()))
+    {
+        frameCollection.addChannel(channel->SharedPointer<WaveTrack>());
+    }
+
+    // update collection length
+    frameCollection.updateCollectionLength();
+    frameCollection.confidenceThreshold = confidenceThreshold();
+    frameCollection.topK = topK();
+    frameCollection.storeEmbeddings = storeEmbeddings();
+    frameCollection.setVocabularies(getVocabularies());
+
+    auto job = std::make_shared<Job>();
+    job->leaderId = leaderID;
+    job->collection = &frameCollection;
+    job->framesTotal = frameCollection.audioFrames.size();
+
+    return job;
+}
+
+void IALLabeler::startJobs(const std::vector<JobPtr> &jobs, bool arrange)
+{
+    if (jobs.empty())
+    {
+        return;
+    }
+
+    arrangeWhenDone = arrangeWhenDone || arrange;
+
+    // the workers can only read the cache once its table exists
+    std::vector<int64_t> modelHashes{ getClassifier().getModelHash() };
+    for (const auto &vocabulary : getVocabularies())
+    {
+        modelHashes.push_back(vocabulary.second->getModelHash());
+    }
+    labelCache.prepare(modelHashes);
+
+    std::weak_ptr<IALLabeler> weakThis = shared_from_this();
+    for (auto &job : jobs)
+    {
+        // the worker must never see the live tracks
+        job->collection->snapshotChannels();
+        activeJobs.push_back(job);
+
+        IALWorkerPool::Get().enqueue([weakThis, job]
+        {
+            // everything the job does is in the try, so nothing can keep it from finishing,
+            // or a cancel waiting on it would never return
+            std::string error;
+            try
+            {
+                int lastPercent = -1;
+                if (!job->start())
+                {
+                    // cancelled before it reached a worker
+                    job->result.cancelled = true;
+                }
+                else
+                {
+                    job->result = job->collection->labelAllFrames([&](size_t framesDone, size_t framesTotal)
+                    {
+                        job->framesDone = framesDone;
+                        job->framesTotal = framesTotal;
+
+                        // only wake up the main thread when there is something new to show
+                        int percent = framesTotal ? int(100 * framesDone / framesTotal) : 100;
+                        if (percent != lastPercent)
+                        {
+                            lastPercent = percent;
+                            wxTheApp->CallAfter([weakThis]
+                            {
+                                if (auto labeler = weakThis.lock())
+                                {
+                                    labeler->updateStatus();
+                                }
+                            });
+                        }
+
+                        return !job->cancelled;
+                    });
+                }
+            }
+            catch (const std::exception &e)
+            {
+                error = e.what();
+            }
+            catch (...)
+            {
+                error = "an unknown error occurred";
+            }
 
-    if (dynamic_cast<WaveTrack *>(track) != nullptr)
+            job->finish(std::move(error));
+
+            wxTheApp->CallAfter([weakThis, job]
+            {
+                if (auto labeler = weakThis.lock())
+                {
+                    labeler->onJobFinished(job);
+                }
+            });
+        });
+    }
+
+    updateStatus();
+}
+
+void IALLabeler::onJobFinished(const JobPtr &job)
+{
+    auto iter = std::find(activeJobs.begin(), activeJobs.end(), job);
+    if (iter == activeJobs.end())
+    {
+        return;
+    }
+
+    activeJobs.erase(iter);
+    finishedJobs.push_back(job);
+
+    // commit everything that was queued together in one undoable step
+    if (activeJobs.empty())
+    {
+        commitFinishedJobs();
+    }
+    else
     {
-        std::shared_ptr<WaveTrack> waveTrack = std::dynamic_pointer_cast<WaveTrack>(track->SharedPointer());
+        updateStatus();
+    }
+}
 
-        Track *leader = *tracklist.FindLeader(track);
-        TrackId leaderID = leader->GetId();
-        std::shared_ptr<WaveTrack> leaderTrack = std::dynamic_pointer_cast<WaveTrack>(leader->SharedPointer());
-        
-        // find out if we have labeled this track before
-        // if we haven't, create a new entry 
-        auto pair = tracks.find(leaderID);
-        if (pair == tracks.end())
+void IALLabeler::commitFinishedJobs()
+{
+    size_t labeledCount = 0;
+    bool cancelled = false;
+    std::string error;
+
+    for (auto &job : finishedJobs)
+    {
+        job->collection->releaseSnapshot();
+        labelCache.store(job->result.newPredictions, getClassifier().getModelHash());
+        for (size_t vocabIdx = 0; vocabIdx < job->result.vocabularies.size() && vocabIdx < job->collection->vocabularies.size(); vocabIdx++)
         {
-            tracks.insert(std::make_pair(leaderID, IALAudioFrameCollection(classifier, leaderTrack)));
-            pair = tracks.find(leaderID);
+            labelCache.store(job->result.vocabularies[vocabIdx].newPredictions,
+                             job->collection->vocabularies[vocabIdx].classifier->getModelHash());
         }
 
-        // grab the frame collection, and add a new channel to it if necessary
-        IALAudioFrameCollection& frameCollection = tracks.find(leaderID)->second;
-        frameCollection.addChannel(std::weak_ptr<WaveTrack>(waveTrack));
+        if (!job->error.empty())
+        {
+            error = job->error;
+        }
+        else if (job->cancelled || job->result.cancelled)
+        {
+            cancelled = true;
+        }
+        else
+        {
+            job->collection->commitLabels(project, job->result);
+            labeledCount += 1;
 
-        // update collection length
-        frameCollection.updateCollectionLength();
+            if (job->collection->storeEmbeddings)
+            {
+                embeddingIndex.updateTrack(job->leaderId, *job->collection, job->result.embeddedFrames);
+            }
+            else
+            {
+                embeddingIndex.removeTrack(job->leaderId);
+            }
+        }
+    }
+    finishedJobs.clear();
 
-        // update the labels
-        frameCollection.labelAllFrames(project);
+    if (labeledCount > 0)
+    {
+        if (arrangeWhenDone)
+        {
+            arrangeTracks();
+        }
 
-        // auto history = ;
-        ProjectHistory::Get( project ).PushState(XO("Labeled Track"), XO("Label"));
+        ProjectHistory::Get( project ).PushState(
+            XO("Labeled %lld track(s)").Format( (long long) labeledCount ),
+            XO("Label"));
+        ProjectWindow::Get( project ).RedrawProject();
     }
+    arrangeWhenDone = false;
 
-    if (arrange){
-        arrangeTracks();
+    auto &status = ProjectStatus::Get( project );
+    if (!error.empty())
+    {
+        status.Set(XO("Labeling failed: %s").Format( wxString(error) ));
+    }
+    else if (cancelled)
+    {
+        status.Set(XO("Labeling cancelled"));
+    }
+    else
+    {
+        status.Set(XO("Labeling finished"));
     }
 }
 
+void IALLabeler::updateStatus()
+{
+    if (activeJobs.empty())
+    {
+        return;
+    }
+
+    size_t framesDone = 0;
+    size_t framesTotal = 0;
+    for (auto &job : activeJobs)
+    {
+        framesDone += job->framesDone;
+        framesTotal += job->framesTotal;
+    }
+
+    int percent = framesTotal ? int(100 * framesDone / framesTotal) : 0;
+    ProjectStatus::Get( project ).Set(
+        XO("Labeling %lld track(s): %d%%")
+            .Format( (long long) activeJobs.size(), percent ));
+}
+
 void IALLabeler::separateTrack(Track* track)
 {
-    TrackList &tracklist = TrackList::Get(const_cast<AudacityProject&>(project));
-    const auto& playableTracks = tracklist.Any<PlayableTrack>();
+    TrackList &tracklist = TrackList::Get(project);
+
+    if (dynamic_cast<WaveTrack *>(track) == nullptr)
+    {
+        return;
+    }
+
+    // the model separates the audio into two sources
+    const int sampleRate = kSeparationSampleRate;
+    const size_t numSources = 2;
+    std::shared_ptr<DeepModel> separationModel = AcquireSeparationModel();
+
+    // the track is streamed through the model one window at a time, so memory does not grow with
+    // the length of the track. consecutive windows overlap, and the overlap is cross-faded so the
+    // window boundaries don't click.
+    const size_t windowLen = 10 * sampleRate;
+    const size_t overlapLen = sampleRate / 2;
+    const size_t hopLen = windowLen - overlapLen;
+
+    Track *leader = *tracklist.FindLeader(track);
+    std::shared_ptr<WaveTrack> leaderTrack = leader->SharedPointer<WaveTrack>();
+
+    const double factor = sampleRate / leaderTrack->GetRate();
+    const sampleCount totalSamples = leaderTrack->TimeToLongSamples(leaderTrack->GetEndTime());
+    SampleBlockFactoryPtr sbFactory = WaveTrackFactory::Get(project).GetSampleBlockFactory();
+
+    std::vector<std::shared_ptr<WaveTrack>> sourceTracks;
+    std::vector<Floats> sourceTails;
+    for (size_t i = 0; i < numSources; i++)
+    {
+        sourceTracks.push_back(std::make_shared<WaveTrack>(sbFactory, floatSample, sampleRate));
+        sourceTails.emplace_back(overlapLen);
+    }
+    bool haveTails = false;
+
+    // samples at the track's rate, and the window of resampled audio fed to the model
+    const size_t readLen = leaderTrack->GetMaxBlockSize();
+    Floats inBuffer{ readLen };
+    size_t inFill = 0;
+    size_t inOffset = 0;
+    sampleCount readPos = 0;
+    bool inputDone = false;
+    bool flushed = false;
+
+    Floats window{ windowLen };
+    size_t windowFill = 0;
+
+    Resample resampler(true, factor, factor);
+
+    ProgressDialog progress(XO("Separating Track"),
+                            XO("Separating '%s'").Format(leaderTrack->GetName()));
+
+    while (true)
+    {
+        // fill the window with resampled audio
+        while (windowFill < windowLen && !flushed)
+        {
+            if (inOffset == inFill && !inputDone)
+            {
+                size_t len = limitSampleBufferSize(readLen, totalSamples - readPos);
+                leaderTrack->Get((samplePtr)inBuffer.get(), floatSample, readPos, len);
+                readPos += len;
+                inFill = len;
+                inOffset = 0;
+                inputDone = (readPos >= totalSamples);
+
+                if (progress.Update(readPos.as_long_long(), totalSamples.as_long_long()) != ProgressResult::Success)
+                {
+                    // the partial source tracks are discarded along with their sample blocks
+                    return;
+                }
+            }
+
+            auto results = resampler.Process(factor, inBuffer.get() + inOffset, inFill - inOffset, inputDone,
+                                             window.get() + windowFill, windowLen - windowFill);
+            inOffset += results.first;
+            windowFill += results.second;
+
+            // once all input has been consumed, the resampler is drained when it stops producing
+            if (inputDone && inOffset == inFill && results.second == 0)
+            {
+                flushed = true;
+            }
+        }
+
+        if (flushed && windowFill == (haveTails ? overlapLen : 0))
+        {
+            // nothing new since the previous window, so its overlap is already final
+            if (haveTails)
+            {
+                for (size_t i = 0; i < numSources; i++)
+                {
+                    sourceTracks[i]->Append((samplePtr)sourceTails[i].get(), floatSample, overlapLen);
+                }
+            }
+            break;
+        }
+
+        const bool lastWindow = flushed;
+
+        // zero-pad a short final window
+        std::fill(window.get() + windowFill, window.get() + windowLen, 0.0f);
+
+        torch::Tensor input = torch::from_blob(window.get(), {1, 1, (int64_t)windowLen},
+                                               torch::TensorOptions().dtype(torch::kFloat32));
+        // expand channel and batch dims
+        input = separationModel->padAndReshape(input);
 
-    static const std::string kSeparationModelPath = wxFileName(FileNames::ResourcesDir(), wxT("separation-model.pt")).GetFullPath().ToStdString();
-    static const std::string kSeparationInstrumentListPath = wxFileName(FileNames::ResourcesDir(), wxT("separation-instruments.txt")).GetFullPath().ToStdString();
-
-    int sampleRate = 8000;
-    DeepModel separationModel(kSeparationModelPath, kSeparationInstrumentListPath);
-    separationModel.setChunkLen(8000);
-
-    if (dynamic_cast<WaveTrack *>(track) != nullptr)
-    {
-        std::shared_ptr<WaveTrack> waveTrack = std::dynamic_pointer_cast<WaveTrack>(track->SharedPointer());
-
-        Track *leader = *tracklist.FindLeader(track);
-        TrackId leaderID = leader->GetId();
-        std::shared_ptr<WaveTrack> leaderTrack = std::dynamic_pointer_cast<WaveTrack>(leader->SharedPointer());
-        
-        sampleFormat originalFormat = leaderTrack->GetSampleFormat();
-        double originalSampleRate = leaderTrack->GetRate();
-        size_t actualLength = leaderTrack->TimeToLongSamples(leaderTrack->GetEndTime()).as_size_t();
-        
-        // SampleBuffer channelBuffer = SampleBuffer(desiredLength, format);
-        // AudacityProject *project = leaderTrack->GetOwner()->GetOwner();
-        SampleBlockFactoryPtr sbFactory = WaveTrackFactory::Get(project).GetSampleBlockFactory();
-
-        // copy channel's samples into buffer
-        SampleBuffer buffer(actualLength, originalFormat);
-        // fill up the buffer
-        leaderTrack->Get(buffer.ptr(), originalFormat, 0, actualLength);
-
-        // make a separate clip where we will do the necessary conversions 
-        WaveClip conversionClip(sbFactory, originalFormat, leaderTrack->GetRate(), leaderTrack->GetWaveColorIndex());
-
-        // fill the clip with our buffer
-        conversionClip.Append(buffer.ptr(), originalFormat, actualLength);
-        conversionClip.Flush();
-        // conversionClip.SetSamples(buffer.ptr(), originalFormat, start, actualLength);
-
-        // do the conversions
-        conversionClip.ConvertToSampleFormat(floatSample);
-        conversionClip.Resample(sampleRate);
-
-        // copy channel's samples into buffer
-        SampleBuffer outBuffer(conversionClip.GetNumSamples().as_size_t(), floatSample);
-        conversionClip.GetSamples(outBuffer.ptr(), floatSample, conversionClip.GetStartSample(), conversionClip.GetNumSamples().as_size_t());
-        
-        torch::Tensor bufTensor = torch::from_blob(outBuffer.ptr(),
-                                                       conversionClip.GetNumSamples().as_size_t(),
-                                                       torch::TensorOptions().dtype(torch::kFloat32));
-
-        torch::Tensor channelTensor = bufTensor.clone();
-
-        buffer.Free();
-        
-        // expand channel and batch dimes
-        channelTensor = separationModel.padAndReshape(channelTensor.view({1, 1, -1}));
-        auto sz = channelTensor.sizes();
-
-        torch::Tensor output = separationModel.modelForward(channelTensor);
-        
-        // this could be a risky operation?
         // view as two channels of separate sources
-        output = output.view({1, 2, -1});
-        torch::Tensor source = output[0][0];
-        torch::Tensor source2 = output[0][1];
+        torch::Tensor output = separationModel->modelForward(input).contiguous().view({1, (int64_t)numSources, -1});
+
+        const size_t emitLen = lastWindow ? windowFill : hopLen;
+        for (size_t i = 0; i < numSources; i++)
+        {
+            torch::Tensor source = (output[0][i] / 10000).to(torch::kFloat32).contiguous();
+            float *data = source.data_ptr<float>();
+
+            // cross-fade the start of this window into the end of the previous one
+            if (haveTails)
+            {
+                const float *tail = sourceTails[i].get();
+                for (size_t j = 0; j < overlapLen; j++)
+                {
+                    float fade = (j + 0.5f) / overlapLen;
+                    data[j] = tail[j] * (1.0f - fade) + data[j] * fade;
+                }
+            }
+
+            sourceTracks[i]->Append((samplePtr)data, floatSample, emitLen);
+
+            if (!lastWindow)
+            {
+                std::copy(data + hopLen, data + windowLen, sourceTails[i].get());
+            }
+        }
+
+        if (lastWindow)
+        {
+            break;
+        }
+        haveTails = true;
+
+        // the overlap is the start of the next window
+        std::copy(window.get() + hopLen, window.get() + windowLen, window.get());
+        windowFill = overlapLen;
+    }
+
+    for (auto &newTrack : sourceTracks)
+    {
+        newTrack->Flush();
+        tracklist.Add(newTrack);
+    }
+
+    ProjectHistory::Get( project ).PushState(XO("Separated Track"), XO("SourceSep"));
+}
+
+#pragma mark Similarity Search
+
+void IALLabeler::findSimilar(Track* track)
+{
+    TrackList &tracklist = TrackList::Get(project);
+    auto &status = ProjectStatus::Get( project );
+
+    if (dynamic_cast<WaveTrack *>(track) == nullptr)
+    {
+        return;
+    }
+    Track *leader = *tracklist.FindLeader(track);
+    forgetDeletedTracks();
+
+    const auto &selectedRegion = ViewInfo::Get( project ).selectedRegion;
+    const double t0 = selectedRegion.t0();
+    const double t1 = selectedRegion.t1();
+    if (t1 <= t0)
+    {
+        status.Set(XO("Select the audio to find similar audio to"));
+        return;
+    }
+
+    int maxRanges = 10;
+    gPrefs->Read(wxT("/IAL/SimilarRanges"), &maxRanges, 10);
+
+    const auto begin = std::chrono::steady_clock::now();
+    std::vector<float> query;
+    if (!embeddingIndex.embeddingOf(leader->GetId(), t0, t1, query))
+    {
+        status.Set(XO("The selection has no stored embeddings. Label the track with embeddings turned on first"));
+        return;
+    }
+    std::vector<IALSimilarRange> ranges = embeddingIndex.search(query, size_t(std::max(1, maxRanges)), leader->GetId(), t0, t1);
+    const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+    if (ranges.empty())
+    {
+        status.Set(XO("No similar audio found"));
+        return;
+    }
+
+    LabelArray labels;
+    labels.reserve(ranges.size());
+    for (const auto &range : ranges)
+    {
+        Track *match = tracklist.FindById(range.track);
+        if (!match)
+        {
+            continue;
+        }
+        labels.emplace_back(SelectedRegion(range.start, range.end),
+                            wxString::Format(wxT("%s (%d%%)"), match->GetName(), (int)std::lround(range.similarity * 100)));
+    }
+
+    if (labels.empty())
+    {
+        status.Set(XO("No similar audio found"));
+        return;
+    }
+
+    auto similarTrack = std::make_shared<LabelTrack>();
+    similarTrack->SetName(XO("Similar to %s").Format( leader->GetName() ).Translation());
+    similarTrack->SetLabels(std::move(labels));
+    tracklist.Add(similarTrack);
+
+    ProjectHistory::Get( project ).PushState(XO("Found similar audio"), XO("Find Similar"));
+    ProjectWindow::Get( project ).RedrawProject();
+
+    status.Set(XO("Found %lld similar range(s) among %lld frames in %.1f ms")
+        .Format( (long long) labels.size(), (long long) embeddingIndex.size(), elapsed ));
+}
+
+void IALLabeler::forgetDeletedTracks()
+{
+    TrackList &tracklist = TrackList::Get(project);
+    for (TrackId id : embeddingIndex.indexedTracks())
+    {
+        if (!tracklist.FindById(id))
+        {
+            embeddingIndex.removeTrack(id);
+        }
+    }
+}
 
-        for (auto source: std::vector<torch::Tensor>{source, source2})
+void IALLabeler::onTrackListDeletion(TrackListEvent &event)
+{
+    event.Skip();
+    forgetDeletedTracks();
+}
+
+#pragma mark Live Labeling
+
+void IALLabeler::startLiveLabeling(const WaveTrackArray &tracks)
+{
+    // whatever a previous recording still has in flight is dropped
+    stopLiveLabeling(true);
+    liveSession += 1;
+    liveDiscarded = false;
+    liveCommitted = false;
+    liveLabelTrack.reset();
+    liveLabelTrackId = TrackId{};
+    liveLateLabels.clear();
+    liveClassId = ClassificationModel::kSilence;
+    liveEndSample = -1;
+    liveClassCounts.clear();
+
+    bool liveLabeling = true;
+    gPrefs->Read(wxT("/IAL/LiveLabeling"), &liveLabeling, true);
+    if (!liveLabeling)
+    {
+        return;
+    }
+
+    // a missing model must never stop the recording
+    try
+    {
+        getClassifier();
+    }
+    catch (const std::exception &e)
+    {
+        ProjectStatus::Get( project ).Set(XO("Live labeling unavailable: %s").Format( wxString(e.what()) ));
+        return;
+    }
+
+    std::weak_ptr<IALLabeler> weakThis = shared_from_this();
+    const size_t session = liveSession;
+
+    auto newLabeler = std::make_shared<IALLiveLabeler>(classifier, confidenceThreshold(), tracks,
+        [weakThis, session](const IALLiveLabel &label)
+        {
+            wxTheApp->CallAfter([weakThis, session, label]
+            {
+                if (auto labeler = weakThis.lock())
+                {
+                    labeler->onLiveLabel(session, label);
+                }
+            });
+        },
+        [weakThis, session](const std::string &error)
+        {
+            wxTheApp->CallAfter([weakThis, session, error]
+            {
+                if (auto labeler = weakThis.lock())
+                {
+                    labeler->onLiveFinished(session, error);
+                }
+            });
+        });
+
+    newLabeler->start();
+
+    std::lock_guard<std::mutex> guard(liveMutex);
+    liveLabeler = newLabeler;
+}
+
+void IALLabeler::captureLive(const WaveTrackArray &tracks, size_t channel, samplePtr buffer, sampleFormat format, size_t len)
+{
+    std::shared_ptr<IALLiveLabeler> labeler;
+    {
+        std::lock_guard<std::mutex> guard(liveMutex);
+        labeler = liveLabeler;
+    }
+
+    if (labeler)
+    {
+        labeler->capture(tracks, channel, buffer, format, len);
+    }
+}
+
+void IALLabeler::stopLiveLabeling(bool discard)
+{
+    std::shared_ptr<IALLiveLabeler> labeler;
+    {
+        std::lock_guard<std::mutex> guard(liveMutex);
+        labeler.swap(liveLabeler);
+    }
+
+    if (!labeler)
+    {
+        return;
+    }
+
+    liveDiscarded = discard;
+    labeler->finish(discard);
+}
+
+void IALLabeler::commitLiveLabeling()
+{
+    liveCommitted = true;
+
+    // the track was applied along with the recording's own tracks, and has its id now
+    TrackList &tracklist = TrackList::Get(project);
+    if (liveLabelTrack && tracklist.Contains(liveLabelTrack.get()))
+    {
+        liveLabelTrackId = liveLabelTrack->GetId();
+        nameLiveLabelTrack(*liveLabelTrack);
+    }
+    liveLabelTrack.reset();
+}
+
+void IALLabeler::onLiveLabel(size_t session, const IALLiveLabel &label)
+{
+    if (session != liveSession || liveDiscarded)
+    {
+        return;
+    }
+
+    liveClassCounts[label.classId] += 1;
+
+    // the recording's undo state may already be pushed; changing the tracks now would slip into it unseen
+    if (liveCommitted)
+    {
+        liveLateLabels.push_back(label);
+        return;
+    }
+
+    TrackList &tracklist = TrackList::Get(project);
+    if (!liveLabelTrack)
+    {
+        // pending, like the tracks being recorded into, until the recording is committed
+        liveLabelTrack = std::make_shared<LabelTrack>();
+        tracklist.RegisterPendingNewTrack(liveLabelTrack);
+    }
+    else if (!tracklist.Contains(liveLabelTrack.get()))
+    {
+        // the recording's pending tracks were cleared
+        return;
+    }
+
+    addLiveLabel(*liveLabelTrack, label);
+    ProjectWindow::Get( project ).RedrawProject();
+}
+
+void IALLabeler::onLiveFinished(size_t session, const std::string &error)
+{
+    if (session != liveSession)
+    {
+        return;
+    }
+
+    if (!liveDiscarded && liveCommitted && !liveLateLabels.empty())
+    {
+        TrackList &tracklist = TrackList::Get(project);
+        LabelTrack *track = nullptr;
+        if (liveLabelTrackId == TrackId{})
+        {
+            // none of the labels were ready in time for the recording
+            track = tracklist.Add(std::make_shared<LabelTrack>());
+        }
+        else
         {
-            source = source.clone() / 10000;
-            auto sourceLength = source.sizes()[0];
-            SampleBuffer sourceBuffer(source.sizes()[0], floatSample);
-
-            // sourceBuffer()
-            auto sourcePtr = source.accessor<float, 1>();
-
-            // ooo copying by hand
-            // CopySamples((samplePtr)source.to(torch::kFloat32).data_ptr<float>(), 
-            //               floatSample, sourceBuffer.ptr(), floatSample, sourceLength)
-            // float* s = source.contiguous().to(torch::kFloat32).data_ptr<float>();
-            // float* d = (float*)sourceBuffer.ptr();
-            // for (int i = 0; i < sourceLength; i++, d += 1, s += 1)
-            //     *d = *s;
-
-            // CopySamples(source.data_ptr<float>(), floatSample, sourceBuffer.ptr(), floatSample, sourceLength);
-            
-            // make a separate clip where we will do the necessary conversions 
-            auto newTrack = std::make_shared<WaveTrack>(sbFactory, floatSample, 8000);
-
-            // fill the clip with our buffer
-            // newTrack->Append(sourceBuffer.ptr(), floatSample, sourceLength);
-            newTrack->Append((samplePtr)source.to(torch::kFloat32).data_ptr<float>(),
-                              floatSample, sourceLength);
-            newTrack->Flush();
-
-            tracklist.Add(newTrack);
-            // auto history = ;
+            // deleted, or undone along with the recording, if it's gone
+            track = track_cast<LabelTrack *>(tracklist.FindById(liveLabelTrackId));
         }
 
-        ProjectHistory::Get( project ).PushState(XO("Separated Track"), XO("SourceSep"));
+        if (track)
+        {
+            for (const auto &label : liveLateLabels)
+            {
+                addLiveLabel(*track, label);
+            }
+            nameLiveLabelTrack(*track);
+
+            ProjectHistory::Get( project ).PushState(XO("Labeled Recorded Audio"), XO("Live Labels"));
+            ProjectWindow::Get( project ).RedrawProject();
+        }
+    }
+
+    if (!error.empty())
+    {
+        ProjectStatus::Get( project ).Set(XO("Live labeling failed: %s").Format( wxString(error) ));
+    }
+
+    liveLabelTrack.reset();
+    liveLabelTrackId = TrackId{};
+    liveLateLabels.clear();
+    liveClassCounts.clear();
+}
+
+void IALLabeler::addLiveLabel(LabelTrack &track, const IALLiveLabel &label)
+{
+    // frames carrying on the previous class just stretch its label
+    const int numLabels = track.GetNumLabels();
+    if (numLabels > 0 && label.classId == liveClassId && label.startSample == liveEndSample)
+    {
+        LabelStruct extended = *track.GetLabel(numLabels - 1);
+        extended.selectedRegion.setT1(label.end);
+        track.SetLabel(numLabels - 1, extended);
+    }
+    else
+    {
+        track.AddLabel(SelectedRegion(label.start, label.end), wxString(getClassifier().className(label.classId)));
     }
 
-}
\ No newline at end of file
+    liveClassId = label.classId;
+    liveEndSample = label.endSample;
+}
+
+void IALLabeler::nameLiveLabelTrack(LabelTrack &track)
+{
+    // name the track after its most common class, as a labeled track is named, passing over silence
+    int32_t trackClassId = ClassificationModel::kSilence;
+    size_t trackClassCount = 0;
+    for (const auto &classCount : liveClassCounts)
+    {
+        if (classCount.first != ClassificationModel::kSilence && classCount.second > trackClassCount)
+        {
+            trackClassId = classCount.first;
+            trackClassCount = classCount.second;
+        }
+    }
+    track.SetName(wxString(getClassifier().className(trackClassId)));
+}
@@ -9,12 +9,21 @@
 #define IALLabeler_hpp
 
 #include <stdio.h>
+#include <atomic>
+#include <condition_variable>
 #include <memory>
 #include <map>
+#include <mutex>
+#include <vector>
+
+#include <wx/event.h>
 
 #include "ClientData.h"
 #include "../Track.h"
 #include "IALAudioFrame.hpp"
+#include "IALEmbeddingIndex.hpp"
+#include "IALLabelCache.hpp"
+#include "IALLiveLabeler.hpp"
 #include "ClassificationModel.h"
 
 class LabelTrack;
@@ -22,18 +31,18 @@ class ClassifierModel;
 
 class IALLabeler
     : public ClientData::Base,
+      public wxEvtHandler,
       public std::enable_shared_from_this<IALLabeler>
 {
     
 public:
-    ClassificationModel classifier;
-    
     // Get static instance
     static IALLabeler &Get(AudacityProject &project);
     static const IALLabeler &Get(const AudacityProject &project);
     
     // Constructor
     IALLabeler(AudacityProject &project);
+    ~IALLabeler();
     
     // Disable the copy constructors
     IALLabeler(const IALLabeler &that) = delete;
@@ -42,18 +51,158 @@ public:
     // Disable the move constructors
     IALLabeler(IALLabeler &&that) = delete;
     IALLabeler& operator= (IALLabeler&&) = delete;
+
+    /**
+     @brief Returns the instrument classifier, loading it through the model registry on first use.
+     @discussion The model is shared with every other project, so it must not be modified.
+     */
+    ClassificationModel &getClassifier();
+
+    /**
+     @brief Applies the /IAL/FreezeModels, /IAL/QuantizedModel, /IAL/IntraOpThreads and /IAL/InterOpThreads preferences.
+     @discussion Must be called at startup, before any model is loaded (see DeepModel::setInferenceOptions).
+     */
+    static void configureInference();
+
+    /**
+     @brief Loads the labeler's models on the worker pool, so the first labeling or separation doesn't wait for them.
+     @discussion Does nothing if the /IAL/WarmUpModels preference is off.
+     */
+    static void warmUpModels();
+
+    /**
+     @brief The confidence a frame's best class needs to be used rather than "not sure", from the /IAL/ConfidenceThreshold preference.
+     @discussion Changing it and labeling again only reclassifies the stored probabilities of frames that haven't changed
+     (see IALProbitStore), so it never waits on the model.
+     */
+    static float confidenceThreshold();
+    static void setConfidenceThreshold(float threshold);
+
+    /**
+     @brief How many of the best classes each label keeps, from the /IAL/TopK preference.
+     */
+    static int topK();
+
+    /**
+     @brief Whether labeling also keeps each frame's embedding for finding similar audio, from the /IAL/StoreEmbeddings preference.
+     */
+    static bool storeEmbeddings();
     
+    /**
+     @brief The extra vocabularies every track is labeled with, loaded from the /IAL/Vocabularies preference.
+     @discussion The preference lists the names of folders under ial-weights in the resources directory, separated by
+     semicolons or commas. Each folder holds an ial-model.pt and an ial-instruments.txt. A model that frames audio differently
+     from the classifier can't share its frames, so it is skipped. The list is reloaded whenever the preference changes.
+     */
+    const std::vector<std::pair<std::string, std::shared_ptr<ClassificationModel>>> &getVocabularies();
+
+    /**
+     @brief Queues a track for labeling on the worker pool and returns immediately.
+     @discussion The labels are added to the project on the main thread once every job queued alongside it has finished,
+     as a single undoable step. A track that is already being labeled is skipped.
+     */
     void labelTrack(Track* track, bool arrange);
     void labelTracks();
 
+    /**
+     @brief Asks every queued and running labeling job to stop at the next frame.
+     @param wait if true, blocks until the workers have let go of the tracks, e.g. before the project is closed.
+     @discussion Jobs that haven't reached a worker yet are skipped rather than waited for. After waiting, nothing that
+     was labeled is added to the project.
+     */
+    void cancelLabeling(bool wait = false);
+    bool isLabeling() const { return !activeJobs.empty(); }
+
     void separateTrack(Track* track);
+
+    /**
+     @brief Finds the stretches of the project's labeled tracks that sound most like the selected part of a track.
+     @discussion The selection's embedding is the mean of the stored embeddings of its frames, and the matches come from the project's
+     embedding index (see IALEmbeddingIndex), so no audio is read and the model is not run. The matches are added as a new label
+     track, one label per range, naming the track it was found in. Only tracks labeled with /IAL/StoreEmbeddings on are searched.
+     */
+    void findSimilar(Track* track);
+    bool canFindSimilar() const { return !embeddingIndex.empty(); }
+
+    /**
+     @brief Starts labeling the audio that is about to be recorded. Called on the main thread when recording starts.
+     @param tracks the tracks being recorded into, one per input channel.
+     @discussion Labels are added to a new label track as each frame is classified, so they are ready as soon as the
+     recording stops. Until the recording is committed the track is pending, like the recording's own new tracks, so it
+     goes into the same undo state, and goes away with them if the recording is cancelled. Does nothing if the
+     /IAL/LiveLabeling preference is off or the classifier can't be loaded.
+     */
+    void startLiveLabeling(const WaveTrackArray &tracks);
+
+    /**
+     @brief Hands captured samples to the live labeler, if there is one. Called on the AudioIO buffer thread.
+     */
+    void captureLive(const WaveTrackArray &tracks, size_t channel, samplePtr buffer, sampleFormat format, size_t len);
+
+    /**
+     @brief Called on the main thread once the recording's pending tracks have been applied, just before it is pushed.
+     @discussion The labels so far go into the project with the recording; any that come in later are held back.
+     */
+    void commitLiveLabeling();
+
+    /**
+     @brief Called on the main thread once recording has stopped and the recorded audio has been pushed to the history.
+     @param discard if true, the recording was thrown away, and no more labels are added.
+     @discussion The last frames are labeled in the background; when they are done, the labels that missed the recording's
+     undo state are added together, as an undo state of their own.
+     */
+    void stopLiveLabeling(bool discard);
     
 private:
+    struct Job;
+    using JobPtr = std::shared_ptr<Job>;
+
     AudacityProject &project;
+    IALLabelCache labelCache;
+    std::shared_ptr<ClassificationModel> classifier;
+    std::vector<std::pair<std::string, std::shared_ptr<ClassificationModel>>> vocabularies;
+    wxString loadedVocabularies;
     // assumes tracks have already been labeled
     void arrangeTracks();
+
+    JobPtr makeJob(Track* track);
+    void startJobs(const std::vector<JobPtr> &jobs, bool arrange);
+    void onJobFinished(const JobPtr &job);
+    void commitFinishedJobs();
+    void updateStatus();
     
     std::map<TrackId, IALAudioFrameCollection> tracks;
+    IALEmbeddingIndex embeddingIndex;
+
+    // drops the embeddings of tracks that are no longer in the project, e.g. after a deletion or an undo
+    void forgetDeletedTracks();
+    void onTrackListDeletion(TrackListEvent &event);
+
+    // only touched on the main thread
+    std::vector<JobPtr> activeJobs;
+    std::vector<JobPtr> finishedJobs;
+    bool arrangeWhenDone = false;
+
+    void onLiveLabel(size_t session, const IALLiveLabel &label);
+    void onLiveFinished(size_t session, const std::string &error);
+    void addLiveLabel(LabelTrack &track, const IALLiveLabel &label);
+    void nameLiveLabelTrack(LabelTrack &track);
+
+    // the buffer thread only ever takes a copy of the live labeler, under the mutex
+    std::mutex liveMutex;
+    std::shared_ptr<IALLiveLabeler> liveLabeler;
+
+    // only touched on the main thread. labels from any other session than the current one are dropped.
+    size_t liveSession = 0;
+    bool liveDiscarded = false;
+    bool liveCommitted = false;
+    std::shared_ptr<LabelTrack> liveLabelTrack;
+    // once committed, the track is only found by its id, since an undo may have replaced it
+    TrackId liveLabelTrackId;
+    std::vector<IALLiveLabel> liveLateLabels;
+    int32_t liveClassId = ClassificationModel::kSilence;
+    long long liveEndSample = -1;
+    std::map<int32_t, size_t> liveClassCounts;
 };
 
 #endif
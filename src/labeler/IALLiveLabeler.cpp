@@ -0,0 +1,359 @@
+//
+//  IALLiveLabeler.cpp
+//  Audacity
+//
+
+#include "IALLiveLabeler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+#include "ClassificationModel.h"
+#include "IALWorkerPool.hpp"
+#include "../Resample.h"
+#include "../RingBuffer.h"
+
+// frames quieter than this are labeled as silence without running the model, as in IALAudioFrame::audioIsSilent
+static const double kSilenceThreshold = -80.0;
+
+// how far the worker may fall behind capture before labeling gives up, e.g. while the pool is busy with other tracks
+static const double kRingBufferSeconds = 20.0;
+
+IALLiveLabeler::IALLiveLabeler(std::shared_ptr<ClassificationModel> classifier, float confidenceThreshold,
+                               const WaveTrackArray &tracks, LabelCallback onLabel, FinishedCallback onFinished)
+    : classifier(std::move(classifier)), confidenceThreshold(confidenceThreshold),
+      onLabel(std::move(onLabel)), onFinished(std::move(onFinished)),
+      rate(tracks.empty() ? 0 : tracks[0]->GetRate())
+{
+    const size_t ringSize = size_t(rate * kRingBufferSeconds);
+    for (size_t channel = 0; channel < tracks.size(); channel++)
+    {
+        rings.push_back(std::make_unique<RingBuffer>(floatSample, ringSize));
+    }
+    channelAudio.resize(tracks.size());
+}
+
+IALLiveLabeler::~IALLiveLabeler()
+{
+}
+
+void IALLiveLabeler::start()
+{
+    // the task keeps us alive until the recording is labeled
+    auto self = shared_from_this();
+    IALWorkerPool::Get().enqueue([self]
+    {
+        self->classifyFrames();
+    });
+}
+
+#pragma mark Capture
+
+void IALLiveLabeler::capture(const WaveTrackArray &tracks, size_t channel, samplePtr buffer, sampleFormat format, size_t len)
+{
+    if (len == 0 || channel >= rings.size() || channel >= tracks.size() || finishing.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    if (!haveOrigin.load(std::memory_order_relaxed))
+    {
+        // the samples were just appended, so they end where the track does
+        origin = tracks[channel]->GetEndTime() - len / rate;
+        haveOrigin.store(true, std::memory_order_relaxed);
+    }
+
+    // the ring buffer publishes the samples, and the origin written before them, to the worker
+    if (rings[channel]->Put(buffer, format, len) < len)
+    {
+        overrun.store(true);
+    }
+
+    // without the mutex, a wakeup may come just before the worker waits; the next buffer wakes it instead
+    wake.notify_one();
+}
+
+void IALLiveLabeler::finish(bool discard)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (finishing)
+        {
+            return;
+        }
+        discarded = discard;
+        finishing = true;
+    }
+    wake.notify_one();
+}
+
+#pragma mark Classification
+
+void IALLiveLabeler::classifyFrames()
+{
+    std::string error;
+    std::vector<float> input;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]{ return finishing || overrun || available() > 0; });
+        }
+
+        if (discarded)
+        {
+            break;
+        }
+        if (overrun)
+        {
+            error = "labeling fell too far behind the recording";
+            break;
+        }
+
+        // once capture has stopped, one more pass labels the rest of the recording
+        const bool last = finishing;
+        std::vector<Frame> frames;
+        try
+        {
+            mixDown(input);
+            resample(input, last);
+            cutFrames(last, frames);
+            classify(frames, last);
+        }
+        catch (const std::exception &e)
+        {
+            // don't keep the recording waiting on a model that can't run
+            error = e.what();
+            break;
+        }
+
+        for (const auto &frame : frames)
+        {
+            onLabel(frame.label);
+        }
+
+        if (last)
+        {
+            break;
+        }
+    }
+
+    onFinished(error);
+}
+
+size_t IALLiveLabeler::available() const
+{
+    // only samples that every channel has can be downmixed
+    size_t available = rings.empty() ? 0 : rings[0]->AvailForGet();
+    for (const auto &ring : rings)
+    {
+        available = std::min(available, ring->AvailForGet());
+    }
+    return available;
+}
+
+void IALLiveLabeler::mixDown(std::vector<float> &input)
+{
+    input.clear();
+
+    const size_t available = this->available();
+    if (available == 0)
+    {
+        return;
+    }
+
+    input.resize(available, 0.0f);
+    for (size_t channel = 0; channel < rings.size(); channel++)
+    {
+        std::vector<float> &audio = channelAudio[channel];
+        audio.resize(available);
+        rings[channel]->Get((samplePtr)audio.data(), floatSample, available);
+        for (size_t i = 0; i < available; i++)
+        {
+            input[i] += audio[i];
+        }
+    }
+
+    if (rings.size() > 1)
+    {
+        const float scale = 1.0f / rings.size();
+        for (auto &sample : input)
+        {
+            sample *= scale;
+        }
+    }
+
+    recorded += available;
+}
+
+void IALLiveLabeler::resample(std::vector<float> &input, bool last)
+{
+    const double modelRate = classifier->getSampleRate();
+    if (rate == modelRate)
+    {
+        modelAudio.insert(modelAudio.end(), input.begin(), input.end());
+        return;
+    }
+
+    // one resampler for the whole recording, so the audio is resampled as one stream
+    const double factor = modelRate / rate;
+    if (!resampler)
+    {
+        if (input.empty())
+        {
+            // nothing was ever captured
+            return;
+        }
+        resampler = std::make_unique<Resample>(true, factor, factor);
+    }
+
+    std::vector<float> output;
+    size_t used = 0;
+    while (true)
+    {
+        output.resize(size_t(std::ceil((input.size() - used) * factor)) + 1024);
+        auto result = resampler->Process(factor, input.data() + used, input.size() - used, last,
+                                         output.data(), output.size());
+        used += result.first;
+        modelAudio.insert(modelAudio.end(), output.begin(), output.begin() + result.second);
+
+        // on the last pass, keep going until the resampler has let go of everything it holds
+        if (result.first == 0 && result.second == 0)
+        {
+            break;
+        }
+    }
+}
+
+long long IALLiveLabeler::recordingSample(long long modelSample) const
+{
+    return std::llround(modelSample * rate / classifier->getSampleRate());
+}
+
+void IALLiveLabeler::cutFrames(bool last, std::vector<Frame> &frames)
+{
+    const size_t windowLength = classifier->getChunkLen();
+    const size_t hopLength = classifier->getHopLen();
+
+    auto addFrame = [&](size_t offset, size_t frameLength, long long endSample)
+    {
+        Frame frame;
+        frame.audio.assign(modelAudio.begin() + offset, modelAudio.begin() + offset + frameLength);
+        frame.label.startSample = recordingSample(modelFramed);
+        // the resampler may hand back a little more than was recorded
+        frame.label.endSample = std::min(endSample, recorded);
+        frame.label.start = origin + frame.label.startSample / rate;
+        frame.label.end = origin + frame.label.endSample / rate;
+        frame.label.classId = ClassificationModel::kSilence;
+        frames.push_back(std::move(frame));
+    };
+
+    // a whole window labels its hop
+    size_t offset = 0;
+    while (modelAudio.size() - offset >= windowLength && recordingSample(modelFramed) < recorded)
+    {
+        addFrame(offset, windowLength, recordingSample(modelFramed + hopLength));
+        offset += hopLength;
+        modelFramed += hopLength;
+    }
+
+    // the last, short frame labels everything that's left
+    if (last && recordingSample(modelFramed) < recorded)
+    {
+        addFrame(offset, std::min(modelAudio.size() - offset, windowLength), recorded);
+    }
+
+    if (last)
+    {
+        modelAudio.clear();
+    }
+    else
+    {
+        modelAudio.erase(modelAudio.begin(), modelAudio.begin() + offset);
+    }
+}
+
+void IALLiveLabeler::classify(std::vector<Frame> &frames, bool last)
+{
+    const int chunkLen = classifier->getChunkLen();
+    // the sequence length the collection labels tracks with (see IALAudioFrameCollection::labelAllFrames)
+    const size_t sequenceLength = classifier->getFixedSequenceLength() > 0 ? classifier->getFixedSequenceLength() : 10;
+
+    // the frames that can be reported, in recording order, and where each sequence to classify starts among them
+    std::vector<Frame> ready;
+    std::vector<torch::Tensor> sequences;
+    std::vector<size_t> sequenceStarts;
+
+    auto closeSequence = [&]
+    {
+        if (sequence.empty())
+        {
+            return;
+        }
+
+        // shape (seq, batch, 1, chunkLen), zero-padded like a short last frame of a track
+        torch::Tensor audio = torch::zeros({int64_t(sequence.size()), 1, 1, chunkLen},
+                                           torch::TensorOptions().dtype(torch::kFloat32));
+        float *data = audio.data_ptr<float>();
+        for (size_t i = 0; i < sequence.size(); i++)
+        {
+            std::copy_n(sequence[i].audio.begin(), std::min(sequence[i].audio.size(), size_t(chunkLen)), data + i * chunkLen);
+        }
+
+        sequences.push_back(audio);
+        sequenceStarts.push_back(ready.size());
+        std::move(sequence.begin(), sequence.end(), std::back_inserter(ready));
+        sequence.clear();
+    };
+
+    for (auto &frame : frames)
+    {
+        if (sequence.size() == sequenceLength)
+        {
+            closeSequence();
+        }
+
+        const size_t length = frame.audio.size();
+        double sumSquares = 0;
+        for (float sample : frame.audio)
+        {
+            sumSquares += double(sample) * sample;
+        }
+
+        // silence breaks up the sequences, as it does for a track
+        if (length == 0 || 10 * std::log10(sumSquares / length) <= kSilenceThreshold)
+        {
+            closeSequence();
+            frame.label.classId = ClassificationModel::kSilence;
+            ready.push_back(std::move(frame));
+        }
+        else
+        {
+            sequence.push_back(std::move(frame));
+        }
+    }
+
+    // a sequence that isn't full yet waits for the frames after it, unless there are none
+    if (last || sequence.size() == sequenceLength)
+    {
+        closeSequence();
+    }
+
+    if (!sequences.empty())
+    {
+        // every sequence closed since the last pass goes through the model in one batch
+        std::vector<torch::Tensor> predictions = classifier->predictSequenceBatch(sequences);
+        for (size_t i = 0; i < predictions.size(); i++)
+        {
+            std::vector<int32_t> classIds = classifier->classIdsFromProbits(predictions[i], confidenceThreshold);
+            for (size_t j = 0; j < classIds.size(); j++)
+            {
+                ready[sequenceStarts[i] + j].label.classId = classIds[j];
+            }
+        }
+    }
+
+    frames.swap(ready);
+}
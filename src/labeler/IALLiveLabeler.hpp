@@ -0,0 +1,137 @@
+//
+//  IALLiveLabeler.hpp
+//  Audacity
+//
+
+#ifndef IALLiveLabeler_hpp
+#define IALLiveLabeler_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../SampleFormat.h"
+#include "../WaveTrack.h"
+
+class ClassificationModel;
+class Resample;
+class RingBuffer;
+
+/**
+ @brief The class of one frame of captured audio, and the stretch of the recording that it labels.
+ */
+struct IALLiveLabel
+{
+    // in seconds, on the project's timeline
+    double start;
+    double end;
+    // in samples from the start of the recording, so that consecutive labels can be matched up exactly
+    long long startSample;
+    long long endSample;
+    int32_t classId;
+};
+
+/**
+ @brief Labels audio while it is being recorded.
+ @discussion AudioIO hands every captured buffer to capture() on its buffer thread, which only copies the samples into a
+ ring buffer per channel, allocated up front, so that capture never waits on a lock or on the allocator. All capture
+ channels are labeled together, as one recording. A single task on the worker pool, which lasts the whole recording, takes
+ the samples every channel has, downmixes them, resamples them to the model's rate through one resampler, cuts them into
+ frames (the model's window, its hop apart) and classifies them in order, reporting each one through the label callback, so
+ labels arrive in recording order and never overlap. Frames are classified in the same sequences as when a whole track is
+ labeled: runs of frames up to the model's sequence length, broken by silence. Each frame goes through the model once, when
+ its sequence is complete, so labels lag the recording by up to one sequence. The callbacks are called on a worker thread;
+ it is up to the owner to move them to the main thread (see IALLabeler).
+
+ A live labeler lasts for a single recording. Once the stream has stopped, finish() labels whatever is left over, and the
+ finished callback is called after the last label. If the worker falls so far behind that a ring buffer fills, labeling
+ stops with an error rather than holding up the recording.
+ */
+class IALLiveLabeler : public std::enable_shared_from_this<IALLiveLabeler>
+{
+public:
+    using LabelCallback = std::function<void(const IALLiveLabel &label)>;
+    using FinishedCallback = std::function<void(const std::string &error)>;
+
+    /**
+     @param tracks the capture tracks, one per channel, which give the rate and the number of channels.
+     */
+    IALLiveLabeler(std::shared_ptr<ClassificationModel> classifier, float confidenceThreshold,
+                   const WaveTrackArray &tracks, LabelCallback onLabel, FinishedCallback onFinished);
+    ~IALLiveLabeler();
+
+    IALLiveLabeler(const IALLiveLabeler &) = delete;
+    IALLiveLabeler &operator= (const IALLiveLabeler &) = delete;
+
+    /**
+     @brief Starts the worker. Called on the main thread, once the labeler is owned by a shared_ptr.
+     */
+    void start();
+
+    /**
+     @brief Takes samples that were just appended to one of the capture tracks.
+     @discussion Called on the AudioIO buffer thread, after the append, so that the track's end time includes them.
+     Takes no lock and allocates nothing; it copies the samples into the channel's ring buffer and wakes the worker.
+     */
+    void capture(const WaveTrackArray &tracks, size_t channel, samplePtr buffer, sampleFormat format, size_t len);
+
+    /**
+     @brief Called on the main thread once capture has stopped.
+     @param discard if true, audio that hasn't been classified yet is dropped, e.g. when the recording is thrown away.
+     */
+    void finish(bool discard);
+
+private:
+    struct Frame
+    {
+        IALLiveLabel label;
+        // at the model's rate, at most one window long
+        std::vector<float> audio;
+    };
+
+    void classifyFrames();
+
+    // the rest run on the worker only
+    size_t available() const;
+    void mixDown(std::vector<float> &input);
+    void resample(std::vector<float> &input, bool last);
+    void cutFrames(bool last, std::vector<Frame> &frames);
+    void classify(std::vector<Frame> &frames, bool last);
+    long long recordingSample(long long modelSample) const;
+
+    std::shared_ptr<ClassificationModel> classifier;
+    const float confidenceThreshold;
+    LabelCallback onLabel;
+    FinishedCallback onFinished;
+    const double rate;
+
+    // written by capture() only, read by the worker once the samples they go with are in the ring buffers
+    std::vector<std::unique_ptr<RingBuffer>> rings;
+    double origin = 0;
+    std::atomic<bool> haveOrigin{ false };
+    std::atomic<bool> overrun{ false };
+
+    std::atomic<bool> finishing{ false };
+    std::atomic<bool> discarded{ false };
+    // only for the worker to sleep on; capture() wakes it without taking the mutex
+    std::mutex mutex;
+    std::condition_variable wake;
+
+    // only touched by the worker
+    std::vector<std::vector<float>> channelAudio;
+    // how many samples have been downmixed in all
+    long long recorded = 0;
+    std::unique_ptr<Resample> resampler;
+    // resampled audio that hasn't been cut into frames yet, and how many resampled samples have been labeled before it
+    std::vector<float> modelAudio;
+    long long modelFramed = 0;
+    // the frames since the last silence that haven't made up a whole sequence yet
+    std::vector<Frame> sequence;
+};
+
+#endif /* IALLiveLabeler_hpp */
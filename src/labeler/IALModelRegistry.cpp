@@ -0,0 +1,65 @@
+//
+//  IALModelRegistry.cpp
+//  Audacity
+//
+
+#include "IALModelRegistry.hpp"
+
+#include <wx/filename.h>
+
+/**
+ @brief Cheap identity of the files on disk: modification time and size of each.
+ @discussion The model hash itself is computed from the file contents when the model is loaded; this only tells us
+ whether a loaded model may be out of date, without reading the files again.
+ */
+static std::vector<long long> StampFiles(const std::vector<std::string> &paths)
+{
+    std::vector<long long> stamp;
+    for (const auto &path : paths)
+    {
+        wxFileName fileName(wxString::FromUTF8(path.c_str()));
+        wxDateTime modified = fileName.FileExists() ? fileName.GetModificationTime() : wxDateTime();
+        stamp.push_back(modified.IsValid() ? modified.GetValue().GetValue() : -1);
+        stamp.push_back(fileName.FileExists() ? fileName.GetSize().GetValue() : -1);
+    }
+    return stamp;
+}
+
+IALModelRegistry &IALModelRegistry::Get()
+{
+    static IALModelRegistry registry;
+    return registry;
+}
+
+std::shared_ptr<DeepModel> IALModelRegistry::acquireModel(std::type_index type, const std::string &modelPath,
+                                                         const std::string &classlistPath, const Loader &load)
+{
+    std::shared_ptr<Entry> entry;
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto &slot = entries[Key(type, modelPath, classlistPath)];
+        if (!slot)
+        {
+            slot = std::make_shared<Entry>();
+        }
+        entry = slot;
+    }
+
+    std::lock_guard<std::mutex> guard(entry->loadMutex);
+
+    auto stamp = StampFiles({ modelPath, classlistPath });
+    if (!entry->model || entry->fileStamp != stamp)
+    {
+        // projects still holding the previous version keep it alive until they are done with it
+        entry->model = load();
+        entry->fileStamp = stamp;
+    }
+
+    return entry->model;
+}
+
+void IALModelRegistry::clear()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    entries.clear();
+}
@@ -0,0 +1,82 @@
+//
+//  IALModelRegistry.hpp
+//  Audacity
+//
+
+#ifndef IALModelRegistry_hpp
+#define IALModelRegistry_hpp
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <typeindex>
+#include <vector>
+
+#include "DeepModel.h"
+
+/**
+ @brief A process-wide cache of loaded TorchScript models.
+ @discussion Loading a model takes a few hundred milliseconds, so every project and every separation call shares the
+ same instance instead of reading the file again. Models are keyed by their type and file paths, and an entry is only
+ reused while the model and class list files are unchanged on disk; if either is replaced, the next acquire loads the
+ new version (and so gets a new model hash).
+
+ Models handed out by the registry are shared between threads and must be treated as read-only: any configuration
+ (chunk length, batch size, ...) belongs in the configure callback, which runs once before the model is published.
+ */
+class IALModelRegistry
+{
+public:
+    static IALModelRegistry &Get();
+
+    /**
+     @brief Returns the model at modelPath, loading it if it isn't loaded yet.
+     @param configure called once on a freshly loaded model, before it is shared.
+     @discussion Safe to call from any thread. Concurrent requests for the same model wait for a single load; requests
+     for different models load in parallel. Throws whatever the model's constructor throws if the load fails.
+     */
+    template<typename Model>
+    std::shared_ptr<Model> acquire(const std::string &modelPath, const std::string &classlistPath,
+                                   const std::function<void(Model &)> &configure = {})
+    {
+        auto model = acquireModel(typeid(Model), modelPath, classlistPath, [&]() -> std::shared_ptr<DeepModel>
+        {
+            auto newModel = std::make_shared<Model>(modelPath, classlistPath);
+            if (configure)
+            {
+                configure(*newModel);
+            }
+            return newModel;
+        });
+
+        return std::static_pointer_cast<Model>(model);
+    }
+
+    /**
+     @brief Drops the registry's references, so models are freed once the last user lets go of them.
+     */
+    void clear();
+
+private:
+    using Loader = std::function<std::shared_ptr<DeepModel>()>;
+    using Key = std::tuple<std::type_index, std::string, std::string>;
+
+    struct Entry
+    {
+        // held while loading, so that the same model is never loaded twice at once
+        std::mutex loadMutex;
+        std::shared_ptr<DeepModel> model;
+        std::vector<long long> fileStamp;
+    };
+
+    std::shared_ptr<DeepModel> acquireModel(std::type_index type, const std::string &modelPath,
+                                            const std::string &classlistPath, const Loader &load);
+
+    std::mutex mutex;
+    std::map<Key, std::shared_ptr<Entry>> entries;
+};
+
+#endif /* IALModelRegistry_hpp */
@@ -0,0 +1,75 @@
+//
+//  IALProbitStore.cpp
+//  Audacity
+//
+
+#include "IALProbitStore.hpp"
+
+#include <algorithm>
+
+void IALProbitStore::resize(size_t numFrames)
+{
+    values.resize(numFrames * classes, 0);
+    present.resize(numFrames, false);
+}
+
+void IALProbitStore::clear()
+{
+    classes = 0;
+    values.clear();
+    present.assign(present.size(), false);
+}
+
+void IALProbitStore::set(size_t frame, const torch::Tensor &probits)
+{
+    if (classes == 0)
+    {
+        classes = size_t(probits.numel());
+        values.assign(present.size() * classes, 0);
+    }
+
+    if (frame >= present.size() || size_t(probits.numel()) != classes)
+    {
+        return;
+    }
+
+    torch::Tensor quantised = (probits.reshape({-1}).clamp(0, 1) * 255).round().to(torch::kUInt8).contiguous();
+    const uint8_t *data = quantised.data_ptr<uint8_t>();
+    std::copy(data, data + classes, values.begin() + frame * classes);
+    present[frame] = true;
+}
+
+bool IALProbitStore::get(size_t frame, std::vector<float> &out) const
+{
+    if (!has(frame))
+    {
+        return false;
+    }
+
+    out.resize(classes);
+    const uint8_t *row = values.data() + frame * classes;
+    for (size_t i = 0; i < classes; i++)
+    {
+        out[i] = dequantise(row[i]);
+    }
+    return true;
+}
+
+torch::Tensor IALProbitStore::rows(const std::vector<size_t> &frames) const
+{
+    if (frames.empty() || classes == 0)
+    {
+        return torch::zeros({(int64_t)frames.size(), (int64_t)classes});
+    }
+
+    // the store itself is never copied; from_blob only views it while the rows are gathered
+    torch::Tensor all = torch::from_blob(const_cast<uint8_t *>(values.data()),
+                                         {(int64_t)present.size(), (int64_t)classes},
+                                         torch::TensorOptions().dtype(torch::kUInt8));
+
+    std::vector<int64_t> indices(frames.begin(), frames.end());
+    torch::Tensor index = torch::from_blob(indices.data(), {(int64_t)indices.size()},
+                                           torch::TensorOptions().dtype(torch::kInt64));
+
+    return all.index_select(0, index).to(torch::kFloat32).div_(255.0f);
+}
@@ -0,0 +1,62 @@
+//
+//  IALProbitStore.hpp
+//  Audacity
+//
+
+#ifndef IALProbitStore_hpp
+#define IALProbitStore_hpp
+
+#include <cstdint>
+#include <vector>
+
+#include <torch/script.h>
+
+/**
+ @brief The class probabilities of every frame of a collection, kept at one byte per class.
+ @discussion The classifier's outputs are probabilities in [0, 1], so they are stored as multiples of 1/255. That is finer than
+ any threshold worth setting by hand, and takes a quarter of the memory of floats (with none of the overhead of a tensor per
+ frame), so the probabilities of hours of audio can be kept around. Thresholds, top-k alternatives, coalescing and track names
+ are all derived from the store, so changing any of them never has to run the model again.
+
+ Rows are indexed by the frame's position in the collection. A row that was never set reads as missing.
+ */
+class IALProbitStore
+{
+public:
+    /**
+     @brief Grows or shrinks the store to numFrames rows, keeping the rows that remain.
+     */
+    void resize(size_t numFrames);
+    void clear();
+
+    size_t numClasses() const { return classes; }
+    bool has(size_t frame) const { return frame < present.size() && present[frame]; }
+
+    /**
+     @brief Stores a frame's probabilities.
+     @param probits one value per class. The number of classes is fixed by the first row set after a clear.
+     */
+    void set(size_t frame, const torch::Tensor &probits);
+
+    /**
+     @brief The stored probabilities of a frame, dequantised into out. Returns false if the frame has none.
+     */
+    bool get(size_t frame, std::vector<float> &out) const;
+
+    /**
+     @brief The stored probabilities of the given frames, as a (frames, classes) float tensor.
+     @discussion The frames must all have been set. The rows are gathered and dequantised in one go.
+     */
+    torch::Tensor rows(const std::vector<size_t> &frames) const;
+
+    static float dequantise(uint8_t value) { return value / 255.0f; }
+
+    size_t sizeInBytes() const { return values.size(); }
+
+private:
+    size_t classes = 0;
+    std::vector<uint8_t> values;
+    std::vector<bool> present;
+};
+
+#endif /* IALProbitStore_hpp */
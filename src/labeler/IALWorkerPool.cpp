@@ -0,0 +1,91 @@
+//
+//  IALWorkerPool.cpp
+//  Audacity
+//
+
+#include "IALWorkerPool.hpp"
+
+#include <algorithm>
+#include <exception>
+
+#include <wx/log.h>
+
+#include "../Prefs.h"
+
+IALWorkerPool &IALWorkerPool::Get()
+{
+    static IALWorkerPool pool([]
+    {
+        long numThreads = std::max(1u, std::thread::hardware_concurrency());
+        gPrefs->Read(wxT("/IAL/LabelerThreads"), &numThreads, numThreads);
+        return size_t(std::max(1L, numThreads));
+    }());
+
+    return pool;
+}
+
+IALWorkerPool::IALWorkerPool(size_t numThreads)
+{
+    for (size_t idx = 0; idx < numThreads; idx++)
+    {
+        workers.emplace_back([this]{ workerLoop(); });
+    }
+}
+
+IALWorkerPool::~IALWorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void IALWorkerPool::enqueue(Task task)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        tasks.push_back(std::move(task));
+    }
+    condition.notify_one();
+}
+
+void IALWorkerPool::workerLoop()
+{
+    while (true)
+    {
+        Task task;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this]{ return stopping || !tasks.empty(); });
+
+            // finish whatever was queued before shutting down
+            if (tasks.empty())
+            {
+                return;
+            }
+
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+
+        try
+        {
+            task();
+        }
+        catch (const std::exception &e)
+        {
+            wxLogWarning("IALWorkerPool: task failed: %s", e.what());
+        }
+        catch (...)
+        {
+            wxLogWarning("IALWorkerPool: task failed with an unknown exception");
+        }
+    }
+}
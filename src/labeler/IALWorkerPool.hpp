@@ -0,0 +1,58 @@
+//
+//  IALWorkerPool.hpp
+//  Audacity
+//
+
+#ifndef IALWorkerPool_hpp
+#define IALWorkerPool_hpp
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ @brief A fixed-size pool of threads that runs labeling work off the main thread.
+ @discussion The pool is shared by every project in the process, so that labeling many tracks across many projects
+ is bounded by the number of workers rather than spawning a thread per request. Tasks must not touch any wxWidgets
+ objects; results are handed back to the main thread by the task itself (see IALLabeler).
+ */
+class IALWorkerPool
+{
+public:
+    using Task = std::function<void()>;
+
+    /**
+     @brief Returns the process-wide pool, creating it on first use.
+     @discussion The number of workers is read from the /IAL/LabelerThreads preference, and defaults to the number of hardware threads.
+     */
+    static IALWorkerPool &Get();
+
+    explicit IALWorkerPool(size_t numThreads);
+    ~IALWorkerPool();
+
+    IALWorkerPool(const IALWorkerPool &) = delete;
+    IALWorkerPool &operator= (const IALWorkerPool &) = delete;
+
+    /**
+     @brief Queues a task to be run on the next free worker.
+     @discussion A task must catch its own exceptions and report them to whoever waits on it, since the pool has no
+     way to. Any that still escape are logged and swallowed, so that a single bad task cannot take down a worker.
+     */
+    void enqueue(Task task);
+
+    size_t numThreads() const { return workers.size(); }
+
+private:
+    void workerLoop();
+
+    std::vector<std::thread> workers;
+    std::deque<Task> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+};
+
+#endif /* IALWorkerPool_hpp */
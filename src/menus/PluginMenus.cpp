@@ -4,6 +4,8 @@
 #include "../AudioIO.h"
 #include "../BatchProcessDialog.h"
 #include "../Benchmark.h"
+// IAL: Added for the labeler benchmark
+#include "../labeler/IALBenchmark.hpp"
 #include "../CommonCommandFlags.h"
 #include "../Menus.h"
 #include "../PluginManager.h"
@@ -485,6 +487,14 @@ void OnBenchmark(const CommandContext &context)
    ::RunBenchmark( &window, project);
 }
 
+// IAL: measures labeler throughput, e.g. before rolling out new model weights
+void OnLabelerBenchmark(const CommandContext &context)
+{
+   auto &project = context.project;
+   auto &window = GetProjectFrame( project );
+   ::ShowLabelerBenchmark( &window, project );
+}
+
 void OnSimulateRecordingErrors(const CommandContext &context)
 {
    auto &project = context.project;
@@ -892,7 +902,10 @@ BaseItemSharedPtr ToolsMenu()
          // TODO: What should we do here?  Make benchmark a plug-in?
          // Easy enough to do.  We'd call it mod-self-test.
          Command( wxT("Benchmark"), XXO("&Run Benchmark..."),
-            FN(OnBenchmark), AudioIONotBusyFlag() )
+            FN(OnBenchmark), AudioIONotBusyFlag() ),
+         // IAL
+         Command( wxT("LabelerBenchmark"), XXO("Run &Labeler Benchmark..."),
+            FN(OnLabelerBenchmark), AudioIONotBusyFlag() )
    //#endif
       ),
 
@@ -40,6 +40,7 @@ Paul Licameli split from TrackPanel.cpp
 
 #include <wx/combobox.h>
 #include <wx/frame.h>
+#include <wx/numdlg.h>
 #include <wx/sizer.h>
 
 // IAL: Added for the TrackLabeler
@@ -131,6 +132,9 @@ enum {
 
    //IAL: Labeler IDs
    IALLabelerID,
+   IALCancelLabelingID,
+   IALRelabelID,
+   IALFindSimilarID,
    IALSeparatorID,
 
    ChannelMenuID,
@@ -523,6 +527,9 @@ struct WaveTrackMenuTable
 
    // IAL Labeler
    void OnIALLabeler(wxCommandEvent & event);
+   void OnIALCancelLabeling(wxCommandEvent & event);
+   void OnIALRelabel(wxCommandEvent & event);
+   void OnIALFindSimilar(wxCommandEvent & event);
    void OnIALSeparator(wxCommandEvent & event);
 
    void OnMultiView(wxCommandEvent & event);
@@ -655,6 +662,25 @@ BEGIN_POPUP_MENU(WaveTrackMenuTable)
         []( PopupMenuHandler &handler, wxMenu &menu, int id ){
            menu.Enable( id, true );
         });
+      AppendItem("Cancel Labeling", IALCancelLabelingID, XXO("&Cancel Labeling"),
+        POPUP_MENU_FN( OnIALCancelLabeling ),
+        []( PopupMenuHandler &handler, wxMenu &menu, int id ){
+           auto &project =
+              static_cast< WaveTrackMenuTable& >( handler ).mpData->project;
+           menu.Enable( id, IALLabeler::Get( project ).isLabeling() );
+        });
+      AppendItem("Relabel at Threshold", IALRelabelID, XXO("&Relabel at Threshold..."),
+        POPUP_MENU_FN( OnIALRelabel ),
+        []( PopupMenuHandler &handler, wxMenu &menu, int id ){
+           menu.Enable( id, true );
+        });
+      AppendItem("Find Similar Audio", IALFindSimilarID, XXO("&Find Similar Audio"),
+        POPUP_MENU_FN( OnIALFindSimilar ),
+        []( PopupMenuHandler &handler, wxMenu &menu, int id ){
+           auto &project =
+              static_cast< WaveTrackMenuTable& >( handler ).mpData->project;
+           menu.Enable( id, IALLabeler::Get( project ).canFindSimilar() );
+        });
       AppendItem("Separate Track", IALSeparatorID, XXO("&Separate Track"),
         POPUP_MENU_FN( OnIALSeparator ),
         []( PopupMenuHandler &handler, wxMenu &menu, int id ){
@@ -750,34 +776,64 @@ void WaveTrackMenuTable::OnIALLabeler(wxCommandEvent & event)
    mpData->result = RefreshAll | FixScrollbars;
 
    // we DO want to rearrange the tracks here
+   // labeling runs in the background; the labeler pushes the undo state
+   // when the labels arrive
    IALLabeler::Get(mpData->project).labelTrack(pTrack, true);
+}
+
+// IAL Labeler
+void WaveTrackMenuTable::OnIALCancelLabeling(wxCommandEvent & event)
+{
+   IALLabeler::Get(mpData->project).cancelLabeling();
+}
+
+// IAL Labeler
+void WaveTrackMenuTable::OnIALRelabel(wxCommandEvent & event)
+{
+   WaveTrack *const pTrack = static_cast<WaveTrack*>(mpData->pTrack);
 
-   TranslatableString longDesc = XO("Labeled '%s' Track");
-   TranslatableString shortDesc = XO("Label '%s' Track");
+   long threshold = wxGetNumberFromUser(_("Label frames below this confidence (%) as not-sure:"),
+      _("Confidence threshold"),
+      _("Relabel at Threshold"),
+      (long)(IALLabeler::confidenceThreshold() * 100.0 + 0.5),
+      0,
+      100);
+   if (threshold < 0)
+      return;
 
-   longDesc.Format(pTrack->GetName());
+   using namespace RefreshCode;
+   mpData->result = RefreshAll | FixScrollbars;
 
-   ProjectHistory::Get( mpData->project ).PushState(longDesc, shortDesc);
+   // frames that were labeled before are reclassified from their stored
+   // probabilities, without running the model again
+   IALLabeler::setConfidenceThreshold(threshold / 100.0f);
+   IALLabeler::Get(mpData->project).labelTrack(pTrack, false);
 }
 
 // IAL Labeler
-void WaveTrackMenuTable::OnIALSeparator(wxCommandEvent & event)
+void WaveTrackMenuTable::OnIALFindSimilar(wxCommandEvent & event)
 {
    WaveTrack *const pTrack = static_cast<WaveTrack*>(mpData->pTrack);
-   AudacityProject *const project = &mpData->project;
 
    using namespace RefreshCode;
    mpData->result = RefreshAll | FixScrollbars;
 
-   // we DO want to rearrange the tracks here
-   IALLabeler::Get(mpData->project).separateTrack(pTrack);
+   // searches the embeddings stored when the tracks were labeled; the
+   // labeler adds the matches as a label track and pushes the undo state
+   IALLabeler::Get(mpData->project).findSimilar(pTrack);
+}
 
-   TranslatableString longDesc = XO("Separated '%s' Track");
-   TranslatableString shortDesc = XO("Separated '%s' Track");
+// IAL Labeler
+void WaveTrackMenuTable::OnIALSeparator(wxCommandEvent & event)
+{
+   WaveTrack *const pTrack = static_cast<WaveTrack*>(mpData->pTrack);
+   AudacityProject *const project = &mpData->project;
 
-   longDesc.Format(pTrack->GetName());
+   using namespace RefreshCode;
+   mpData->result = RefreshAll | FixScrollbars;
 
-   ProjectHistory::Get( mpData->project ).PushState(longDesc, shortDesc);
+   // the labeler pushes the undo state once the sources have been added
+   IALLabeler::Get(mpData->project).separateTrack(pTrack);
 }
 
 void WaveTrackMenuTable::OnMultiView(wxCommandEvent & event)
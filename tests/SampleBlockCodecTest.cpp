@@ -0,0 +1,248 @@
+// The asserts are the test, so keep them in optimised builds too
+#undef NDEBUG
+
+#include "SampleBlockCodec.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// Round trips samples of one format through SampleBlockCodec, checking every
+// bit of every sample, as well as the sample count in the header
+class SampleBlockCodecTest
+{
+private:
+   // More than one chunk of the codec, and not a whole number of them
+   enum { dataLen = 3 * 4096 + 1234 };
+
+   std::vector<int16_t> mInt16Data;
+   std::vector<int32_t> mInt24Data;
+   std::vector<float> mFloatData;
+
+   static float FloatFromBits(uint32_t bits)
+   {
+      float value;
+      memcpy(&value, &bits, sizeof(value));
+      return value;
+   }
+
+   static bool RoundTrips(const void *data, size_t numsamples, sampleFormat format)
+   {
+      std::vector<char> encoded;
+      if (!SampleBlockCodec::Encode((constSamplePtr)data, numsamples, format, encoded))
+         return false;
+
+      assert(encoded.size() < numsamples * SAMPLE_SIZE(format));
+      const size_t count = SampleBlockCodec::DecodedSampleCount(encoded.data(), encoded.size());
+      assert(count == numsamples);
+
+      std::vector<char> decoded(numsamples * SAMPLE_SIZE(format));
+      const bool decodedOk = SampleBlockCodec::Decode(encoded.data(), encoded.size(), format,
+                                                      (samplePtr)decoded.data(), numsamples);
+      assert(decodedOk);
+
+      // Compare bits, not values, so that NaN payloads and -0 count too
+      assert(memcmp(decoded.data(), data, decoded.size()) == 0);
+      return true;
+   }
+
+public:
+   SampleBlockCodecTest()
+   {
+      std::cout << "==> Testing SampleBlockCodec\n";
+      srand(1234);
+   }
+
+   void SetUp()
+   {
+      mInt16Data.resize(dataLen);
+      mInt24Data.resize(dataLen);
+      mFloatData.resize(dataLen);
+
+      for (int i = 0; i < dataLen; i++)
+      {
+         const double tone = 0.5 * sin(i * 0.01) + 0.00001 * (rand() % 100);
+         mInt16Data[i] = (int16_t)(tone * 32767);
+         mInt24Data[i] = (int32_t)(tone * 8388607);
+         mFloatData[i] = (float)tone;
+      }
+   }
+
+   void TearDown()
+   {
+      mInt16Data.clear();
+      mInt24Data.clear();
+      mFloatData.clear();
+   }
+
+   void TestInt16()
+   {
+      std::cout << "\tint16 samples should decode to exactly what was encoded..." << std::flush;
+
+      // Both extremes, next to each other
+      mInt16Data[100] = 32767;
+      mInt16Data[101] = -32768;
+
+      const bool ok = RoundTrips(mInt16Data.data(), dataLen, int16Sample);
+      assert(ok);
+
+      std::cout << "ok\n";
+   }
+
+   void TestInt24()
+   {
+      std::cout << "\tint24 samples should decode to exactly what was encoded..." << std::flush;
+
+      mInt24Data[100] = 8388607;
+      mInt24Data[101] = -8388608;
+
+      const bool ok = RoundTrips(mInt24Data.data(), dataLen, int24Sample);
+      assert(ok);
+
+      std::cout << "ok\n";
+   }
+
+   void TestFloat()
+   {
+      std::cout << "\tfloat samples, including NaNs and denormals, should keep every bit..." << std::flush;
+
+      const uint32_t specials[] = {
+         0x7fc00000, // quiet NaN
+         0x7fc00001, // NaN with a payload
+         0xffffffff, // negative NaN
+         0x7f800001, // signalling NaN
+         0x7f800000, // infinity
+         0xff800000, // negative infinity
+         0x00000001, // smallest denormal
+         0x807fffff, // largest negative denormal
+         0x80000000, // negative zero
+         0x7f7fffff, // largest finite
+      };
+
+      int i = 500;
+      for (auto bits : specials)
+      {
+         mFloatData[i] = FloatFromBits(bits);
+         i += 37;
+      }
+
+      const bool ok = RoundTrips(mFloatData.data(), dataLen, floatSample);
+      assert(ok);
+
+      std::cout << "ok\n";
+   }
+
+   void TestEscape()
+   {
+      std::cout << "\tresiduals too large for the Rice code should be escaped..." << std::flush;
+
+      // Smooth audio, so the Rice parameter stays small, with lone spikes
+      // from one extreme to the other that no predictor can follow
+      for (int i = 1000; i < dataLen; i += 1000)
+      {
+         mInt16Data[i] = (i / 1000) % 2 ? 32767 : -32768;
+         mInt24Data[i] = (i / 1000) % 2 ? 8388607 : -8388608;
+         mFloatData[i] = FloatFromBits((i / 1000) % 2 ? 0x7fffffff : 0xffffffff);
+      }
+
+      const bool int16Ok = RoundTrips(mInt16Data.data(), dataLen, int16Sample);
+      const bool int24Ok = RoundTrips(mInt24Data.data(), dataLen, int24Sample);
+      const bool floatOk = RoundTrips(mFloatData.data(), dataLen, floatSample);
+      assert(int16Ok && int24Ok && floatOk);
+
+      std::cout << "ok\n";
+   }
+
+   void TestShortBlocks()
+   {
+      std::cout << "\tblocks that don't compress should be refused..." << std::flush;
+
+      std::vector<char> encoded;
+
+      // Nothing to encode
+      bool encodedOk = SampleBlockCodec::Encode((constSamplePtr)mInt16Data.data(), 0, int16Sample, encoded);
+      assert(!encodedOk);
+
+      // The header alone is bigger than one sample
+      encodedOk = SampleBlockCodec::Encode((constSamplePtr)mFloatData.data(), 1, floatSample, encoded);
+      assert(!encodedOk);
+
+      // Noise doesn't compress
+      std::vector<int32_t> noise(dataLen);
+      for (auto &sample : noise)
+         sample = int32_t((unsigned(rand()) << 16) ^ unsigned(rand()));
+      encodedOk = SampleBlockCodec::Encode((constSamplePtr)noise.data(), dataLen, floatSample, encoded);
+      assert(!encodedOk);
+
+      std::cout << "ok\n";
+   }
+
+   void TestDamagedBlobs()
+   {
+      std::cout << "\tdamaged blobs should be rejected, not decoded..." << std::flush;
+
+      std::vector<char> encoded;
+      const bool encodedOk = SampleBlockCodec::Encode((constSamplePtr)mInt16Data.data(), dataLen, int16Sample, encoded);
+      assert(encodedOk);
+
+      std::vector<int16_t> decoded(dataLen);
+
+      // A header that is too short, or isn't ours
+      size_t count = SampleBlockCodec::DecodedSampleCount(encoded.data(), SampleBlockCodec::HeaderBytes - 1);
+      assert(count == 0);
+      std::vector<char> foreign(encoded);
+      foreign[0] = 'X';
+      count = SampleBlockCodec::DecodedSampleCount(foreign.data(), foreign.size());
+      assert(count == 0);
+      bool decodedOk = SampleBlockCodec::Decode(foreign.data(), foreign.size(), int16Sample,
+                                                (samplePtr)decoded.data(), dataLen);
+      assert(!decodedOk);
+
+      // Asking for another number of samples than the header holds
+      decodedOk = SampleBlockCodec::Decode(encoded.data(), encoded.size(), int16Sample,
+                                           (samplePtr)decoded.data(), dataLen - 1);
+      assert(!decodedOk);
+
+      // Cut off half way
+      decodedOk = SampleBlockCodec::Decode(encoded.data(), encoded.size() / 2, int16Sample,
+                                           (samplePtr)decoded.data(), dataLen);
+      assert(!decodedOk);
+
+      std::cout << "ok\n";
+   }
+};
+
+int main()
+{
+   SampleBlockCodecTest tester;
+
+   tester.SetUp();
+   tester.TestInt16();
+   tester.TearDown();
+
+   tester.SetUp();
+   tester.TestInt24();
+   tester.TearDown();
+
+   tester.SetUp();
+   tester.TestFloat();
+   tester.TearDown();
+
+   tester.SetUp();
+   tester.TestEscape();
+   tester.TearDown();
+
+   tester.SetUp();
+   tester.TestShortBlocks();
+   tester.TearDown();
+
+   tester.SetUp();
+   tester.TestDamagedBlobs();
+   tester.TearDown();
+
+   return 0;
+}